@@ -0,0 +1,196 @@
+#include <stdlib.h>
+#include <errno.h>
+
+#include "alloc.h"
+#include "stats.h"
+
+#define WORD_BITS 64
+#define ALL_TAKEN (~(uint64_t) 0)
+
+static void
+mark_summary(alloc_map* map, long word) {
+  uint64_t bit = (uint64_t) 1 << (word % WORD_BITS);
+  if (map->words[word] == ALL_TAKEN) {
+    map->summary[word / WORD_BITS] |= bit;
+  }
+  else {
+    map->summary[word / WORD_BITS] &= ~bit;
+  }
+}
+
+// The bitmap is laid out as bytes, bit i lives in byte i / 8, which on a
+// little endian machine is the same bit of the 64 bit word i / 64.
+void
+alloc_map_init(alloc_map* map, void* bitmap, long bits, uint32_t* hint) {
+  alloc_map_free(map);
+  pthread_mutex_init(&map->lock, 0);
+  map->words = bitmap;
+  map->bits = bits;
+  map->numWords = (bits + WORD_BITS - 1) / WORD_BITS;
+  map->summaryWords = (map->numWords + WORD_BITS - 1) / WORD_BITS;
+  map->summary = calloc(map->summaryWords, sizeof(uint64_t));
+  map->hint = hint;
+  if (bits % WORD_BITS) {
+    // Bits past the end are never free, that way scans stop on their own
+    map->words[map->numWords - 1] |= ALL_TAKEN << (bits % WORD_BITS);
+  }
+  if (map->numWords % WORD_BITS) {
+    map->summary[map->summaryWords - 1] |= ALL_TAKEN << (map->numWords % WORD_BITS);
+  }
+  map->freeCount = 0;
+  for (long i = 0; i < map->numWords; ++i) {
+    map->freeCount += WORD_BITS - __builtin_popcountll(map->words[i]);
+    mark_summary(map, i);
+  }
+  if (*map->hint >= bits) {
+    *map->hint = 0;
+  }
+}
+
+void
+alloc_map_free(alloc_map* map) {
+  if (map->summary) {
+    pthread_mutex_destroy(&map->lock);
+  }
+  free(map->summary);
+  map->summary = 0;
+}
+
+static int
+test_bit(alloc_map* map, long bit) {
+  return (map->words[bit / WORD_BITS] >> (bit % WORD_BITS)) & 1;
+}
+
+static void
+set_bit(alloc_map* map, long bit) {
+  if (test_bit(map, bit)) {
+    return;
+  }
+  map->words[bit / WORD_BITS] |= (uint64_t) 1 << (bit % WORD_BITS);
+  mark_summary(map, bit / WORD_BITS);
+  --map->freeCount;
+}
+
+static void
+clear_bit(alloc_map* map, long bit) {
+  if (!test_bit(map, bit)) {
+    return;
+  }
+  map->words[bit / WORD_BITS] &= ~((uint64_t) 1 << (bit % WORD_BITS));
+  mark_summary(map, bit / WORD_BITS);
+  ++map->freeCount;
+}
+
+int
+alloc_test(alloc_map* map, long bit) {
+  pthread_mutex_lock(&map->lock);
+  int taken = test_bit(map, bit);
+  pthread_mutex_unlock(&map->lock);
+  return taken;
+}
+
+void
+alloc_set(alloc_map* map, long bit) {
+  pthread_mutex_lock(&map->lock);
+  set_bit(map, bit);
+  pthread_mutex_unlock(&map->lock);
+}
+
+void
+alloc_clear(alloc_map* map, long bit) {
+  alloc_clear_run(map, bit, 1);
+}
+
+void
+alloc_clear_run(alloc_map* map, long start, long count) {
+  pthread_mutex_lock(&map->lock);
+  for (long i = start; i < start + count; ++i) {
+    clear_bit(map, i);
+  }
+  pthread_mutex_unlock(&map->lock);
+}
+
+// First word at or after word that still has a free bit, or -1
+static long
+find_free_word(alloc_map* map, long word) {
+  long index = word / WORD_BITS;
+  if (index >= map->summaryWords) {
+    return -1;
+  }
+  long start = index;
+  uint64_t open = ~map->summary[index] & (ALL_TAKEN << (word % WORD_BITS));
+  while (!open) {
+    if (++index >= map->summaryWords) {
+      stats_add(STAT_ALLOC_WORDS_SCANNED, index - start);
+      return -1;
+    }
+    open = ~map->summary[index];
+  }
+  stats_add(STAT_ALLOC_WORDS_SCANNED, index - start + 1);
+  return index * WORD_BITS + __builtin_ctzll(open);
+}
+
+static long
+find_bit(alloc_map* map, long goal) {
+  if (map->freeCount == 0) {
+    return -ENOSPC;
+  }
+  if (goal < 0 || goal >= map->bits) {
+    goal = 0;
+  }
+  long word = goal / WORD_BITS;
+  uint64_t open = ~map->words[word] & (ALL_TAKEN << (goal % WORD_BITS));
+  if (open) {
+    return word * WORD_BITS + __builtin_ctzll(open);
+  }
+  word = find_free_word(map, word + 1);
+  if (word < 0) {
+    word = find_free_word(map, 0);
+  }
+  if (word < 0) {
+    return -ENOSPC;
+  }
+  return word * WORD_BITS + __builtin_ctzll(~map->words[word]);
+}
+
+// Returns the first free bit at or after goal, wrapping around to the
+// start if there is nothing past it. Nothing is claimed.
+long
+alloc_find(alloc_map* map, long goal) {
+  pthread_mutex_lock(&map->lock);
+  long bit = find_bit(map, goal);
+  pthread_mutex_unlock(&map->lock);
+  return bit;
+}
+
+// Claims up to want free bits in a row, starting from the first free one
+// at or after goal (or the hint when goal is negative). Returns where the
+// run starts and sets got to how long it turned out to be.
+long
+alloc_run(alloc_map* map, long goal, long want, long* got) {
+  stats_add(STAT_ALLOC_CALLS, 1);
+  pthread_mutex_lock(&map->lock);
+  long start = find_bit(map, (goal < 0) ? *map->hint : goal);
+  if (start < 0) {
+    pthread_mutex_unlock(&map->lock);
+    return start;
+  }
+  long end = start + 1;
+  while (end - start < want && end < map->bits) {
+    uint64_t taken = map->words[end / WORD_BITS] >> (end % WORD_BITS);
+    if (taken & 1) {
+      break;
+    }
+    end += taken ? __builtin_ctzll(taken) : WORD_BITS - end % WORD_BITS;
+  }
+  if (end - start > want) {
+    end = start + want;
+  }
+  for (long i = start; i < end; ++i) {
+    set_bit(map, i);
+  }
+  *map->hint = (end < map->bits) ? end : 0;
+  *got = end - start;
+  pthread_mutex_unlock(&map->lock);
+  return start;
+}
@@ -0,0 +1,41 @@
+#ifndef ALLOC_H
+#define ALLOC_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+/*
+ Hands out bits from one of the on disk bitmaps (a set bit is taken).
+
+ The bitmap is scanned a 64 bit word at a time. On top of it sits an in
+ memory summary with one bit per bitmap word, set while that word is
+ completely full, so a single summary word skips 4096 taken bits. The
+ search starts from a hint kept in the superblock, which is left just
+ past the last thing handed out, so filling up an image doesn't rescan
+ everything in front of it on every allocation.
+
+ Every call takes the map's own lock, so a map can be shared between
+ threads as it is.
+*/
+
+typedef struct alloc_map {
+  uint64_t* words;
+  long bits;
+  long numWords;
+  uint64_t* summary;
+  long summaryWords;
+  uint32_t* hint;
+  long freeCount;
+  pthread_mutex_t lock;
+} alloc_map;
+
+void alloc_map_init(alloc_map* map, void* bitmap, long bits, uint32_t* hint);
+void alloc_map_free(alloc_map* map);
+int alloc_test(alloc_map* map, long bit);
+void alloc_set(alloc_map* map, long bit);
+void alloc_clear(alloc_map* map, long bit);
+void alloc_clear_run(alloc_map* map, long start, long count);
+long alloc_find(alloc_map* map, long goal);
+long alloc_run(alloc_map* map, long goal, long want, long* got);
+
+#endif
@@ -0,0 +1,125 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "arena.h"
+
+typedef struct arena_chunk {
+  struct arena_chunk* next;
+  long index;
+  size_t size;
+  size_t used;
+  char data[];
+} arena_chunk;
+
+typedef struct arena {
+  arena_chunk* first;
+  arena_chunk* current;
+} arena;
+
+static __thread arena* threadArena;
+static pthread_key_t arenaKey;
+static pthread_once_t arenaOnce = PTHREAD_ONCE_INIT;
+
+static void
+free_arena(void* arg) {
+  arena* area = arg;
+  arena_chunk* chunk = area->first;
+  while (chunk) {
+    arena_chunk* next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+  free(area);
+}
+
+static void
+init_key() {
+  pthread_key_create(&arenaKey, free_arena);
+}
+
+static arena_chunk*
+new_chunk(size_t size, long index) {
+  arena_chunk* chunk = malloc(sizeof(arena_chunk) + size);
+  chunk->next = 0;
+  chunk->index = index;
+  chunk->size = size;
+  chunk->used = 0;
+  return chunk;
+}
+
+// This thread's arena, its chunks are freed when the thread exits
+static arena*
+get_arena() {
+  if (!threadArena) {
+    pthread_once(&arenaOnce, init_key);
+    threadArena = malloc(sizeof(arena));
+    threadArena->first = new_chunk(ARENA_CHUNK, 0);
+    threadArena->current = threadArena->first;
+    pthread_setspecific(arenaKey, threadArena);
+  }
+  return threadArena;
+}
+
+void*
+arena_alloc(size_t size) {
+  arena* area = get_arena();
+  size = (size + 15) & ~(size_t) 15;
+  arena_chunk* chunk = area->current;
+  while (chunk->used + size > chunk->size) {
+    if (!chunk->next) {
+      // Too big for a standard chunk gets one to itself, it stays on the
+      // list and gets reused like the rest
+      chunk->next = new_chunk((size > ARENA_CHUNK) ? size : ARENA_CHUNK, chunk->index + 1);
+    }
+    else if (chunk->next->size < size) {
+      arena_chunk* bigger = new_chunk(size, chunk->index + 1);
+      bigger->next = chunk->next->next;
+      free(chunk->next);
+      chunk->next = bigger;
+    }
+    chunk = chunk->next;
+    chunk->used = 0;
+  }
+  area->current = chunk;
+  void* memory = &chunk->data[chunk->used];
+  chunk->used += size;
+  return memory;
+}
+
+char*
+arena_strndup(const char* string, size_t len) {
+  char* copy = arena_alloc(len + 1);
+  memcpy(copy, string, len);
+  copy[len] = 0;
+  return copy;
+}
+
+arena_mark
+arena_save() {
+  arena* area = get_arena();
+  arena_mark mark = {area->current->index, area->current->used};
+  return mark;
+}
+
+void
+arena_release(arena_mark mark) {
+  arena* area = get_arena();
+  arena_chunk* current = area->current;
+  if (mark.chunk > current->index ||
+      (mark.chunk == current->index && mark.used >= current->used)) {
+    return;
+  }
+  arena_chunk* chunk = area->first;
+  while (chunk->index < mark.chunk) {
+    chunk = chunk->next;
+  }
+  chunk->used = mark.used;
+  area->current = chunk;
+}
+
+void
+arena_reset() {
+  arena_mark start = {0, 0};
+  arena_release(start);
+}
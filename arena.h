@@ -0,0 +1,32 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/*
+ Bump allocator for temporaries that only live as long as one request.
+ Every thread has its own, so nothing is locked. Memory comes out of
+ chunks that are kept from one request to the next, so once a thread
+ has warmed up a request doesn't call malloc at all.
+
+ arena_reset hands everything back in one go and is meant for the end
+ of a FUSE callback. Code that can't know whether it is inside one
+ saves a mark first and releases back to it when done. Releasing to a
+ mark older than one already released is fine, releasing to one that
+ was already released past does nothing.
+*/
+
+#define ARENA_CHUNK (256 * 1024)
+
+typedef struct arena_mark {
+  long chunk;
+  size_t used;
+} arena_mark;
+
+void* arena_alloc(size_t size);
+char* arena_strndup(const char* string, size_t len);
+arena_mark arena_save();
+void arena_release(arena_mark mark);
+void arena_reset();
+
+#endif
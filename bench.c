@@ -0,0 +1,315 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "storage.h"
+#include "stats.h"
+
+/*
+ Micro-benchmarks for storage, run straight against a scratch image
+ without FUSE or a mount in the way:
+
+   ./nufs-bench [-i image] [-f filter]
+
+ Every result is one line of key=value pairs, e.g.
+
+   bench=lookup dir_size=1000 ops=1000 ns_per_op=412.3 ops_per_s=2425400
+
+ with bytes_per_s added for reads and writes, so runs can be diffed or
+ fed to a script. -f only runs benchmarks whose name contains filter.
+ The image is reformatted between groups and removed at the end.
+*/
+
+#define BENCH_IMAGE_SIZE (1024L * 1024 * 1024)
+#define BENCH_BLOCK_SIZE 4096
+#define BENCH_INODES 65536
+// Small files are gone over again until at least this much has moved
+#define BENCH_MIN_BYTES (64L * 1024 * 1024)
+
+static const char* image = "bench.nufs";
+static const char* filter = 0;
+static uint64_t seed = 0x9e3779b97f4a7c15;
+
+static const long dirSizes[] = {100, 1000, 10000};
+static const long fileSizes[] = {64 * 1024, 1024 * 1024, 64 * 1024 * 1024};
+static const long ioSizes[] = {4096, 64 * 1024, 1024 * 1024};
+
+static uint64_t
+next_random() {
+  seed ^= seed << 13;
+  seed ^= seed >> 7;
+  seed ^= seed << 17;
+  return seed;
+}
+
+static int
+wanted(const char* name) {
+  return !filter || strstr(name, filter);
+}
+
+static void
+report(const char* name, const char* params, long ops, long bytes, long ns) {
+  if (ns <= 0) {
+    ns = 1;
+  }
+  printf("bench=%s %s ops=%ld ns_per_op=%.1f ops_per_s=%.0f", name, params, ops,
+         (double) ns / ops, ops * 1e9 / ns);
+  if (bytes) {
+    printf(" bytes_per_s=%.0f", bytes * 1e9 / ns);
+  }
+  printf("\n");
+  fflush(stdout);
+}
+
+static void
+fresh_image() {
+  if (storage_format(image, BENCH_IMAGE_SIZE, BENCH_BLOCK_SIZE, BENCH_INODES) < 0 ||
+      storage_init(image) < 0) {
+    fprintf(stderr, "bench: can't make an image at %s\n", image);
+    exit(1);
+  }
+}
+
+static void
+check(long rv, const char* what) {
+  if (rv < 0) {
+    fprintf(stderr, "bench: %s failed: %s\n", what, strerror(-rv));
+    exit(1);
+  }
+}
+
+static void
+shuffle(long* order, long count) {
+  for (long i = 0; i < count; ++i) {
+    order[i] = i;
+  }
+  for (long i = count - 1; i > 0; --i) {
+    long j = next_random() % (i + 1);
+    long swap = order[i];
+    order[i] = order[j];
+    order[j] = swap;
+  }
+}
+
+static int
+count_entry(void* context, const char* name, long inodeId, int type, long next) {
+  ++*(long*) context;
+  return 0;
+}
+
+// create, lookup, stat, readdir and unlink on a directory of size files
+static void
+bench_directory(long size) {
+  char name[64];
+  char params[64];
+  struct stat st;
+  long* order = malloc(size * sizeof(long));
+  snprintf(params, sizeof(params), "dir_size=%ld", size);
+  fresh_image();
+  check(create_dir_inode("/d", 0755), "mkdir");
+
+  long start = stats_now();
+  for (long i = 0; i < size; ++i) {
+    snprintf(name, sizeof(name), "/d/file%ld", i);
+    check(get_new_inode(name, S_IFREG | 0644, 0), "create");
+  }
+  if (wanted("create")) {
+    report("create", params, size, 0, stats_now() - start);
+  }
+  storage_commit();
+
+  shuffle(order, size);
+  start = stats_now();
+  for (long i = 0; i < size; ++i) {
+    snprintf(name, sizeof(name), "/d/file%ld", order[i]);
+    check((long) get_inode(name), "lookup");
+  }
+  if (wanted("lookup")) {
+    report("lookup", params, size, 0, stats_now() - start);
+  }
+
+  start = stats_now();
+  for (long i = 0; i < size; ++i) {
+    snprintf(name, sizeof(name), "/d/file%ld", order[i]);
+    check(get_stat(name, &st), "stat");
+  }
+  if (wanted("stat")) {
+    report("stat", params, size, 0, stats_now() - start);
+  }
+
+  if (wanted("readdir")) {
+    long dirId = lookup_inode_at(-1, "d");
+    check(dirId, "lookup");
+    long entries = 0;
+    start = stats_now();
+    while (entries < 100000) {
+      check(list_dir_at(dirId, 0, count_entry, &entries), "readdir");
+    }
+    report("readdir", params, entries, 0, stats_now() - start);
+    forget_inode(dirId, 1);
+  }
+
+  shuffle(order, size);
+  start = stats_now();
+  for (long i = 0; i < size; ++i) {
+    snprintf(name, sizeof(name), "/d/file%ld", order[i]);
+    check(inode_unlink(name), "unlink");
+  }
+  if (wanted("unlink")) {
+    report("unlink", params, size, 0, stats_now() - start);
+  }
+  storage_commit();
+  free(order);
+}
+
+// Sequential and random reads and writes of ioSize on a fileSize file,
+// the sequential writes starting from an empty file each pass
+static void
+bench_io(long fileSize, long ioSize) {
+  char params[96];
+  snprintf(params, sizeof(params), "file_size=%ld io_size=%ld", fileSize, ioSize);
+  fresh_image();
+  check(get_new_inode("/f", S_IFREG | 0644, 0), "create");
+  open_file* fh = open_handle("/f");
+  check((long) fh, "open");
+  char* buf = malloc(ioSize);
+  memset(buf, 'b', ioSize);
+  long perPass = fileSize / ioSize;
+  long passes = (BENCH_MIN_BYTES + fileSize - 1) / fileSize;
+  long ops = perPass * passes;
+  long bytes = ops * ioSize;
+
+  long elapsed = 0;
+  for (long pass = 0; pass < passes; ++pass) {
+    check(truncate_handle(fh, 0), "truncate");
+    storage_commit();
+    long start = stats_now();
+    for (long i = 0; i < perPass; ++i) {
+      check(write_handle(fh, buf, ioSize, i * ioSize), "write");
+    }
+    elapsed += stats_now() - start;
+  }
+  if (wanted("seq_write")) {
+    report("seq_write", params, ops, bytes, elapsed);
+  }
+  storage_commit();
+
+  long start = stats_now();
+  for (long pass = 0; pass < passes; ++pass) {
+    for (long i = 0; i < perPass; ++i) {
+      check(read_handle(fh, buf, ioSize, i * ioSize), "read");
+    }
+  }
+  if (wanted("seq_read")) {
+    report("seq_read", params, ops, bytes, stats_now() - start);
+  }
+
+  start = stats_now();
+  for (long i = 0; i < ops; ++i) {
+    check(read_handle(fh, buf, ioSize, (next_random() % perPass) * ioSize), "read");
+  }
+  if (wanted("rand_read")) {
+    report("rand_read", params, ops, bytes, stats_now() - start);
+  }
+
+  start = stats_now();
+  for (long i = 0; i < ops; ++i) {
+    check(write_handle(fh, buf, ioSize, (next_random() % perPass) * ioSize), "write");
+  }
+  if (wanted("rand_write")) {
+    report("rand_write", params, ops, bytes, stats_now() - start);
+  }
+  storage_commit();
+  release_handle(fh);
+  free(buf);
+}
+
+// Filling a file up to fileSize and truncating it back to nothing, only
+// the truncates are timed
+static void
+bench_truncate(long fileSize) {
+  char params[64];
+  snprintf(params, sizeof(params), "file_size=%ld", fileSize);
+  fresh_image();
+  check(get_new_inode("/t", S_IFREG | 0644, 0), "create");
+  open_file* fh = open_handle("/t");
+  check((long) fh, "open");
+  long ioSize = (fileSize < 1024 * 1024) ? fileSize : 1024 * 1024;
+  char* buf = malloc(ioSize);
+  memset(buf, 't', ioSize);
+  long ops = (BENCH_MIN_BYTES / 4 + fileSize - 1) / fileSize;
+  if (ops < 4) {
+    ops = 4;
+  }
+  long elapsed = 0;
+  for (long i = 0; i < ops; ++i) {
+    for (long offset = 0; offset < fileSize; offset += ioSize) {
+      check(write_handle(fh, buf, ioSize, offset), "write");
+    }
+    long start = stats_now();
+    check(truncate_handle(fh, 0), "truncate");
+    elapsed += stats_now() - start;
+    // Freed blocks only come back once the truncate is committed
+    storage_commit();
+  }
+  report("truncate", params, ops, 0, elapsed);
+  release_handle(fh);
+  free(buf);
+}
+
+static int
+wants_any(const char** names, int count) {
+  for (int i = 0; i < count; ++i) {
+    if (wanted(names[i])) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int
+main(int argc, char* argv[]) {
+  int opt;
+  while ((opt = getopt(argc, argv, "i:f:")) != -1) {
+    switch (opt) {
+    case 'i':
+      image = optarg;
+      break;
+    case 'f':
+      filter = optarg;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-i image] [-f filter]\n", argv[0]);
+      return 1;
+    }
+  }
+  // Commits only happen where a benchmark asks for one
+  storage_set_durability(DURABILITY_NONE, 0);
+
+  const char* dirBenches[] = {"create", "lookup", "stat", "readdir", "unlink"};
+  if (wants_any(dirBenches, 5)) {
+    for (size_t i = 0; i < sizeof(dirSizes) / sizeof(dirSizes[0]); ++i) {
+      bench_directory(dirSizes[i]);
+    }
+  }
+  const char* ioBenches[] = {"seq_write", "seq_read", "rand_read", "rand_write"};
+  if (wants_any(ioBenches, 4)) {
+    for (size_t i = 0; i < sizeof(fileSizes) / sizeof(fileSizes[0]); ++i) {
+      for (size_t j = 0; j < sizeof(ioSizes) / sizeof(ioSizes[0]); ++j) {
+        if (ioSizes[j] <= fileSizes[i]) {
+          bench_io(fileSizes[i], ioSizes[j]);
+        }
+      }
+    }
+  }
+  if (wanted("truncate")) {
+    for (size_t i = 0; i < sizeof(fileSizes) / sizeof(fileSizes[0]); ++i) {
+      bench_truncate(fileSizes[i]);
+    }
+  }
+  unlink(image);
+  return 0;
+}
@@ -0,0 +1,503 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <signal.h>
+#include <pthread.h>
+#include <libgen.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "stats.h"
+
+/*
+ End to end benchmarks through a real mount, so everything between the
+ syscall and the image is counted:
+
+   ./nufs-bench-fuse [-d mountpoint] [-i image] [-o nufs options]
+                     [-j threads] [-n scale] [-f filter] [-S]
+
+ Formats a fresh image with mkfs.nufs, mounts it with ./nufs -f, runs
+ the workloads against the mountpoint and unmounts again, even when a
+ workload fails. -o is handed to nufs, so modes can be compared with
+ e.g. -o durability=fsync or -o direct_io. -n multiplies every
+ workload's size and -S prints /.nufs/stats before unmounting.
+
+ Each result is one line of key=value pairs, with throughput and the
+ latency percentiles of the single syscall being measured:
+
+   bench=stat threads=1 ops=2000 seconds=0.011 ops_per_s=181818
+     p50_ns=4608 p90_ns=5888 p99_ns=9215 p999_ns=30719 max_ns=41210
+*/
+
+#define SMALL_FILES 2000
+#define SEQ_FILE_SIZE (256L * 1024 * 1024)
+#define SEQ_IO_SIZE (1024 * 1024)
+#define RAND_FILE_SIZE (64L * 1024 * 1024)
+#define RAND_IO_SIZE 4096
+#define RAND_OPS 20000
+#define TREE_DEPTH 4
+#define TREE_FANOUT 5
+#define TREE_FILES 4
+#define PARALLEL_OPS 5000
+
+static const char* mountpoint = "mnt";
+static const char* image = "bench-fuse.nufs";
+static const char* nufsOptions = 0;
+static const char* filter = 0;
+static int threads = 4;
+static long scale = 1;
+static int showStats = 0;
+static pid_t server = -1;
+
+typedef struct workload {
+  const char* name;
+  latency_histogram hist;
+  long ops;
+  long bytes;
+  long start;
+  long end;
+} workload;
+
+static int
+wanted(const char* name) {
+  return !filter || strstr(name, filter);
+}
+
+static void
+check(long rv, const char* what) {
+  if (rv < 0) {
+    fprintf(stderr, "bench-fuse: %s failed: %s\n", what, strerror(errno));
+    exit(1);
+  }
+}
+
+static void
+path_of(char* path, size_t size, const char* name) {
+  snprintf(path, size, "%s/%s", mountpoint, name);
+}
+
+static void
+begin(workload* work, const char* name) {
+  memset(work, 0, sizeof(workload));
+  work->name = name;
+  work->hist.name = name;
+  work->start = stats_now();
+}
+
+// Times one call into work, counting bytes towards its throughput
+#define TIMED_CALL(work, call, size) \
+  do { \
+    long callStart = stats_now(); \
+    check((call), #call); \
+    histogram_record(&(work)->hist, stats_now() - callStart); \
+    __atomic_add_fetch(&(work)->ops, 1, __ATOMIC_RELAXED); \
+    __atomic_add_fetch(&(work)->bytes, (size), __ATOMIC_RELAXED); \
+  } while (0)
+
+static void
+report(workload* work, int threadCount) {
+  if (!work->end) {
+    work->end = stats_now();
+  }
+  double seconds = (work->end - work->start) / 1e9;
+  if (seconds <= 0) {
+    seconds = 1e-9;
+  }
+  latency_histogram* hist = &work->hist;
+  printf("bench=%s threads=%d ops=%ld seconds=%.3f ops_per_s=%.0f", work->name,
+         threadCount, work->ops, seconds, work->ops / seconds);
+  if (work->bytes) {
+    printf(" bytes_per_s=%.0f", work->bytes / seconds);
+  }
+  printf(" p50_ns=%ld p90_ns=%ld p99_ns=%ld p999_ns=%ld max_ns=%ld\n",
+         histogram_percentile(hist, 50), histogram_percentile(hist, 90),
+         histogram_percentile(hist, 99), histogram_percentile(hist, 99.9), hist->maxNs);
+  fflush(stdout);
+}
+
+static uint64_t
+next_random(uint64_t* seed) {
+  *seed ^= *seed << 13;
+  *seed ^= *seed >> 7;
+  *seed ^= *seed << 17;
+  return *seed;
+}
+
+// Writes size bytes of file name in ioSize pieces, untimed
+static void
+fill_file(const char* name, long size, long ioSize) {
+  char path[4096];
+  path_of(path, sizeof(path), name);
+  char* buf = malloc(ioSize);
+  memset(buf, 'f', ioSize);
+  int fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+  check(fd, "open");
+  for (long offset = 0; offset < size; offset += ioSize) {
+    check(pwrite(fd, buf, ioSize, offset), "pwrite");
+  }
+  check(close(fd), "close");
+  free(buf);
+}
+
+// So reads have to come from nufs rather than the kernel's page cache
+static void
+drop_cache(const char* name) {
+  char path[4096];
+  path_of(path, sizeof(path), name);
+  int fd = open(path, O_RDONLY);
+  check(fd, "open");
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+}
+
+static void
+bench_small_files() {
+  char path[4096];
+  struct stat st;
+  workload work;
+  long count = SMALL_FILES * scale;
+  path_of(path, sizeof(path), "small");
+  check(mkdir(path, 0755), "mkdir");
+
+  begin(&work, "create");
+  for (long i = 0; i < count; ++i) {
+    snprintf(path, sizeof(path), "%s/small/file%ld", mountpoint, i);
+    int fd;
+    TIMED_CALL(&work, fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 0644), 0);
+    close(fd);
+  }
+  report(&work, 1);
+
+  begin(&work, "stat");
+  for (long i = 0; i < count; ++i) {
+    snprintf(path, sizeof(path), "%s/small/file%ld", mountpoint, i);
+    TIMED_CALL(&work, stat(path, &st), 0);
+  }
+  report(&work, 1);
+
+  begin(&work, "unlink");
+  for (long i = 0; i < count; ++i) {
+    snprintf(path, sizeof(path), "%s/small/file%ld", mountpoint, i);
+    TIMED_CALL(&work, unlink(path), 0);
+  }
+  report(&work, 1);
+}
+
+static void
+bench_sequential() {
+  char path[4096];
+  workload work;
+  long size = SEQ_FILE_SIZE * scale;
+  char* buf = malloc(SEQ_IO_SIZE);
+  memset(buf, 's', SEQ_IO_SIZE);
+  path_of(path, sizeof(path), "seq");
+
+  int fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+  check(fd, "open");
+  begin(&work, "seq_write");
+  for (long offset = 0; offset < size; offset += SEQ_IO_SIZE) {
+    TIMED_CALL(&work, write(fd, buf, SEQ_IO_SIZE), SEQ_IO_SIZE);
+  }
+  // Only done once it's all on the image
+  check(fsync(fd), "fsync");
+  work.end = stats_now();
+  check(close(fd), "close");
+  report(&work, 1);
+
+  drop_cache("seq");
+  fd = open(path, O_RDONLY);
+  check(fd, "open");
+  begin(&work, "seq_read");
+  for (long offset = 0; offset < size; offset += SEQ_IO_SIZE) {
+    TIMED_CALL(&work, read(fd, buf, SEQ_IO_SIZE), SEQ_IO_SIZE);
+  }
+  close(fd);
+  report(&work, 1);
+  free(buf);
+}
+
+static void
+bench_random() {
+  char path[4096];
+  char buf[RAND_IO_SIZE];
+  workload work;
+  uint64_t seed = 0x9e3779b97f4a7c15;
+  long blocks = RAND_FILE_SIZE / RAND_IO_SIZE;
+  long ops = RAND_OPS * scale;
+  fill_file("rand", RAND_FILE_SIZE, SEQ_IO_SIZE);
+  drop_cache("rand");
+  path_of(path, sizeof(path), "rand");
+  int fd = open(path, O_RDWR);
+  check(fd, "open");
+
+  begin(&work, "rand_read_4k");
+  for (long i = 0; i < ops; ++i) {
+    off_t offset = (next_random(&seed) % blocks) * RAND_IO_SIZE;
+    TIMED_CALL(&work, pread(fd, buf, RAND_IO_SIZE, offset), RAND_IO_SIZE);
+  }
+  report(&work, 1);
+
+  memset(buf, 'r', sizeof(buf));
+  begin(&work, "rand_write_4k");
+  for (long i = 0; i < ops; ++i) {
+    off_t offset = (next_random(&seed) % blocks) * RAND_IO_SIZE;
+    TIMED_CALL(&work, pwrite(fd, buf, RAND_IO_SIZE, offset), RAND_IO_SIZE);
+  }
+  report(&work, 1);
+  close(fd);
+}
+
+static void
+make_tree(char* path, int depth) {
+  size_t len = strlen(path);
+  if (depth == TREE_DEPTH) {
+    for (int i = 0; i < TREE_FILES; ++i) {
+      snprintf(path + len, 4096 - len, "/f%d", i);
+      int fd = open(path, O_CREAT | O_WRONLY, 0644);
+      check(fd, "open");
+      close(fd);
+    }
+    path[len] = 0;
+    return;
+  }
+  for (int i = 0; i < TREE_FANOUT; ++i) {
+    snprintf(path + len, 4096 - len, "/d%d", i);
+    check(mkdir(path, 0755), "mkdir");
+    make_tree(path, depth + 1);
+  }
+  path[len] = 0;
+}
+
+// Lists every directory and stats everything in it, like find or du.
+// The stats are what is timed.
+static void
+walk_tree(char* path, workload* work) {
+  DIR* dir = opendir(path);
+  if (!dir) {
+    check(-1, "opendir");
+  }
+  size_t len = strlen(path);
+  struct dirent* entry;
+  while ((entry = readdir(dir))) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+      continue;
+    }
+    struct stat st;
+    snprintf(path + len, 4096 - len, "/%s", entry->d_name);
+    TIMED_CALL(work, lstat(path, &st), 0);
+    if (S_ISDIR(st.st_mode)) {
+      walk_tree(path, work);
+    }
+    path[len] = 0;
+  }
+  closedir(dir);
+}
+
+static void
+bench_tree() {
+  char path[4096];
+  workload work;
+  path_of(path, sizeof(path), "tree");
+  check(mkdir(path, 0755), "mkdir");
+  for (long i = 0; i < scale; ++i) {
+    snprintf(path, sizeof(path), "%s/tree/t%ld", mountpoint, i);
+    check(mkdir(path, 0755), "mkdir");
+    make_tree(path, 0);
+  }
+  path_of(path, sizeof(path), "tree");
+  begin(&work, "tree_walk");
+  walk_tree(path, &work);
+  report(&work, 1);
+}
+
+typedef struct reader {
+  workload* work;
+  int fd;
+  uint64_t seed;
+} reader;
+
+static void*
+read_randomly(void* arg) {
+  reader* self = arg;
+  char buf[RAND_IO_SIZE];
+  long blocks = SEQ_FILE_SIZE * scale / RAND_IO_SIZE;
+  for (long i = 0; i < PARALLEL_OPS * scale; ++i) {
+    off_t offset = (next_random(&self->seed) % blocks) * RAND_IO_SIZE;
+    TIMED_CALL(self->work, pread(self->fd, buf, RAND_IO_SIZE, offset), RAND_IO_SIZE);
+  }
+  return 0;
+}
+
+// threads readers at once, each with its own descriptor, going at
+// random over the sequential benchmark's file
+static void
+bench_parallel() {
+  char path[4096];
+  workload work;
+  struct stat st;
+  path_of(path, sizeof(path), "seq");
+  if (stat(path, &st) < 0) {
+    fill_file("seq", SEQ_FILE_SIZE * scale, SEQ_IO_SIZE);
+  }
+  drop_cache("seq");
+  reader* readers = calloc(threads, sizeof(reader));
+  pthread_t* ids = calloc(threads, sizeof(pthread_t));
+  begin(&work, "parallel_read_4k");
+  for (int i = 0; i < threads; ++i) {
+    readers[i].work = &work;
+    readers[i].fd = open(path, O_RDONLY);
+    check(readers[i].fd, "open");
+    readers[i].seed = 0x9e3779b97f4a7c15 + i;
+    pthread_create(&ids[i], 0, read_randomly, &readers[i]);
+  }
+  for (int i = 0; i < threads; ++i) {
+    pthread_join(ids[i], 0);
+    close(readers[i].fd);
+  }
+  work.end = stats_now();
+  report(&work, threads);
+  free(readers);
+  free(ids);
+}
+
+static void
+print_stats() {
+  char path[4096];
+  char line[1024];
+  path_of(path, sizeof(path), ".nufs/stats");
+  FILE* file = fopen(path, "r");
+  if (!file) {
+    return;
+  }
+  while (fgets(line, sizeof(line), file)) {
+    printf("# %s", line);
+  }
+  fclose(file);
+}
+
+static int
+is_mounted() {
+  struct stat mount;
+  struct stat parent;
+  char parentPath[4096];
+  snprintf(parentPath, sizeof(parentPath), "%s", mountpoint);
+  return stat(mountpoint, &mount) == 0 &&
+    stat(dirname(parentPath), &parent) == 0 && mount.st_dev != parent.st_dev;
+}
+
+static void
+unmount() {
+  if (server <= 0) {
+    return;
+  }
+  char command[4096];
+  snprintf(command, sizeof(command), "fusermount -u %s", mountpoint);
+  if (system(command) != 0) {
+    kill(server, SIGTERM);
+  }
+  waitpid(server, 0, 0);
+  server = -1;
+  unlink(image);
+}
+
+static void
+mount_image() {
+  char command[4096];
+  long size = (SEQ_FILE_SIZE + RAND_FILE_SIZE) * scale * 2 + (256L << 20);
+  snprintf(command, sizeof(command), "./mkfs.nufs -s %ldK -i 65536 %s > /dev/null",
+           size / 1024, image);
+  if (system(command) != 0) {
+    fprintf(stderr, "bench-fuse: %s failed\n", command);
+    exit(1);
+  }
+  mkdir(mountpoint, 0755);
+  server = fork();
+  check(server, "fork");
+  if (server == 0) {
+    if (nufsOptions) {
+      execl("./nufs", "nufs", "-f", "-o", nufsOptions, mountpoint, image, (char*) 0);
+    }
+    else {
+      execl("./nufs", "nufs", "-f", mountpoint, image, (char*) 0);
+    }
+    perror("bench-fuse: ./nufs");
+    _exit(1);
+  }
+  atexit(unmount);
+  for (int i = 0; i < 100 && !is_mounted(); ++i) {
+    if (waitpid(server, 0, WNOHANG) == server) {
+      server = -1;
+      fprintf(stderr, "bench-fuse: nufs exited before mounting\n");
+      exit(1);
+    }
+    usleep(100 * 1000);
+  }
+  if (!is_mounted()) {
+    fprintf(stderr, "bench-fuse: %s didn't get mounted\n", mountpoint);
+    exit(1);
+  }
+}
+
+int
+main(int argc, char* argv[]) {
+  int opt;
+  while ((opt = getopt(argc, argv, "d:i:o:j:n:f:S")) != -1) {
+    switch (opt) {
+    case 'd':
+      mountpoint = optarg;
+      break;
+    case 'i':
+      image = optarg;
+      break;
+    case 'o':
+      nufsOptions = optarg;
+      break;
+    case 'j':
+      threads = atoi(optarg);
+      break;
+    case 'n':
+      scale = atol(optarg);
+      break;
+    case 'f':
+      filter = optarg;
+      break;
+    case 'S':
+      showStats = 1;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-d mountpoint] [-i image] [-o nufs options] "
+              "[-j threads] [-n scale] [-f filter] [-S]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (threads < 1 || scale < 1) {
+    fprintf(stderr, "bench-fuse: -j and -n must be at least 1\n");
+    return 1;
+  }
+  mount_image();
+  if (wanted("small") || wanted("create") || wanted("stat") || wanted("unlink")) {
+    bench_small_files();
+  }
+  if (wanted("seq")) {
+    bench_sequential();
+  }
+  if (wanted("rand")) {
+    bench_random();
+  }
+  if (wanted("tree")) {
+    bench_tree();
+  }
+  if (wanted("parallel")) {
+    bench_parallel();
+  }
+  if (showStats) {
+    print_stats();
+  }
+  unmount();
+  return 0;
+}
@@ -0,0 +1,118 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "dcache.h"
+#include "directory.h"
+
+typedef struct dcache_slot {
+  int32_t parentId;
+  int32_t childId;
+  uint32_t generation;
+  uint32_t hash;
+  uint8_t valid;
+  uint8_t nameLen;
+  char name[DCACHE_NAME_MAX];
+} dcache_slot;
+
+static dcache_slot slots[DCACHE_SLOTS];
+static pthread_mutex_t stripes[DCACHE_STRIPES];
+// Indexed by inode id + 1 so root (-1) gets slot 0
+static uint32_t* generations;
+static long generationCount;
+
+static uint32_t
+slot_hash(long parentId, const char* name, size_t len) {
+  return dir_hash(name, len) ^ ((uint32_t) parentId * 2654435761u);
+}
+
+static uint32_t
+generation_of(long inodeId) {
+  if (inodeId + 1 < 0 || inodeId + 1 >= generationCount) {
+    return 0;
+  }
+  return __atomic_load_n(&generations[inodeId + 1], __ATOMIC_ACQUIRE);
+}
+
+static pthread_mutex_t*
+stripe_of(uint32_t hash) {
+  return &stripes[(hash % DCACHE_SLOTS) % DCACHE_STRIPES];
+}
+
+void
+dcache_init(long inodeCount) {
+  memset(slots, 0, sizeof(slots));
+  for (int i = 0; i < DCACHE_STRIPES; ++i) {
+    pthread_mutex_init(&stripes[i], 0);
+  }
+  free(generations);
+  generationCount = inodeCount + 1;
+  generations = calloc(generationCount, sizeof(uint32_t));
+}
+
+static dcache_slot*
+find_slot(long parentId, const char* name, size_t len, uint32_t hash) {
+  dcache_slot* slot = &slots[hash % DCACHE_SLOTS];
+  if (slot->valid && slot->hash == hash && slot->parentId == parentId &&
+      slot->generation == generation_of(parentId) &&
+      slot->nameLen == len && memcmp(slot->name, name, len) == 0) {
+    return slot;
+  }
+  return 0;
+}
+
+int
+dcache_lookup(long parentId, const char* name, size_t len, long* childId) {
+  if (len > DCACHE_NAME_MAX) {
+    return 0;
+  }
+  uint32_t hash = slot_hash(parentId, name, len);
+  pthread_mutex_lock(stripe_of(hash));
+  dcache_slot* slot = find_slot(parentId, name, len, hash);
+  if (slot) {
+    *childId = slot->childId;
+  }
+  pthread_mutex_unlock(stripe_of(hash));
+  return slot != 0;
+}
+
+void
+dcache_add(long parentId, const char* name, size_t len, long childId) {
+  if (len > DCACHE_NAME_MAX) {
+    // Long names just don't get cached
+    return;
+  }
+  uint32_t hash = slot_hash(parentId, name, len);
+  pthread_mutex_lock(stripe_of(hash));
+  dcache_slot* slot = &slots[hash % DCACHE_SLOTS];
+  slot->parentId = parentId;
+  slot->childId = childId;
+  slot->generation = generation_of(parentId);
+  slot->hash = hash;
+  slot->nameLen = len;
+  memcpy(slot->name, name, len);
+  slot->valid = 1;
+  pthread_mutex_unlock(stripe_of(hash));
+}
+
+void
+dcache_invalidate(long parentId, const char* name, size_t len) {
+  if (len > DCACHE_NAME_MAX) {
+    return;
+  }
+  uint32_t hash = slot_hash(parentId, name, len);
+  pthread_mutex_lock(stripe_of(hash));
+  dcache_slot* slot = find_slot(parentId, name, len, hash);
+  if (slot) {
+    slot->valid = 0;
+  }
+  pthread_mutex_unlock(stripe_of(hash));
+}
+
+void
+dcache_forget_inode(long inodeId) {
+  if (inodeId + 1 >= 0 && inodeId + 1 < generationCount) {
+    __atomic_add_fetch(&generations[inodeId + 1], 1, __ATOMIC_RELEASE);
+  }
+}
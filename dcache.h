@@ -0,0 +1,31 @@
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#include <stddef.h>
+
+/*
+ Dentry cache, remembers which child inode a (parent inode, name) pair
+ resolved to so path walks don't have to go back to the directory
+ blocks. Names that weren't found are cached too (as -ENOENT) so repeated
+ misses are just as cheap.
+
+ It's a direct mapped table: a colliding insert replaces whatever was
+ in the slot. Entries remember the generation of their parent, dropping
+ an inode bumps its generation which throws away everything cached under
+ it in one go.
+
+ Slots are guarded by a fixed set of striped locks, so lookups from
+ different threads only contend when they land on the same stripe.
+*/
+
+#define DCACHE_SLOTS 8192
+#define DCACHE_NAME_MAX 55
+#define DCACHE_STRIPES 64
+
+void dcache_init(long inodeCount);
+int dcache_lookup(long parentId, const char* name, size_t len, long* childId);
+void dcache_add(long parentId, const char* name, size_t len, long childId);
+void dcache_invalidate(long parentId, const char* name, size_t len);
+void dcache_forget_inode(long inodeId);
+
+#endif
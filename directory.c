@@ -4,178 +4,611 @@
 #include <stdio.h>
 #include <errno.h>
 #include <assert.h>
+#include <dirent.h>
 #include "directory.h"
+#include "arena.h"
 
-char*
-smart_cat(char* str1, char* str2) {
-    if (!str2) {
-        return str1;
-    }
-    if (!str1) {
-        str1 = malloc(sizeof(char) * (strlen(str2) + 1));
-        return str1;
-    }
-    char* outString = malloc(strlen(str1) + strlen(str2) + 1);
-    memcpy(outString, str1, strlen(str1));
-    memcpy(outString + strlen(str1), str2, strlen(str2));
-    outString[strlen(str1) + strlen(str2)] = 0;
-    return outString;
-}
-
-char* num_to_string(long number) {
-    int isNegative = number < 0;
-    if (isNegative) {
-      number = -number;
-    }
-    int n = snprintf(NULL, 0, "%lu", number) + 1;
-    char* numBuf = malloc(sizeof(char) * n);
-    snprintf(numBuf, n, "%lu", number);
-    if (isNegative) {
-      char* output = malloc(2 * sizeof(char));
-      output[0] = '-';
-      output[1] = 0;
-      output = smart_cat(output, numBuf);
-      free(numBuf);
-      return output;
+#define ALIGN4(x) (((x) + 3) & ~3)
+
+uint32_t
+dir_hash(const char* name, size_t len) {
+    // FNV-1a, cheap and good enough to spread names over the buckets
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= (unsigned char) name[i];
+        hash *= 16777619u;
     }
-    else {
-      return numBuf;
+    return hash;
+}
+
+uint32_t
+dir_minor_hash(const char* name, size_t len) {
+    // djb2, unrelated to FNV so names that collide in one rarely do in both
+    uint32_t hash = 5381;
+    for (size_t i = 0; i < len; ++i) {
+        hash = hash * 33 + (unsigned char) name[i];
     }
+    return hash & ((1u << DIR_MINOR_BITS) - 1);
 }
 
-directory*
-create_directory(char* name, long inodeId, long pnum) {
-    directory* dir = malloc(sizeof(directory));
-    dir->pnum = pnum;
-    dir->inodeId = inodeId;
-    dir->paths = 0;
-    add_file(dir, name, inodeId);
-    return dir;
+static uint32_t
+entry_size(size_t nameLen) {
+    return ALIGN4(sizeof(dir_entry) + nameLen);
 }
 
-char*
-get_file_start(directory* dir) {
-    char* start = strstr(dir->paths, "/");
-    int haveSeenBackslash = 0;
-    while (start && (*start == '/' ||
-                     (isdigit(*start) && !haveSeenBackslash) ||
-                     *start == '-' ||
-                     *start == '\\')) {
-        if (*start == '\\') {
-          haveSeenBackslash = 1;
-        }
-        ++start;
+static uint32_t
+first_entry_offset(const dir_block* header) {
+    return ALIGN4(sizeof(dir_block) + header->numBuckets * sizeof(uint32_t));
+}
+
+static dir_entry*
+entry_at(const void* block, uint32_t offset) {
+    return (dir_entry*) ((byte*) block + offset);
+}
+
+void
+dir_block_init(void* block, size_t size, long inodeId, long pnum) {
+    dir_block* header = block;
+    memset(block, 0, size);
+    header->magic = DIR_MAGIC;
+    header->inodeId = inodeId;
+    header->pnum = pnum;
+    header->size = size;
+    header->numBuckets = size / DIR_BUCKET_BYTES;
+    if (header->numBuckets == 0) {
+        header->numBuckets = 1;
     }
-    if (*start) {
-      return start;
+    header->count = 0;
+    header->dead = 0;
+    header->used = first_entry_offset(header);
+}
+
+int
+dir_block_is_valid(const void* block) {
+    return block && ((const dir_block*) block)->magic == DIR_MAGIC;
+}
+
+const dir_entry*
+dir_block_find(const void* block, const char* name, size_t len) {
+    const dir_block* header = block;
+    uint32_t hash = dir_hash(name, len);
+    uint32_t offset = header->buckets[hash % header->numBuckets];
+    while (offset) {
+        const dir_entry* entry = entry_at(block, offset);
+        if (entry->hash == hash && entry->nameLen == len &&
+            memcmp(entry->name, name, len) == 0) {
+            return entry;
+        }
+        offset = entry->next;
     }
-    else {
-      return 0;
+    return 0;
+}
+
+// Whether a different name already has both of this one's hashes
+static int
+hashes_taken(const void* block, const char* name, size_t len) {
+    const dir_block* header = block;
+    uint32_t hash = dir_hash(name, len);
+    uint32_t minor = 0;
+    int haveMinor = 0;
+    uint32_t offset = header->buckets[hash % header->numBuckets];
+    while (offset) {
+        const dir_entry* entry = entry_at(block, offset);
+        if (entry->hash == hash) {
+            if (!haveMinor) {
+                minor = dir_minor_hash(name, len);
+                haveMinor = 1;
+            }
+            if (dir_minor_hash(entry->name, entry->nameLen) == minor) {
+                return 1;
+            }
+        }
+        offset = entry->next;
     }
+    return 0;
+}
+
+long
+dir_block_lookup(const void* block, const char* name, size_t len) {
+    const dir_entry* entry = dir_block_find(block, name, len);
+    return entry ? entry->inodeId : -ENOENT;
 }
 
 int
-add_file(directory* dir, char* name, long inodeId) {
-    if (isdigit(*name)) {
-        name = smart_cat("\\", name);
+dir_block_insert(void* block, const char* name, size_t len, long inodeId, int type) {
+    dir_block* header = block;
+    if (len == 0 || len > DIR_NAME_MAX) {
+        return -ENAMETOOLONG;
     }
-    if (dir->paths) {
-        dir->paths = smart_cat(dir->paths, name);
+    if (dir_block_find(block, name, len) || hashes_taken(block, name, len)) {
+        return -EEXIST;
     }
-    else {
-        int len = strlen(name);
-        dir->paths = malloc((len + 1) * sizeof(char));
-        strcpy(dir->paths, name);
-    }
-    dir->paths = smart_cat(dir->paths, "/");
-    char* numBuf = num_to_string(inodeId);
-    dir->paths = smart_cat(dir->paths, numBuf);
-    free(numBuf);
+    uint32_t needed = entry_size(len);
+    if (header->used + needed > header->size) {
+        if (header->used - header->dead + needed > header->size) {
+            return -ENOSPC;
+        }
+        dir_block_compact(block);
+    }
+    uint32_t hash = dir_hash(name, len);
+    uint32_t bucket = hash % header->numBuckets;
+    dir_entry* entry = entry_at(block, header->used);
+    entry->inodeId = inodeId;
+    entry->hash = hash;
+    entry->type = type;
+    entry->nameLen = len;
+    memcpy(entry->name, name, len);
+    entry->next = header->buckets[bucket];
+    header->buckets[bucket] = header->used;
+    header->used += needed;
+    ++header->count;
     return 0;
 }
 
-char*
-get_name(directory* dir) {
-    char* start = get_file_start(dir);
-    if (!start) {
-      return 0;
+long
+dir_block_remove(void* block, const char* name, size_t len) {
+    dir_block* header = block;
+    uint32_t hash = dir_hash(name, len);
+    uint32_t* link = &header->buckets[hash % header->numBuckets];
+    while (*link) {
+        uint32_t offset = *link;
+        dir_entry* entry = entry_at(block, offset);
+        if (entry->hash == hash && entry->nameLen == len &&
+            memcmp(entry->name, name, len) == 0) {
+            long inodeId = entry->inodeId;
+            uint32_t size = entry_size(entry->nameLen);
+            *link = entry->next;
+            --header->count;
+            if (offset + size == header->used) {
+                // Last record, just pull the end back
+                header->used = offset;
+            }
+            else {
+                // Leave a hole that gets squeezed out by the next compaction,
+                // children always have real ids so -1 marks it dead
+                entry->inodeId = -1;
+                entry->next = 0;
+                header->dead += size;
+            }
+            return inodeId;
+        }
+        link = &entry->next;
     }
-    char* firstSlash = strstr(start, "/");
-    long length = firstSlash - start;
-    char* name = malloc(sizeof(char) * (length + 1));
-    strncpy(name, start, length);
-    name[length] = 0;
-    return name;
+    return -ENOENT;
 }
 
 void
-remove_file(directory* dir, char* name) {
-    char* start = get_file_start(dir);
-    if (!start) {
-      return;
-    }
-    char* location = strstr(start, name);
-    if (location != NULL) {
-        int index = location - start;
-        int slashSeen = 0;
-        while (start[index] && (!slashSeen || isdigit(start[index]))) {
-            if (start[index] == '/') {
-               slashSeen = 1;
+dir_block_compact(void* block) {
+    dir_block* header = block;
+    uint32_t readOffset = first_entry_offset(header);
+    uint32_t writeOffset = readOffset;
+    memset(header->buckets, 0, header->numBuckets * sizeof(uint32_t));
+    while (readOffset < header->used) {
+        dir_entry* entry = entry_at(block, readOffset);
+        uint32_t size = entry_size(entry->nameLen);
+        if (entry->inodeId >= 0) {
+            if (writeOffset != readOffset) {
+                memmove(entry_at(block, writeOffset), entry, size);
             }
-            start[index] = 0;
-            ++index;
-            location = &start[index];
+            dir_entry* moved = entry_at(block, writeOffset);
+            uint32_t bucket = moved->hash % header->numBuckets;
+            moved->next = header->buckets[bucket];
+            header->buckets[bucket] = writeOffset;
+            writeOffset += size;
+        }
+        readOffset += size;
+    }
+    header->used = writeOffset;
+    header->dead = 0;
+}
+
+const dir_entry*
+dir_block_next(const void* block, uint32_t* cursor) {
+    const dir_block* header = block;
+    if (*cursor < first_entry_offset(header)) {
+        *cursor = first_entry_offset(header);
+    }
+    while (*cursor < header->used) {
+        const dir_entry* entry = entry_at(block, *cursor);
+        *cursor += entry_size(entry->nameLen);
+        if (entry->inodeId >= 0) {
+            return entry;
         }
-        strcat(start, location);
     }
+    return 0;
+}
+
+static int
+is_index(const void* block) {
+    return block && ((const dir_index*) block)->magic == DIR_INDEX_MAGIC;
+}
+
+int
+dir_is_valid(const void* block) {
+    return dir_block_is_valid(block) || is_index(block);
 }
 
+// Turns block into an empty index, keeping the directory's ids from its
+// header, whichever kind of block it was before
+static void
+index_init(void* block, size_t size) {
+    const dir_block* old = block;
+    long inodeId = old->inodeId;
+    long pnum = old->pnum;
+    dir_index* index = block;
+    memset(block, 0, size);
+    index->magic = DIR_INDEX_MAGIC;
+    index->inodeId = inodeId;
+    index->pnum = pnum;
+    index->size = size;
+    index->count = 0;
+    index->max = (size - sizeof(dir_index)) / sizeof(dir_index_entry);
+}
+
+// Last entry at or below hash, the first covers everything before the second
+static int
+find_index(const dir_index* index, uint32_t hash) {
+    int low = 1;
+    int high = index->count - 1;
+    int found = 0;
+    while (low <= high) {
+        int mid = (low + high) / 2;
+        if (index->entries[mid].hash <= hash) {
+            found = mid;
+            low = mid + 1;
+        }
+        else {
+            high = mid - 1;
+        }
+    }
+    return found;
+}
+
+static void
+index_insert(dir_index* index, uint32_t hash, long blockIndex) {
+    int slot = (index->count > 0) ? find_index(index, hash) + 1 : 0;
+    memmove(&index->entries[slot + 1], &index->entries[slot],
+            (index->count - slot) * sizeof(dir_index_entry));
+    index->entries[slot].hash = hash;
+    index->entries[slot].block = blockIndex;
+    ++index->count;
+}
+
+// The index blocks passed through on the way to a hash's leaf, root first
+typedef struct dir_path {
+    long index[DIR_INDEX_LEVELS];
+    int levels;
+    long leaf;
+    const void* leafBlock;
+} dir_path;
+
+static int
+walk_index(dir_store* store, uint32_t hash, dir_path* path) {
+    long blockIndex = 0;
+    const void* block = store->view(store->context, 0);
+    path->levels = 0;
+    while (is_index(block)) {
+        if (path->levels == DIR_INDEX_LEVELS) {
+            return -EIO;
+        }
+        const dir_index* index = block;
+        path->index[path->levels++] = blockIndex;
+        blockIndex = index->entries[find_index(index, hash)].block;
+        block = store->view(store->context, blockIndex);
+    }
+    if (!dir_block_is_valid(block)) {
+        return -EIO;
+    }
+    path->leaf = blockIndex;
+    path->leafBlock = block;
+    return 0;
+}
+
+// The leaf holding hash, with *end set to the first hash past the ones it
+// holds, or past the top of the hash space for the last leaf. Carrying on
+// from *end goes through every leaf once in hash order.
 long
-get_file_inode(directory* dir, char* name) {
-    char* start = get_file_start(dir);
-    assert(name);
-    if (!start) {
-        return -ENOENT;
+dir_leaf_for(dir_store* store, uint32_t hash, uint64_t* end) {
+    long blockIndex = 0;
+    const void* block = store->view(store->context, 0);
+    *end = (uint64_t) UINT32_MAX + 1;
+    for (int levels = 0; is_index(block); ++levels) {
+        if (levels == DIR_INDEX_LEVELS) {
+            return -EIO;
+        }
+        const dir_index* index = block;
+        int slot = find_index(index, hash);
+        if (slot + 1 < (int) index->count && index->entries[slot + 1].hash < *end) {
+            *end = index->entries[slot + 1].hash;
+        }
+        blockIndex = index->entries[slot].block;
+        block = store->view(store->context, blockIndex);
+    }
+    if (!dir_block_is_valid(block)) {
+        return -EIO;
+    }
+    return blockIndex;
+}
+
+// Makes room for one more entry in the index right above path's leaf,
+// by starting the index, adding a level under the root or splitting the
+// block under it
+static int
+index_make_room(dir_store* store, dir_path* path, uint32_t hash) {
+    void* ctx = store->context;
+    if (path->levels == 0) {
+        // The only leaf moves out of block 0 so the root can go there
+        long moved = store->grow(ctx);
+        if (moved < 0) {
+            return moved;
+        }
+        dir_index* root = store->mut(ctx, 0);
+        memcpy(store->mut(ctx, moved), root, store->blockSize);
+        index_init(root, store->blockSize);
+        index_insert(root, 0, moved);
+        path->index[0] = 0;
+        path->levels = 1;
+        path->leaf = moved;
+        return 0;
+    }
+    dir_index* parent = store->mut(ctx, path->index[path->levels - 1]);
+    if (parent->count < parent->max) {
+        return 0;
+    }
+    if (path->levels == 1) {
+        // The root's entries move down into a block of their own, which
+        // is just as full and gets split below
+        long child = store->grow(ctx);
+        if (child < 0) {
+            return child;
+        }
+        dir_index* root = store->mut(ctx, 0);
+        memcpy(store->mut(ctx, child), root, store->blockSize);
+        root->count = 0;
+        index_insert(root, 0, child);
+        path->index[1] = child;
+        path->levels = 2;
     }
-    char* location = strstr(start, name);
-    int nameLen = strlen(name);
-    while (location && *(location + nameLen) != '/') {
-      // +1 is just to move it beyond current match so we actually progress
-      location = strstr(location + 1, name);
-    }
-    if (location != 0) {
-        char* slash = strstr(location, "/");
-        char* inodeNum = slash + 1;
-        int len = 0;
-        while (inodeNum[len] && isdigit(inodeNum[len])) {
-            ++len;
+    else {
+        const dir_index* root = store->view(ctx, 0);
+        if (root->count == root->max) {
+            // Both levels are full
+            return -ENOSPC;
         }
-        slash = malloc(sizeof(char) * (len + 1));
-        strncpy(slash, inodeNum, len);
-        long val = atol(slash);
-        free(slash);
-        return val;
     }
-    return -1;
+    long sibling = store->grow(ctx);
+    if (sibling < 0) {
+        return sibling;
+    }
+    dir_index* full = store->mut(ctx, path->index[1]);
+    dir_index* half = store->mut(ctx, sibling);
+    index_init(half, store->blockSize);
+    int keep = full->count / 2;
+    memcpy(half->entries, &full->entries[keep], (full->count - keep) * sizeof(dir_index_entry));
+    half->count = full->count - keep;
+    full->count = keep;
+    index_insert(store->mut(ctx, 0), half->entries[0].hash, sibling);
+    if (hash >= half->entries[0].hash) {
+        path->index[1] = sibling;
+    }
+    return 0;
+}
+
+static int
+compare_hashes(const void* a, const void* b) {
+    uint32_t first = *(const uint32_t*) a;
+    uint32_t second = *(const uint32_t*) b;
+    return (first > second) - (first < second);
+}
+
+// A hash to split the leaf at, as near the middle as possible without
+// parting entries with the same hash. 0 when they all share one.
+static uint32_t
+split_hash(const void* leaf) {
+    const dir_block* header = leaf;
+    uint32_t count = header->count;
+    arena_mark mark = arena_save();
+    uint32_t* hashes = arena_alloc(count * sizeof(uint32_t));
+    uint32_t cursor = 0;
+    const dir_entry* entry;
+    for (uint32_t i = 0; (entry = dir_block_next(leaf, &cursor)); ++i) {
+        hashes[i] = entry->hash;
+    }
+    qsort(hashes, count, sizeof(uint32_t), compare_hashes);
+    uint32_t split = 0;
+    for (uint32_t i = count / 2; i < count && !split; ++i) {
+        if (i > 0 && hashes[i] != hashes[i - 1]) {
+            split = hashes[i];
+        }
+    }
+    for (uint32_t i = count / 2; i > 0 && !split; --i) {
+        if (hashes[i] != hashes[i - 1]) {
+            split = hashes[i];
+        }
+    }
+    arena_release(mark);
+    return split;
+}
+
+// Moves the top half of the leaf hash is headed for into a new block.
+// A leaf whose entries all share one hash can't be split, which has to
+// be known before the index is touched.
+static int
+split_leaf(dir_store* store, dir_path* path, uint32_t hash) {
+    void* ctx = store->context;
+    uint32_t split = split_hash(store->view(ctx, path->leaf));
+    if (!split) {
+        return -ENOSPC;
+    }
+    int rv = index_make_room(store, path, hash);
+    if (rv < 0) {
+        return rv;
+    }
+    long sibling = store->grow(ctx);
+    if (sibling < 0) {
+        return sibling;
+    }
+    void* lower = store->mut(ctx, path->leaf);
+    void* upper = store->mut(ctx, sibling);
+    const dir_block* header = lower;
+    arena_mark mark = arena_save();
+    void* copy = arena_alloc(store->blockSize);
+    memcpy(copy, lower, store->blockSize);
+    dir_block_init(lower, store->blockSize, header->inodeId, header->pnum);
+    dir_block_init(upper, store->blockSize, header->inodeId, header->pnum);
+    uint32_t cursor = 0;
+    const dir_entry* entry;
+    while ((entry = dir_block_next(copy, &cursor))) {
+        dir_block_insert((entry->hash >= split) ? upper : lower, entry->name, entry->nameLen,
+                         entry->inodeId, entry->type);
+    }
+    arena_release(mark);
+    index_insert(store->mut(ctx, path->index[path->levels - 1]), split, sibling);
+    return 0;
+}
+
+long
+dir_lookup(dir_store* store, const char* name, size_t len) {
+    dir_path path;
+    int rv = walk_index(store, dir_hash(name, len), &path);
+    if (rv < 0) {
+        return rv;
+    }
+    return dir_block_lookup(path.leafBlock, name, len);
+}
+
+// A name can only ever be in the leaf its hash leads to, so the leaf's
+// own check is all it takes to turn away duplicates
+int
+dir_insert(dir_store* store, const char* name, size_t len, long inodeId, int type) {
+    if (len == 0 || len > DIR_NAME_MAX) {
+        return -ENAMETOOLONG;
+    }
+    uint32_t hash = dir_hash(name, len);
+    for (;;) {
+        dir_path path;
+        int rv = walk_index(store, hash, &path);
+        if (rv < 0) {
+            return rv;
+        }
+        rv = dir_block_insert(store->mut(store->context, path.leaf), name, len, inodeId, type);
+        if (rv != -ENOSPC) {
+            return rv;
+        }
+        rv = split_leaf(store, &path, hash);
+        if (rv < 0) {
+            return rv;
+        }
+    }
+}
+
+long
+dir_remove(dir_store* store, const char* name, size_t len) {
+    dir_path path;
+    int rv = walk_index(store, dir_hash(name, len), &path);
+    if (rv < 0) {
+        return rv;
+    }
+    return dir_block_remove(store->mut(store->context, path.leaf), name, len);
+}
+
+// Points an existing entry at another inode without taking it out, so the
+// name never goes missing in between. Returns the id it used to have.
+long
+dir_replace(dir_store* store, const char* name, size_t len, long inodeId, int type) {
+    dir_path path;
+    int rv = walk_index(store, dir_hash(name, len), &path);
+    if (rv < 0) {
+        return rv;
+    }
+    if (!dir_block_find(path.leafBlock, name, len)) {
+        return -ENOENT;
+    }
+    void* leaf = store->mut(store->context, path.leaf);
+    dir_entry* entry = (dir_entry*) dir_block_find(leaf, name, len);
+    long oldId = entry->inodeId;
+    entry->inodeId = inodeId;
+    entry->type = type;
+    return oldId;
+}
+
+directory*
+create_directory(long inodeId, long pnum, size_t blockSize) {
+    directory* dir = malloc(sizeof(directory));
+    dir->pnum = pnum;
+    dir->inodeId = inodeId;
+    dir->blockSize = blockSize;
+    dir->size = blockSize;
+    dir->blocks = malloc(blockSize);
+    dir_block_init(dir->blocks, blockSize, inodeId, pnum);
+    return dir;
+}
+
+static long
+num_blocks(directory* dir) {
+    return dir->size / dir->blockSize;
+}
+
+static byte*
+block_at(directory* dir, long index) {
+    return &dir->blocks[index * dir->blockSize];
+}
+
+static const void*
+memory_view(void* context, long blockIndex) {
+    return block_at(context, blockIndex);
+}
+
+static void*
+memory_mut(void* context, long blockIndex) {
+    return block_at(context, blockIndex);
+}
+
+static long
+memory_grow(void* context) {
+    directory* dir = context;
+    dir->blocks = realloc(dir->blocks, dir->size + dir->blockSize);
+    dir->size += dir->blockSize;
+    return num_blocks(dir) - 1;
+}
+
+static dir_store
+memory_store(directory* dir) {
+    dir_store store = {memory_view, memory_mut, memory_grow, dir, dir->blockSize};
+    return store;
+}
+
+int
+add_file(directory* dir, char* name, long inodeId, int type) {
+    dir_store store = memory_store(dir);
+    return dir_insert(&store, name, strlen(name), inodeId, type);
+}
+
+void
+remove_file(directory* dir, char* name) {
+    dir_store store = memory_store(dir);
+    dir_remove(&store, name, strlen(name));
+}
+
+long
+get_file_inode(directory* dir, char* name) {
+    assert(name);
+    dir_store store = memory_store(dir);
+    return dir_lookup(&store, name, strlen(name));
 }
 
 size_t
 get_size_directory(directory* dir) {
-    return sizeof(int) + sizeof(int) + (1 + strlen(dir->paths)) * sizeof(char);
+    return dir->size;
 }
 
 long
 get_num_files(directory* dir) {
-    char* paths = get_file_start(dir);
-    if (!paths) {
-        return 0;
-    }
     long counter = 0;
-    while(*paths) {
-        if (*paths == '/') {
-            ++counter;
+    for (long i = 0; i < num_blocks(dir); ++i) {
+        if (dir_block_is_valid(block_at(dir, i))) {
+            counter += ((dir_block*) block_at(dir, i))->count;
         }
-        ++paths;
     }
     return counter;
 }
@@ -186,78 +619,111 @@ get_file_names(directory* dir, char*** namesPointer) {
   if (!numFiles) {
     return numFiles;
   }
-  *namesPointer = malloc(sizeof(char*) * numFiles);
+  *namesPointer = arena_alloc(sizeof(char*) * numFiles);
   char** names = *namesPointer;
-  int inName = 1;
   long nameIndex = 0;
-  long currentLength = 0;
-  char* fileNameStart = get_file_start(dir);
-  int currentStart = 0;
-  int haveSeenBackslash = 0;
-  for (int i = 0; i < strlen(fileNameStart); ++i) {
-    char currentChar = fileNameStart[i];
-    if (currentChar == '/') {
-      while(fileNameStart[currentStart] && fileNameStart[currentStart] == '\\') {
-        ++currentStart;
-        --currentLength;
-      }
-      if (fileNameStart[currentStart]) {
-        names[nameIndex] = malloc(sizeof(char) * (currentLength + 1));
-        strncpy(names[nameIndex], &fileNameStart[currentStart], currentLength);
-        names[nameIndex][currentLength] = 0;
-        ++nameIndex;
-      }
-      inName = 0;
-      currentLength = 0;
-      haveSeenBackslash = 0;
-    }
-    if (!inName && !isdigit(currentChar) && currentChar != '-' && currentChar != '/') {
-      inName = 1;
-      currentStart = i;
-    }
-    if (inName) {
-      ++currentLength;
+  for (long i = 0; i < num_blocks(dir); ++i) {
+    if (!dir_block_is_valid(block_at(dir, i))) {
+      continue;
+    }
+    uint32_t cursor = 0;
+    const dir_entry* entry;
+    while ((entry = dir_block_next(block_at(dir, i), &cursor))) {
+      names[nameIndex++] = arena_strndup(entry->name, entry->nameLen);
     }
   }
   return numFiles;
 }
 
+int
+is_dir_empty(directory* dir) {
+    return get_num_files(dir) == 0;
+}
+
 int
 has_file(directory* dir, char* name) {
-  char slash[2] = "/";
-  char* searchString = smart_cat(name, slash);
-  return strstr(dir->paths, searchString) != NULL;
+    return get_file_inode(dir, name) >= 0;
 }
 
 void
 free_directory(directory* dir) {
-    free(dir->paths);
+    free(dir->blocks);
     free(dir);
 }
 
-void*
-serialize(directory* dir) {
-    size_t size = get_size_directory(dir);
-    //long stringLen = strlen(dir->paths) + 1
-    void* writeArray = malloc(size);
-    memcpy(writeArray, &dir->pnum, sizeof(int));
-    memcpy(writeArray + sizeof(int), &dir->inodeId, sizeof(int));
-    long twoInt = sizeof(int) + sizeof(int);
-    memcpy(writeArray + twoInt, dir->paths, size - twoInt);
-    return writeArray;
-}
-
 directory*
 deserialize(void* addr, size_t size) {
-    int twoInt = sizeof(int) + sizeof(int);
-    assert(size >= twoInt + 1);
-    int* intPtr = addr;
+    const dir_block* header = addr;
+    assert(size >= sizeof(dir_block) && dir_is_valid(addr));
     directory* dir = malloc(sizeof(directory));
-    dir->pnum = intPtr[0];
-    dir->inodeId = intPtr[1];
-    long dataSize = size - twoInt;
-    dir->paths = malloc(sizeof(char) * dataSize);
-    void* dataAddr = addr + twoInt;
-    memcpy(dir->paths, dataAddr, dataSize);
+    dir->pnum = header->pnum;
+    dir->inodeId = header->inodeId;
+    dir->blockSize = header->size;
+    dir->size = size - size % header->size;
+    dir->blocks = malloc(dir->size);
+    memcpy(dir->blocks, addr, dir->size);
+    return dir;
+}
+
+int
+is_legacy_directory(const void* addr, size_t size) {
+    // Old directories were two ints and a "name/inode" string, the first
+    // int (pnum) is never going to collide with the magic
+    return size >= 2 * sizeof(int) + 1 && !dir_is_valid(addr);
+}
+
+/*
+ Old format: int pnum, int inodeId, then a string of name/inode pairs.
+ The first pair is the directory itself, names starting with a digit
+ were escaped with a backslash so they can be told apart from the
+ previous inode number.
+*/
+directory*
+convert_legacy_directory(const void* addr, size_t size, size_t blockSize,
+                         int (*get_type)(long inodeId)) {
+    const int* intPtr = addr;
+    const char* paths = (const char*) addr + 2 * sizeof(int);
+    size_t length = strnlen(paths, size - 2 * sizeof(int));
+    directory* dir = create_directory(intPtr[1], intPtr[0], blockSize);
+    size_t pos = 0;
+    int isSelf = 1;
+    while (pos < length) {
+        size_t nameStart = pos;
+        while (pos < length && paths[pos] != '/') {
+            ++pos;
+        }
+        if (pos >= length) {
+            break;
+        }
+        size_t nameLen = pos - nameStart;
+        ++pos;
+        size_t numStart = pos;
+        if (pos < length && paths[pos] == '-') {
+            ++pos;
+        }
+        while (pos < length && isdigit(paths[pos])) {
+            ++pos;
+        }
+        if (pos == numStart) {
+            // No number after the slash, this isn't something we wrote
+            break;
+        }
+        long inodeId = strtol(&paths[numStart], 0, 10);
+        if (isSelf) {
+            isSelf = 0;
+            continue;
+        }
+        if (nameLen > 1 && paths[nameStart] == '\\' && isdigit(paths[nameStart + 1])) {
+            ++nameStart;
+            --nameLen;
+        }
+        if (nameLen == 0 || nameLen > DIR_NAME_MAX || inodeId < 0) {
+            continue;
+        }
+        char name[DIR_NAME_MAX + 1];
+        memcpy(name, &paths[nameStart], nameLen);
+        name[nameLen] = 0;
+        add_file(dir, name, inodeId, get_type ? get_type(inodeId) : DT_UNKNOWN);
+    }
     return dir;
 }
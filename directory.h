@@ -2,27 +2,139 @@
 #define DIRECTORY_H
 
 #include <string.h>
+#include <stdint.h>
+#include "types.h"
 
+/*
+ A directory is stored as a run of fixed size directory blocks. Every
+ block starts with a dir_block header followed by a table of hash
+ buckets, then the entry records themselves packed one after the other.
+ Each bucket holds the offset of the first record whose name hashes to
+ it, records chain to the next one through `next`. Offsets are from the
+ start of the block and 0 terminates a chain (the header lives there).
+
+ All of the dir_block_* functions work in place on a single block, so
+ they can be pointed straight at the mapped image.
+*/
+
+#define DIR_MAGIC 0x4446554e
+#define DIR_NAME_MAX 255
+// Roughly one bucket per 128 bytes of block keeps chains short
+#define DIR_BUCKET_BYTES 128
+// Names in a directory never share both dir_hash and dir_minor_hash, which
+// lets readdir resume from the pair alone
+#define DIR_MINOR_BITS 30
+
+typedef struct dir_entry {
+    int32_t inodeId;
+    uint32_t next;
+    uint32_t hash;
+    uint8_t type;
+    uint8_t nameLen;
+    char name[];
+} dir_entry;
+
+typedef struct dir_block {
+    uint32_t magic;
+    int32_t inodeId;
+    int32_t pnum;
+    uint32_t size;
+    uint32_t numBuckets;
+    uint32_t count;
+    uint32_t used;
+    uint32_t dead;
+    uint32_t buckets[];
+} dir_block;
+
+uint32_t dir_hash(const char* name, size_t len);
+uint32_t dir_minor_hash(const char* name, size_t len);
+void dir_block_init(void* block, size_t size, long inodeId, long pnum);
+int dir_block_is_valid(const void* block);
+const dir_entry* dir_block_find(const void* block, const char* name, size_t len);
+long dir_block_lookup(const void* block, const char* name, size_t len);
+int dir_block_insert(void* block, const char* name, size_t len, long inodeId, int type);
+long dir_block_remove(void* block, const char* name, size_t len);
+void dir_block_compact(void* block);
+const dir_entry* dir_block_next(const void* block, uint32_t* cursor);
+
+/*
+ One block only goes so far, so bigger directories are indexed by name
+ hash much like ext4's htree. Block 0 turns into a dir_index whose
+ entries say which block to look in for each range of hashes: sorted by
+ hash, each covering its own up to the next one's, the first everything
+ below that. An index points either at leaves (plain dir_blocks) or, once
+ the root itself fills up, at one more level of index blocks. A full
+ leaf is split in two at a hash between its entries and the new half
+ gets indexed, so finding a name means at most DIR_INDEX_LEVELS index
+ blocks and then one leaf whatever the directory's size.
+
+ Block numbers are positions within the directory, not image blocks.
+ The header leads with the same fields as a dir_block.
+*/
+
+#define DIR_INDEX_MAGIC 0x5844554e
+#define DIR_INDEX_LEVELS 2
+
+typedef struct dir_index_entry {
+    uint32_t hash;
+    uint32_t block;
+} dir_index_entry;
+
+typedef struct dir_index {
+    uint32_t magic;
+    int32_t inodeId;
+    int32_t pnum;
+    uint32_t size;
+    uint32_t count;
+    uint32_t max;
+    dir_index_entry entries[];
+} dir_index;
+
+// Where a directory's blocks live, so the same code runs on the image
+// and on in memory copies. grow adds a block on the end and returns its
+// number, which may move the blocks mut and view handed out before.
+typedef struct dir_store {
+    const void* (*view)(void* context, long blockIndex);
+    void* (*mut)(void* context, long blockIndex);
+    long (*grow)(void* context);
+    void* context;
+    size_t blockSize;
+} dir_store;
+
+int dir_is_valid(const void* block);
+long dir_lookup(dir_store* store, const char* name, size_t len);
+int dir_insert(dir_store* store, const char* name, size_t len, long inodeId, int type);
+long dir_remove(dir_store* store, const char* name, size_t len);
+long dir_replace(dir_store* store, const char* name, size_t len, long inodeId, int type);
+long dir_leaf_for(dir_store* store, uint32_t hash, uint64_t* end);
+
+/*
+ An in memory copy of a whole directory, i.e. all of its blocks back to
+ back. This is what gets written to the directory's inode.
+*/
 typedef struct directory {
     int pnum;
     int inodeId;
-    char* paths;
+    size_t blockSize;
+    size_t size;
+    byte* blocks;
 } directory;
 
-char* smart_cat(char* str1, char* str2);
-directory* create_directory(char* name, long inodeId, long pnum);
-int add_file(directory* dir, char* name, long inodeId);
-char* get_name(directory* dir);
+directory* create_directory(long inodeId, long pnum, size_t blockSize);
+int add_file(directory* dir, char* name, long inodeId, int type);
 void remove_file(directory* dir, char* name);
 long get_file_inode(directory* dir, char* name);
 size_t get_size_directory(directory* dir);
 long get_num_files(directory* dir);
+// The names come out of the calling thread's arena
 long get_file_names(directory* dir, char*** namesPointer);
 void free_directory(directory* dir);
 int is_dir_empty(directory* dir);
 int has_file(directory* dir, char* name);
 
-void* serialize(directory* dir);
 directory* deserialize(void* addr, size_t size);
+int is_legacy_directory(const void* addr, size_t size);
+directory* convert_legacy_directory(const void* addr, size_t size, size_t blockSize,
+                                    int (*get_type)(long inodeId));
 
 #endif
@@ -0,0 +1,371 @@
+#include <string.h>
+#include <errno.h>
+
+#include "extent.h"
+#include "storage.h"
+
+typedef struct split {
+  uint32_t logical;
+  uint32_t block;
+} split;
+
+// A 1k block holds 84 entries, so even 2^32 blocks in single block
+// extents stay well under this many levels
+#define EXTENT_MAX_DEPTH 8
+
+// Blocks taken before an insert changes anything, so running out of space
+// part way through a split can't leave the tree half moved
+typedef struct reserve {
+  long blocks[EXTENT_MAX_DEPTH + 2];
+  int count;
+} reserve;
+
+static void insert_node(extent_header* node, extent* e, reserve* spare, split* out);
+
+static extent*
+entries_of(extent_header* node) {
+  return (extent*) (node + 1);
+}
+
+static extent_index*
+indexes_of(extent_header* node) {
+  return (extent_index*) (node + 1);
+}
+
+static extent_header*
+node_block(uint32_t blockId) {
+  return block_mut(blockId);
+}
+
+// For lookups, so just walking the tree doesn't put its blocks in the
+// next commit
+static extent_header*
+node_view(uint32_t blockId) {
+  return (extent_header*) block_view(blockId);
+}
+
+static int
+block_capacity() {
+  return (storage_block_size() - sizeof(extent_header)) / sizeof(extent);
+}
+
+static void
+init_node(extent_header* node, int max, int depth) {
+  node->magic = EXTENT_MAGIC;
+  node->count = 0;
+  node->max = max;
+  node->depth = depth;
+}
+
+void
+extent_init(extent_root* root) {
+  init_node(&root->header, INLINE_EXTENTS, 0);
+  root->blocks = 0;
+}
+
+// Last entry starting at or before logical, -1 when they all start after.
+// Extents and indexes both lead with logical so this works on either.
+static int
+find_entry(extent_header* node, uint32_t logical) {
+  extent* entries = entries_of(node);
+  int low = 0;
+  int high = node->count - 1;
+  int found = -1;
+  while (low <= high) {
+    int mid = (low + high) / 2;
+    if (entries[mid].logical <= logical) {
+      found = mid;
+      low = mid + 1;
+    }
+    else {
+      high = mid - 1;
+    }
+  }
+  return found;
+}
+
+// Returns the image block holding file block logical, or 0 for a hole.
+// runLength is set to how many blocks from there on are mapped
+// contiguously, or for a hole how many blocks until something is mapped.
+long
+extent_map(extent_root* root, long logical, long* runLength) {
+  extent_header* node = &root->header;
+  long limit = (long) UINT32_MAX + 1;
+  while (node->depth > 0) {
+    int i = find_entry(node, logical);
+    if (i < 0) {
+      i = 0;
+    }
+    if (i + 1 < node->count && indexes_of(node)[i + 1].logical < limit) {
+      limit = indexes_of(node)[i + 1].logical;
+    }
+    node = node_view(indexes_of(node)[i].child);
+  }
+  extent* entries = entries_of(node);
+  int i = find_entry(node, logical);
+  if (i >= 0 && logical < (long) entries[i].logical + entries[i].length) {
+    *runLength = (long) entries[i].logical + entries[i].length - logical;
+    return entries[i].physical + (logical - entries[i].logical);
+  }
+  if (i + 1 < node->count) {
+    limit = entries[i + 1].logical;
+  }
+  *runLength = limit - logical;
+  return 0;
+}
+
+static int
+contiguous(extent* first, extent* second) {
+  return (uint64_t) first->logical + first->length == second->logical &&
+    (uint64_t) first->physical + first->length == second->physical &&
+    (uint64_t) first->length + second->length <= UINT32_MAX;
+}
+
+// Moves the top of a full node into a fresh block. Appends (the common
+// case) leave the full node alone and start the new block empty.
+static extent_header*
+split_node(extent_header* node, int insertAt, reserve* spare, split* out) {
+  long blockId = spare->blocks[--spare->count];
+  extent_header* sibling = node_block(blockId);
+  init_node(sibling, block_capacity(), node->depth);
+  int keep = (insertAt >= node->count) ? node->count : node->count / 2;
+  memcpy(entries_of(sibling), &entries_of(node)[keep], (node->count - keep) * sizeof(extent));
+  sibling->count = node->count - keep;
+  node->count = keep;
+  out->block = blockId;
+  return sibling;
+}
+
+static void
+insert_at(extent_header* node, int position, void* entry) {
+  extent* entries = entries_of(node);
+  memmove(&entries[position + 1], &entries[position], (node->count - position) * sizeof(extent));
+  memcpy(&entries[position], entry, sizeof(extent));
+  ++node->count;
+}
+
+// Puts entry into node at its sorted spot, splitting node if it is full.
+// A split is reported through out so the parent can index the new block.
+static void
+add_entry(extent_header* node, void* entry, reserve* spare, split* out) {
+  uint32_t logical = ((extent*) entry)->logical;
+  int position = find_entry(node, logical) + 1;
+  if (node->count < node->max) {
+    insert_at(node, position, entry);
+    return;
+  }
+  extent_header* sibling = split_node(node, position, spare, out);
+  if (sibling->count == 0 || logical >= entries_of(sibling)[0].logical) {
+    insert_at(sibling, find_entry(sibling, logical) + 1, entry);
+  }
+  else {
+    insert_at(node, position, entry);
+  }
+  out->logical = entries_of(sibling)[0].logical;
+}
+
+// Whether e just grows an extent already in the leaf, rather than needing
+// an entry of its own
+static int
+merges(extent_header* leaf, extent* e) {
+  extent* entries = entries_of(leaf);
+  int i = find_entry(leaf, e->logical);
+  return (i >= 0 && contiguous(&entries[i], e)) ||
+    (i + 1 < leaf->count && contiguous(e, &entries[i + 1]));
+}
+
+static void
+insert_leaf(extent_header* node, extent* e, reserve* spare, split* out) {
+  extent* entries = entries_of(node);
+  int i = find_entry(node, e->logical);
+  // Grow a neighbour when the new blocks carry on from it
+  if (i >= 0 && contiguous(&entries[i], e)) {
+    entries[i].length += e->length;
+    if (i + 1 < node->count && contiguous(&entries[i], &entries[i + 1])) {
+      entries[i].length += entries[i + 1].length;
+      memmove(&entries[i + 1], &entries[i + 2], (node->count - i - 2) * sizeof(extent));
+      --node->count;
+    }
+    return;
+  }
+  if (i + 1 < node->count && contiguous(e, &entries[i + 1])) {
+    entries[i + 1].logical = e->logical;
+    entries[i + 1].physical = e->physical;
+    entries[i + 1].length += e->length;
+    return;
+  }
+  add_entry(node, e, spare, out);
+}
+
+static void
+insert_index(extent_header* node, extent* e, reserve* spare, split* out) {
+  extent_index* indexes = indexes_of(node);
+  int i = find_entry(node, e->logical);
+  if (i < 0) {
+    // Only the first child can be asked to cover something before its key
+    i = 0;
+    indexes[0].logical = e->logical;
+  }
+  split childSplit = {0, 0};
+  insert_node(node_block(indexes[i].child), e, spare, &childSplit);
+  if (childSplit.block) {
+    extent_index index = {childSplit.logical, childSplit.block, 0};
+    add_entry(node, &index, spare, out);
+  }
+}
+
+static void
+insert_node(extent_header* node, extent* e, reserve* spare, split* out) {
+  if (node->depth == 0) {
+    insert_leaf(node, e, spare, out);
+  }
+  else {
+    insert_index(node, e, spare, out);
+  }
+}
+
+// How many nodes on the way down to e's leaf split when it goes in. A
+// node only splits when it is full and has to take a new entry, which is
+// e itself in the leaf and the new sibling's index everywhere above it.
+// splits says whether node itself does.
+static int
+count_splits(extent_header* node, extent* e, int* splits) {
+  int below = 0;
+  int adds;
+  if (node->depth == 0) {
+    adds = !merges(node, e);
+  }
+  else {
+    int i = find_entry(node, e->logical);
+    below = count_splits(node_view(indexes_of(node)[(i < 0) ? 0 : i].child), e, &adds);
+  }
+  *splits = adds && node->count == node->max;
+  return below + *splits;
+}
+
+// The root can't have a sibling, so when it splits everything it kept
+// moves down into a new block and the root becomes an index over that
+// block and the one the split produced.
+static void
+push_down_root(extent_root* root, reserve* spare, split* rootSplit) {
+  extent_header* header = &root->header;
+  long blockId = spare->blocks[--spare->count];
+  extent_header* child = node_block(blockId);
+  init_node(child, block_capacity(), header->depth);
+  memcpy(entries_of(child), root->entries, header->count * sizeof(extent));
+  child->count = header->count;
+
+  extent_index* indexes = (extent_index*) root->entries;
+  indexes[0].logical = (child->count) ? entries_of(child)[0].logical : 0;
+  indexes[0].child = blockId;
+  indexes[0].unused = 0;
+  indexes[1].logical = rootSplit->logical;
+  indexes[1].child = rootSplit->block;
+  indexes[1].unused = 0;
+  header->count = 2;
+  ++header->depth;
+}
+
+int
+extent_insert(extent_root* root, long logical, long physical, long length) {
+  if (logical + length > (long) UINT32_MAX || physical + length > (long) UINT32_MAX) {
+    return -EFBIG;
+  }
+  if (root->header.depth > EXTENT_MAX_DEPTH) {
+    return -EIO;
+  }
+  extent e = {logical, physical, length};
+  // Every split takes a block, the root splitting one more to move down to
+  int rootSplits;
+  reserve spare = {{0}, 0};
+  int needed = count_splits(&root->header, &e, &rootSplits) + rootSplits;
+  while (spare.count < needed) {
+    long blockId = get_next_block();
+    if (blockId < 0) {
+      while (spare.count > 0) {
+        release_block(spare.blocks[--spare.count]);
+      }
+      return blockId;
+    }
+    spare.blocks[spare.count++] = blockId;
+  }
+  split rootSplit = {0, 0};
+  insert_node(&root->header, &e, &spare, &rootSplit);
+  if (rootSplit.block) {
+    push_down_root(root, &spare, &rootSplit);
+  }
+  root->blocks += length;
+  return 0;
+}
+
+// Returns how many mapped blocks it gave back
+static long
+truncate_node(extent_header* node, uint32_t logical) {
+  long released = 0;
+  if (node->depth == 0) {
+    extent* entries = entries_of(node);
+    while (node->count > 0) {
+      extent* last = &entries[node->count - 1];
+      if (last->logical >= logical) {
+        release_blocks(last->physical, last->length);
+        released += last->length;
+        --node->count;
+      }
+      else {
+        if ((uint64_t) last->logical + last->length > logical) {
+          uint32_t keep = logical - last->logical;
+          release_blocks(last->physical + keep, last->length - keep);
+          released += last->length - keep;
+          last->length = keep;
+        }
+        break;
+      }
+    }
+    return released;
+  }
+  extent_index* indexes = indexes_of(node);
+  while (node->count > 0) {
+    extent_index* last = &indexes[node->count - 1];
+    extent_header* child = node_block(last->child);
+    if (last->logical >= logical) {
+      released += truncate_node(child, 0);
+    }
+    else {
+      released += truncate_node(child, logical);
+    }
+    if (child->count > 0) {
+      break;
+    }
+    release_block(last->child);
+    --node->count;
+  }
+  return released;
+}
+
+// How many image blocks the file has mapped, not counting the tree's own
+long
+extent_count(extent_root* root) {
+  return root->blocks;
+}
+
+// Drops every block at or past file block logical, handing them back to
+// the allocator, then pulls the tree back into the inode if it fits.
+void
+extent_truncate(extent_root* root, long logical) {
+  extent_header* header = &root->header;
+  root->blocks -= truncate_node(header, (logical > UINT32_MAX) ? UINT32_MAX : logical);
+  if (header->count == 0) {
+    header->depth = 0;
+  }
+  while (header->depth > 0 && header->count == 1) {
+    uint32_t childId = indexes_of(header)[0].child;
+    extent_header* child = node_block(childId);
+    if (child->count > INLINE_EXTENTS) {
+      break;
+    }
+    memcpy(root->entries, entries_of(child), child->count * sizeof(extent));
+    header->count = child->count;
+    header->depth = child->depth;
+    release_block(childId);
+  }
+}
@@ -0,0 +1,56 @@
+#ifndef EXTENT_H
+#define EXTENT_H
+
+#include <stdint.h>
+
+/*
+ Maps file blocks to image blocks as runs: an extent says `length` blocks
+ starting at file block `logical` live at image block `physical` onwards.
+
+ The extents form a small B+ tree. Its root is stored in the inode with
+ room for INLINE_EXTENTS entries; once that overflows the entries move
+ into tree blocks and the root starts holding extent_index entries that
+ point at them instead. Every node starts with an extent_header and
+ `depth` says how far it is above the leaves, so depth 0 nodes hold
+ extents and everything above holds indexes. Index keys are the first
+ logical block their child covers.
+*/
+
+#define EXTENT_MAGIC 0xf30a
+#define INLINE_EXTENTS 4
+
+typedef struct extent_header {
+    uint16_t magic;
+    uint16_t count;
+    uint16_t max;
+    uint16_t depth;
+} extent_header;
+
+typedef struct extent {
+    uint32_t logical;
+    uint32_t physical;
+    uint32_t length;
+} extent;
+
+// Same size as an extent so both kinds of node hold the same number
+typedef struct extent_index {
+    uint32_t logical;
+    uint32_t child;
+    uint32_t unused;
+} extent_index;
+
+// blocks counts the image blocks the tree maps, not its own, so stat
+// doesn't have to walk it
+typedef struct extent_root {
+    extent_header header;
+    extent entries[INLINE_EXTENTS];
+    uint32_t blocks;
+} extent_root;
+
+void extent_init(extent_root* root);
+long extent_map(extent_root* root, long logical, long* runLength);
+int extent_insert(extent_root* root, long logical, long physical, long length);
+void extent_truncate(extent_root* root, long logical);
+long extent_count(extent_root* root);
+
+#endif
@@ -0,0 +1,209 @@
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "journal.h"
+
+static uint32_t
+checksum_bytes(uint32_t hash, const void* data, size_t size) {
+  // FNV-1a, only has to notice a torn or stale transaction
+  const unsigned char* bytes = data;
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= bytes[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static size_t
+descriptor_size(long count, long freedCount) {
+  return sizeof(journal_header) + count * sizeof(uint32_t) + freedCount * sizeof(journal_extent);
+}
+
+static long
+descriptor_blocks(const superblock* sb, long count, long freedCount) {
+  return (descriptor_size(count, freedCount) + sb->block_size - 1) / sb->block_size;
+}
+
+static off_t
+journal_offset(const superblock* sb, long block) {
+  return ((off_t) sb->journal_start + block) * sb->block_size;
+}
+
+// How many blocks a transaction that frees freedCount extents can log
+long
+journal_capacity(const superblock* sb, long freedCount) {
+  long bytes = (long) sb->journal_blocks * sb->block_size - descriptor_size(0, freedCount);
+  long count = (bytes > 0) ? bytes / (sb->block_size + sizeof(uint32_t)) : 0;
+  // Rounding the descriptor up to whole blocks can cost one more
+  while (count > 0 && descriptor_blocks(sb, count, freedCount) + count > sb->journal_blocks) {
+    --count;
+  }
+  return count;
+}
+
+static int
+write_all(int fd, const void* data, size_t size, off_t offset) {
+  while (size > 0) {
+    ssize_t written = pwrite(fd, data, size, offset);
+    if (written < 0) {
+      return -errno;
+    }
+    data = (const char*) data + written;
+    size -= written;
+    offset += written;
+  }
+  return 0;
+}
+
+static int
+read_all(int fd, void* data, size_t size, off_t offset) {
+  while (size > 0) {
+    ssize_t got = pread(fd, data, size, offset);
+    if (got <= 0) {
+      return (got < 0) ? -errno : -EIO;
+    }
+    data = (char*) data + got;
+    size -= got;
+    offset += got;
+  }
+  return 0;
+}
+
+// Writes the transaction into the journal and waits for it to be on disk,
+// once this returns it will survive a crash. image is where the logged
+// blocks are read from, block n being at image + n * block_size.
+int
+journal_commit(int fd, const superblock* sb, uint64_t sequence, const uint32_t* homes,
+               long count, const journal_extent* freed, long freedCount, const void* image) {
+  if (count > journal_capacity(sb, freedCount)) {
+    return -ENOSPC;
+  }
+  long descBlocks = descriptor_blocks(sb, count, freedCount);
+  journal_header* header = calloc(descBlocks, sb->block_size);
+  header->magic = JOURNAL_MAGIC;
+  header->sequence = sequence;
+  header->count = count;
+  header->freed = freedCount;
+  memcpy(header->homes, homes, count * sizeof(uint32_t));
+  // Nothing freed usually comes with no array at all
+  if (freedCount) {
+    memcpy(&header->homes[count], freed, freedCount * sizeof(journal_extent));
+  }
+
+  size_t covered = offsetof(journal_header, sequence);
+  uint32_t hash = checksum_bytes(2166136261u, (char*) header + covered,
+                                 descriptor_size(count, freedCount) - covered);
+  int rv = 0;
+  for (long i = 0; i < count && rv == 0; ++i) {
+    const char* block = (const char*) image + (off_t) homes[i] * sb->block_size;
+    hash = checksum_bytes(hash, block, sb->block_size);
+    rv = write_all(fd, block, sb->block_size, journal_offset(sb, descBlocks + i));
+  }
+  header->checksum = hash;
+  if (rv == 0) {
+    rv = write_all(fd, header, descBlocks * sb->block_size, journal_offset(sb, 0));
+  }
+  if (rv == 0 && fdatasync(fd) < 0) {
+    rv = -errno;
+  }
+  free(header);
+  return rv;
+}
+
+int
+journal_invalidate(int fd, const superblock* sb) {
+  journal_header header;
+  memset(&header, 0, sizeof(header));
+  return write_all(fd, &header, sizeof(header), journal_offset(sb, 0));
+}
+
+// Marks the extents free in the on disk bitmap and punches them out,
+// the same as a checkpoint does once it has written everything back.
+static int
+replay_frees(int fd, const superblock* sb, const journal_extent* freed, long freedCount) {
+  off_t bitmap = (off_t) sb->block_bitmap_start * sb->block_size;
+  for (long i = 0; i < freedCount; ++i) {
+    if ((uint64_t) freed[i].start + freed[i].length > sb->block_count) {
+      continue;
+    }
+    for (uint32_t block = freed[i].start; block < freed[i].start + freed[i].length; ++block) {
+      unsigned char byte;
+      int rv = read_all(fd, &byte, 1, bitmap + block / 8);
+      if (rv < 0) {
+        return rv;
+      }
+      byte &= ~(1 << (block % 8));
+      rv = write_all(fd, &byte, 1, bitmap + block / 8);
+      if (rv < 0) {
+        return rv;
+      }
+    }
+    off_t offset = (off_t) freed[i].start * sb->block_size;
+    off_t length = (off_t) freed[i].length * sb->block_size;
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) < 0) {
+      // Free blocks have to read back as zero one way or another
+      char* zeros = calloc(1, sb->block_size);
+      for (off_t done = 0; done < length; done += sb->block_size) {
+        write_all(fd, zeros, sb->block_size, offset + done);
+      }
+      free(zeros);
+    }
+  }
+  return 0;
+}
+
+// Applies the transaction left in the journal, if it was committed
+// completely. Has to run before the image is mapped.
+int
+journal_replay(int fd, const superblock* sb) {
+  if (sb->journal_blocks == 0) {
+    return 0;
+  }
+  journal_header first;
+  int rv = read_all(fd, &first, sizeof(first), journal_offset(sb, 0));
+  if (rv < 0 || first.magic != JOURNAL_MAGIC) {
+    return rv;
+  }
+  if (first.count > sb->journal_blocks || first.freed > sb->journal_blocks * sb->block_size ||
+      descriptor_blocks(sb, first.count, first.freed) + first.count > sb->journal_blocks) {
+    // Garbage, nothing we could have written
+    return journal_invalidate(fd, sb);
+  }
+  long descBlocks = descriptor_blocks(sb, first.count, first.freed);
+  size_t size = (descBlocks + first.count) * sb->block_size;
+  char* log = malloc(size);
+  rv = read_all(fd, log, size, journal_offset(sb, 0));
+  if (rv < 0) {
+    free(log);
+    return rv;
+  }
+  journal_header* header = (journal_header*) log;
+  size_t covered = offsetof(journal_header, sequence);
+  uint32_t hash = checksum_bytes(2166136261u, log + covered,
+                                 descriptor_size(header->count, header->freed) - covered);
+  hash = checksum_bytes(hash, log + descBlocks * sb->block_size, first.count * sb->block_size);
+  if (hash == header->checksum) {
+    for (long i = 0; i < header->count && rv == 0; ++i) {
+      if (header->homes[i] < sb->block_count) {
+        rv = write_all(fd, log + (descBlocks + i) * sb->block_size, sb->block_size,
+                       (off_t) header->homes[i] * sb->block_size);
+      }
+    }
+    if (rv == 0) {
+      rv = replay_frees(fd, sb, (journal_extent*) &header->homes[header->count], header->freed);
+    }
+    if (rv == 0 && fdatasync(fd) < 0) {
+      rv = -errno;
+    }
+  }
+  if (rv == 0) {
+    rv = journal_invalidate(fd, sb);
+  }
+  free(log);
+  return rv;
+}
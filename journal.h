@@ -0,0 +1,45 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+#include "storage.h"
+
+/*
+ Metadata journal. Changes to the image are batched into transactions,
+ and a transaction's metadata blocks are copied into the journal region
+ before any of them are written back to where they belong. A
+ transaction is laid out from the start of the region as a descriptor,
+ which is a journal_header followed by the home block of every logged
+ block and the extents the transaction freed, then the logged blocks
+ themselves in the same order.
+
+ The checksum covers the descriptor and every logged block, so a
+ transaction that didn't make it to disk completely is never replayed.
+ Only the newest transaction is ever in the region: it is checkpointed
+ before the next one is written over it, so replaying it a second time
+ changes nothing.
+*/
+
+#define JOURNAL_MAGIC 0x4a46554e
+
+typedef struct journal_extent {
+    uint32_t start;
+    uint32_t length;
+} journal_extent;
+
+typedef struct journal_header {
+    uint32_t magic;
+    uint32_t checksum;
+    uint64_t sequence;
+    uint32_t count;
+    uint32_t freed;
+    uint32_t homes[];
+} journal_header;
+
+long journal_capacity(const superblock* sb, long freedCount);
+int journal_commit(int fd, const superblock* sb, uint64_t sequence, const uint32_t* homes,
+                   long count, const journal_extent* freed, long freedCount, const void* image);
+int journal_invalidate(int fd, const superblock* sb);
+int journal_replay(int fd, const superblock* sb);
+
+#endif
@@ -0,0 +1,203 @@
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "log.h"
+
+/*
+ The ring is a bounded multi producer queue. Each slot's seq says whose
+ turn it is: a writer claiming position pos waits for seq == pos, and
+ publishes its line by setting seq to pos + 1, which is what the drain
+ thread waits for before handing the slot back as pos + LOG_RING_SLOTS.
+*/
+typedef struct log_slot {
+  size_t seq;
+  char text[LOG_LINE_MAX];
+} log_slot;
+
+int logLevel = LOG_LEVEL_WARN;
+
+static log_slot ring[LOG_RING_SLOTS];
+static size_t ringTail;
+static size_t ringHead;
+static long dropped;
+static int draining;
+static int stopping;
+static FILE* logOut;
+static pthread_t drainer;
+// Set while the drain thread waits for lines, only then do writers need
+// to take wakeLock and wake it
+static int sleeping;
+static pthread_mutex_t wakeLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+
+static const char* levelNames[] = {"error", "warn", "info", "debug", "trace"};
+
+static FILE*
+out_file() {
+  return logOut ? logOut : stderr;
+}
+
+static void
+write_now(const char* format, va_list args) {
+  FILE* out = out_file();
+  flockfile(out);
+  vfprintf(out, format, args);
+  fputc('\n', out);
+  funlockfile(out);
+}
+
+// Everything either side touches here is seq_cst, so either the drain
+// thread sees what was just published or we see it asleep
+static void
+wake_drainer() {
+  if (__atomic_load_n(&sleeping, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&wakeLock);
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&wakeLock);
+  }
+}
+
+// Formats straight into a free slot, -1 if there isn't one
+static int
+ring_push(const char* format, va_list args) {
+  size_t pos = __atomic_load_n(&ringTail, __ATOMIC_RELAXED);
+  log_slot* slot;
+  for (;;) {
+    slot = &ring[pos % LOG_RING_SLOTS];
+    long diff = (long) (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+    if (diff < 0) {
+      return -1;
+    }
+    if (diff == 0 && __atomic_compare_exchange_n(&ringTail, &pos, pos + 1, 1,
+                                                 __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      break;
+    }
+    if (diff > 0) {
+      pos = __atomic_load_n(&ringTail, __ATOMIC_RELAXED);
+    }
+  }
+  vsnprintf(slot->text, LOG_LINE_MAX, format, args);
+  __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_SEQ_CST);
+  wake_drainer();
+  return 0;
+}
+
+// Whether the next line in order has been published
+static int
+ring_ready() {
+  log_slot* slot = &ring[ringHead % LOG_RING_SLOTS];
+  return __atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) == ringHead + 1;
+}
+
+// Writes out every published line, returning how many there were
+static int
+ring_drain() {
+  int count = 0;
+  while (ring_ready()) {
+    log_slot* slot = &ring[ringHead % LOG_RING_SLOTS];
+    fprintf(logOut, "%s\n", slot->text);
+    __atomic_store_n(&slot->seq, ringHead + LOG_RING_SLOTS, __ATOMIC_RELEASE);
+    ++ringHead;
+    ++count;
+  }
+  long lost = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED);
+  if (lost) {
+    fprintf(logOut, "nufs: dropped %ld log lines\n", lost);
+  }
+  if (count || lost) {
+    fflush(logOut);
+  }
+  return count;
+}
+
+// Sleeps whenever the ring is empty until a writer or log_stop wakes it
+static void*
+drain_ring(void* arg) {
+  while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+    if (ring_drain()) {
+      continue;
+    }
+    pthread_mutex_lock(&wakeLock);
+    __atomic_store_n(&sleeping, 1, __ATOMIC_SEQ_CST);
+    while (!ring_ready() && !__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+      pthread_cond_wait(&wake, &wakeLock);
+    }
+    __atomic_store_n(&sleeping, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&wakeLock);
+  }
+  ring_drain();
+  return 0;
+}
+
+void
+log_write(int level, const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  if (level > LOG_LEVEL_WARN && __atomic_load_n(&draining, __ATOMIC_ACQUIRE)) {
+    if (ring_push(format, args) < 0) {
+      __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+    }
+  }
+  else {
+    write_now(format, args);
+  }
+  va_end(args);
+}
+
+// Level for one of error, warn, info, debug or trace, -1 for anything else
+int
+log_parse_level(const char* name) {
+  for (size_t i = 0; i < sizeof(levelNames) / sizeof(levelNames[0]); ++i) {
+    if (strcmp(name, levelNames[i]) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void
+log_set_level(int level) {
+  logLevel = level;
+}
+
+// Starts the drain thread writing to out, stderr if out is null. Nothing
+// at warn or below goes through the ring, so then there's no thread.
+int
+log_start(FILE* out) {
+  if (draining || logLevel <= LOG_LEVEL_WARN) {
+    return 0;
+  }
+  logOut = out ? out : stderr;
+  for (size_t i = 0; i < LOG_RING_SLOTS; ++i) {
+    ring[i].seq = i;
+  }
+  ringHead = 0;
+  ringTail = 0;
+  stopping = 0;
+  int rv = pthread_create(&drainer, 0, drain_ring, 0);
+  if (rv) {
+    return -rv;
+  }
+  __atomic_store_n(&draining, 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+// Writes out what is left in the ring and goes back to writing straight
+// to stderr. A line still being formatted by another thread right now can
+// miss the last drain.
+void
+log_stop() {
+  if (!draining) {
+    return;
+  }
+  __atomic_store_n(&draining, 0, __ATOMIC_RELEASE);
+  pthread_mutex_lock(&wakeLock);
+  __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+  pthread_cond_signal(&wake);
+  pthread_mutex_unlock(&wakeLock);
+  pthread_join(drainer, 0);
+  fflush(logOut);
+  logOut = 0;
+}
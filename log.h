@@ -0,0 +1,55 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdio.h>
+
+/*
+ Leveled logging. Anything above LOG_MAX_LEVEL (a compile time setting,
+ -DLOG_MAX_LEVEL=LOG_LEVEL_INFO say) is compiled out, and anything above
+ the runtime level costs one load and a branch.
+
+ Errors and warnings are written straight away. Everything chattier is
+ formatted into a lock free ring and written out by a background thread
+ started with log_start, so tracing every request doesn't put a write
+ on the request path. The thread sleeps until there are lines to write
+ and is only started at all when the level is above warn. If the ring
+ fills up lines are dropped, and how many is reported once there's room
+ again. Before log_start, or after log_stop, every level is written
+ straight away.
+*/
+
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARN 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_DEBUG 3
+#define LOG_LEVEL_TRACE 4
+
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL LOG_LEVEL_TRACE
+#endif
+
+#define LOG_LINE_MAX 256
+#define LOG_RING_SLOTS 1024
+
+extern int logLevel;
+
+#define log_at(level, ...) \
+  do { \
+    if ((level) <= LOG_MAX_LEVEL && (level) <= logLevel) { \
+      log_write((level), __VA_ARGS__); \
+    } \
+  } while (0)
+
+#define log_error(...) log_at(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_warn(...) log_at(LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_info(...) log_at(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_debug(...) log_at(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define log_trace(...) log_at(LOG_LEVEL_TRACE, __VA_ARGS__)
+
+void log_write(int level, const char* format, ...) __attribute__((format(printf, 2, 3)));
+int log_parse_level(const char* name);
+void log_set_level(int level);
+int log_start(FILE* out);
+void log_stop();
+
+#endif
@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ctype.h>
+
+#include "storage.h"
+
+// Formats a nufs image, e.g. ./mkfs.nufs -s 2G -b 8192 -i 65536 data.nufs
+
+void
+usage(const char* name) {
+    fprintf(stderr, "usage: %s [-s size[K|M|G]] [-b block size] [-i inodes] image\n", name);
+    exit(1);
+}
+
+size_t
+parse_size(const char* arg) {
+    char* end;
+    size_t size = strtoull(arg, &end, 10);
+    switch (toupper(*end)) {
+    case 'G':
+        size *= 1024;
+        /* fallthrough */
+    case 'M':
+        size *= 1024;
+        /* fallthrough */
+    case 'K':
+        size *= 1024;
+        ++end;
+    }
+    if (*end) {
+        return 0;
+    }
+    return size;
+}
+
+int
+main(int argc, char *argv[])
+{
+    size_t imageSize = DEFAULT_DISK_SIZE;
+    size_t blockSize = DEFAULT_BLOCK_SIZE;
+    long inodeCount = DEFAULT_INODE_COUNT;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:b:i:")) != -1) {
+        switch (opt) {
+        case 's':
+            imageSize = parse_size(optarg);
+            break;
+        case 'b':
+            blockSize = parse_size(optarg);
+            break;
+        case 'i':
+            inodeCount = atol(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+    }
+    int rv = storage_format(argv[optind], imageSize, blockSize, inodeCount);
+    if (rv < 0) {
+        fprintf(stderr, "%s: can't format %s: %s\n", argv[0], argv[optind], strerror(-rv));
+        return 1;
+    }
+    printf("%s: %zu bytes, %zu byte blocks, %ld inodes\n",
+           argv[optind], imageSize - imageSize % blockSize, blockSize, inodeCount);
+    return 0;
+}
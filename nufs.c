@@ -8,227 +8,779 @@
 #include <bsd/string.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <time.h>
+#include <fcntl.h>
 
 #define FUSE_USE_VERSION 26
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 
 #include "storage.h"
 #include "directory.h"
+#include "arena.h"
+#include "log.h"
+#include "stats.h"
 
-// implementation for: man 2 access
-// Checks if a file exists.
-int
-nufs_access(const char *path, int mask)
+/*
+ nufs talks to the kernel through the low level FUSE API, so every call
+ names the inode it is about rather than a path. The kernel keeps its
+ own cache of names to inodes and only asks us to look up a name it
+ hasn't seen, one component at a time.
+
+ FUSE's root is always inode 1 where storage's is -1, so storage ids are
+ shifted up by two on the way out and back down on the way in.
+*/
+
+/*
+ Set with -o durability=none|periodic|fsync and -o commit=milliseconds,
+ and how long the kernel can trust what we tell it before asking again
+ with -o attr_timeout, entry_timeout and negative_timeout (seconds).
+ -o log=error|warn|info|debug|trace picks how much gets logged, trace
+ logs every request.
+
+ Every change goes through the kernel, so it can keep file contents
+ cached from one open to the next. -o direct_io turns that off and
+ sends every read and write here instead.
+*/
+typedef struct nufs_config {
+    char* durability;
+    long commitMs;
+    double attrTimeout;
+    double entryTimeout;
+    double negativeTimeout;
+    int directIo;
+    char* log;
+} nufs_config;
+
+static struct fuse_opt nufs_opts[] = {
+    {"durability=%s", offsetof(nufs_config, durability), 0},
+    {"commit=%lu", offsetof(nufs_config, commitMs), 0},
+    {"attr_timeout=%lf", offsetof(nufs_config, attrTimeout), 0},
+    {"entry_timeout=%lf", offsetof(nufs_config, entryTimeout), 0},
+    {"negative_timeout=%lf", offsetof(nufs_config, negativeTimeout), 0},
+    {"direct_io", offsetof(nufs_config, directIo), 1},
+    {"log=%s", offsetof(nufs_config, log), 0},
+    FUSE_OPT_END
+};
+
+static nufs_config config = {0, 0, 1.0, 1.0, 0.0, 0, 0};
+
+static durability durabilityMode = DURABILITY_PERIODIC;
+
+/*
+ /.nufs/stats isn't stored anywhere, it is made up here out of the
+ counters and per-request latencies in stats.h. The control directory
+ and its file get inode numbers far past anything storage hands out.
+ Neither shows up in a listing of the root, and a real .nufs there is
+ hidden behind them.
+*/
+#define CONTROL_NAME ".nufs"
+#define STATS_NAME "stats"
+#define CONTROL_DIR_INO ((fuse_ino_t) 1 << 62)
+#define STATS_INO (CONTROL_DIR_INO + 1)
+#define STATS_SIZE (16 * 1024)
+
+enum {
+    OP_LOOKUP, OP_FORGET, OP_FORGET_MULTI, OP_GETATTR, OP_SETATTR, OP_ACCESS,
+    OP_READDIR, OP_MKNOD, OP_MKDIR, OP_LINK, OP_UNLINK, OP_RMDIR, OP_RENAME,
+    OP_OPEN, OP_CREATE, OP_RELEASE, OP_READ, OP_WRITE, OP_FLUSH, OP_FSYNC,
+    OP_FSYNCDIR, OP_COUNT
+};
+
+static latency_histogram opStats[OP_COUNT] = {
+    [OP_LOOKUP] = {"lookup"}, [OP_FORGET] = {"forget"},
+    [OP_FORGET_MULTI] = {"forget_multi"}, [OP_GETATTR] = {"getattr"},
+    [OP_SETATTR] = {"setattr"}, [OP_ACCESS] = {"access"},
+    [OP_READDIR] = {"readdir"}, [OP_MKNOD] = {"mknod"}, [OP_MKDIR] = {"mkdir"},
+    [OP_LINK] = {"link"}, [OP_UNLINK] = {"unlink"}, [OP_RMDIR] = {"rmdir"},
+    [OP_RENAME] = {"rename"}, [OP_OPEN] = {"open"}, [OP_CREATE] = {"create"},
+    [OP_RELEASE] = {"release"}, [OP_READ] = {"read"}, [OP_WRITE] = {"write"},
+    [OP_FLUSH] = {"flush"}, [OP_FSYNC] = {"fsync"}, [OP_FSYNCDIR] = {"fsyncdir"},
+};
+
+// Each open takes its own copy of the stats, so reading it in pieces
+// doesn't mix up numbers from different moments
+typedef struct stats_snapshot {
+    size_t size;
+    char text[];
+} stats_snapshot;
+
+static long
+id_of(fuse_ino_t ino)
 {
-    printf("access(%s, %04o)\n", path, mask);
-    return 0;
+    return (long) ino - 2;
 }
 
-// implementation for: man 2 stat
-// gets an object's attributes (type, permissions, size, etc)
-int
-nufs_getattr(const char *path, struct stat *st)
+static fuse_ino_t
+ino_of(long inodeId)
 {
-    // TODO: Might want to make this just return the value gotten from get_stat
-    // would require returning the right error codes
-    printf("getattr(%s)\n", path);
-    int rv = get_stat(path, st);
-    if (rv < 0) {
-        return -ENOENT;
+    return inodeId + 2;
+}
+
+static int
+stat_of(long inodeId, struct stat* st)
+{
+    memset(st, 0, sizeof(struct stat));
+    int rv = get_stat_inode_id(inodeId, st);
+    st->st_ino = ino_of(inodeId);
+    return rv;
+}
+
+static void
+fill_entry(struct fuse_entry_param* entry, long inodeId)
+{
+    memset(entry, 0, sizeof(struct fuse_entry_param));
+    entry->ino = ino_of(inodeId);
+    entry->attr_timeout = config.attrTimeout;
+    entry->entry_timeout = config.entryTimeout;
+    stat_of(inodeId, &entry->attr);
+}
+
+// Replies with inodeId as the result of a lookup, which the kernel
+// will forget again later
+static void
+reply_entry(fuse_req_t req, long inodeId)
+{
+    struct fuse_entry_param entry;
+    fill_entry(&entry, inodeId);
+    fuse_reply_entry(req, &entry);
+}
+
+static int
+is_control(fuse_ino_t ino)
+{
+    return ino >= CONTROL_DIR_INO;
+}
+
+// Size 0 like /proc, the stats file is opened direct_io so reads aren't
+// cut off there
+static void
+control_stat(fuse_ino_t ino, struct stat* st)
+{
+    memset(st, 0, sizeof(struct stat));
+    st->st_ino = ino;
+    st->st_uid = getuid();
+    st->st_gid = getgid();
+    if (ino == CONTROL_DIR_INO) {
+        st->st_mode = S_IFDIR | 0555;
+        st->st_nlink = 2;
     }
     else {
-        return 0;
+        st->st_mode = S_IFREG | 0444;
+        st->st_nlink = 1;
     }
 }
 
-// implementation for: man 2 readdir
-// lists the contents of a directory
-int
-nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-             off_t offset, struct fuse_file_info *fi)
+static void
+reply_control_entry(fuse_req_t req, fuse_ino_t ino)
 {
-    struct stat st;
+    struct fuse_entry_param entry;
+    memset(&entry, 0, sizeof(struct fuse_entry_param));
+    entry.ino = ino;
+    entry.attr_timeout = config.attrTimeout;
+    entry.entry_timeout = config.entryTimeout;
+    control_stat(ino, &entry.attr);
+    fuse_reply_entry(req, &entry);
+}
 
-    printf("readdir(%s)\n", path);
+static void
+set_caching(struct fuse_file_info* fi)
+{
+    fi->direct_io = config.directIo;
+    fi->keep_cache = !config.directIo;
+}
 
-    int rv = get_stat(path, &st);
-    if (rv < 0) {
-      printf("Stats got less than zero\n");
-      return rv;
+// Replies to anything that just succeeds or fails
+static void
+reply_status(fuse_req_t req, long rv)
+{
+    fuse_reply_err(req, (rv < 0) ? -rv : 0);
+}
+
+void
+nufs_lookup(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+    log_trace("lookup(%lu, %s)", parent, name);
+    if (parent == FUSE_ROOT_ID && strcmp(name, CONTROL_NAME) == 0) {
+        reply_control_entry(req, CONTROL_DIR_INO);
+        return;
+    }
+    if (is_control(parent)) {
+        if (strcmp(name, STATS_NAME) == 0) {
+            reply_control_entry(req, STATS_INO);
+        }
+        else {
+            reply_status(req, -ENOENT);
+        }
+        return;
+    }
+    long inodeId = lookup_inode_at(id_of(parent), name);
+    if (inodeId == -ENOENT && config.negativeTimeout > 0) {
+        // An entry with no inode, so the kernel remembers the name is missing
+        struct fuse_entry_param entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.entry_timeout = config.negativeTimeout;
+        fuse_reply_entry(req, &entry);
+        return;
+    }
+    if (inodeId < -1) {
+        reply_status(req, inodeId);
+        return;
     }
-    // filler is a callback that adds one item to the result
-    // it will return non-zero when the buffer is full
+    reply_entry(req, inodeId);
+}
 
-    if (!is_directory(path)) {
-      // TODO: get the basename here
-      filler(buf, path, &st, 0);
-      return 0;
+void
+nufs_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+    if (!is_control(ino)) {
+        forget_inode(id_of(ino), nlookup);
     }
-    else {
-      filler(buf, ".", &st, 0);
+    fuse_reply_none(req);
+}
+
+void
+nufs_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data* forgets)
+{
+    for (size_t i = 0; i < count; ++i) {
+        if (!is_control(forgets[i].ino)) {
+            forget_inode(id_of(forgets[i].ino), forgets[i].nlookup);
+        }
     }
+    fuse_reply_none(req);
+}
 
-    read_data* data = get_data(path);
-    directory* dir = deserialize((void*) data->data, data->size);
-    char** fileNames;
-    long numFiles = get_file_names(dir, &fileNames);
-    for (long i = 0; i < numFiles; ++i) {
-        get_stat_inode_id(get_file_inode(dir, fileNames[i]), &st);
-        filler(buf, fileNames[i], &st, 0);
+// implementation for: man 2 stat
+// gets an object's attributes (type, permissions, size, etc)
+void
+nufs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+    log_trace("getattr(%lu)", ino);
+    struct stat st;
+    if (is_control(ino)) {
+        control_stat(ino, &st);
+        fuse_reply_attr(req, &st, config.attrTimeout);
+        return;
+    }
+    int rv = stat_of(id_of(ino), &st);
+    if (rv < 0) {
+        reply_status(req, rv);
+        return;
     }
+    fuse_reply_attr(req, &st, config.attrTimeout);
+}
 
-    free((void*) data);
-    free_directory(dir);
-    return 0;
+// chmod, truncate and utimens all end up here
+void
+nufs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat* attr, int toSet,
+             struct fuse_file_info* fi)
+{
+    log_trace("setattr(%lu, %x)", ino, toSet);
+    long inodeId = id_of(ino);
+    int rv = 0;
+    if (is_control(ino)) {
+        rv = -EACCES;
+    }
+    if (rv == 0 && (toSet & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))) {
+        // No chown
+        rv = -ENOSYS;
+    }
+    if (rv == 0 && (toSet & FUSE_SET_ATTR_MODE)) {
+        rv = inode_chmod_id(inodeId, attr->st_mode);
+    }
+    if (rv == 0 && (toSet & FUSE_SET_ATTR_SIZE)) {
+        if (fi) {
+            rv = truncate_handle((open_file*) fi->fh, attr->st_size);
+        }
+        else {
+            rv = inode_truncate_id(inodeId, attr->st_size);
+        }
+    }
+    if (rv == 0 && (toSet & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))) {
+        struct timespec ts[2] = {{0, UTIME_OMIT}, {0, UTIME_OMIT}};
+        if (toSet & FUSE_SET_ATTR_ATIME) {
+            ts[0] = attr->st_atim;
+            if (toSet & FUSE_SET_ATTR_ATIME_NOW) {
+                ts[0].tv_nsec = UTIME_NOW;
+            }
+        }
+        if (toSet & FUSE_SET_ATTR_MTIME) {
+            ts[1] = attr->st_mtim;
+            if (toSet & FUSE_SET_ATTR_MTIME_NOW) {
+                ts[1].tv_nsec = UTIME_NOW;
+            }
+        }
+        rv = inode_utimens_id(inodeId, ts);
+    }
+    if (rv < 0) {
+        reply_status(req, rv);
+        return;
+    }
+    nufs_getattr(req, ino, fi);
 }
 
 // mknod makes a filesystem object like a file or directory
 // called for: man 2 open, man 2 link
-int
-nufs_mknod(const char *path, mode_t mode, dev_t rdev)
+void
+nufs_mknod(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode, dev_t rdev)
 {
-    printf("mknod(%s, %04o)\n", path, mode);
-    long rv = (long) get_new_inode(path, mode, rdev);
-    if (rv < 0) {
-      return rv;
+    log_trace("mknod(%lu, %s, %04o)", parent, name, mode);
+    long inodeId = get_new_inode_at(id_of(parent), name, mode, rdev);
+    if (inodeId < 0) {
+        reply_status(req, inodeId);
+        return;
     }
-    return 0;
+    reply_entry(req, inodeId);
 }
 
-// most of the following callbacks implement
-// another system call; see section 2 of the manual
-int
-nufs_mkdir(const char *path, mode_t mode)
+void
+nufs_mkdir(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode)
 {
-    printf("mkdir(%s)\n", path);
-    return create_dir_inode(path, mode);
+    log_trace("mkdir(%lu, %s)", parent, name);
+    nufs_mknod(req, parent, name, mode | S_IFDIR, 0);
 }
 
-int
-nufs_link(const char *from, const char *to) {
-  printf("link(%s => %s)\n", from, to);
-  return inode_link(from, to);
+void
+nufs_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newParent, const char* newName)
+{
+    log_trace("link(%lu => %lu, %s)", ino, newParent, newName);
+    int rv = inode_link_at(id_of(ino), id_of(newParent), newName);
+    if (rv < 0) {
+        reply_status(req, rv);
+        return;
+    }
+    reply_entry(req, id_of(ino));
 }
 
-int
-nufs_unlink(const char *path)
+void
+nufs_unlink(fuse_req_t req, fuse_ino_t parent, const char* name)
 {
-    printf("unlink(%s)\n", path);
-    return inode_unlink(path);
+    log_trace("unlink(%lu, %s)", parent, name);
+    reply_status(req, inode_unlink_at(id_of(parent), name));
 }
 
-int
-nufs_rmdir(const char *path)
+// Only ever an empty directory
+void
+nufs_rmdir(fuse_req_t req, fuse_ino_t parent, const char* name)
 {
-    printf("rmdir(%s)\n", path);
-    return remove_dir(path);
+    log_trace("rmdir(%lu, %s)", parent, name);
+    reply_status(req, remove_dir_at(id_of(parent), name));
 }
 
 // implements: man 2 rename
 // called to move a file within the same filesystem
-int
-nufs_rename(const char *from, const char *to)
+void
+nufs_rename(fuse_req_t req, fuse_ino_t parent, const char* name,
+            fuse_ino_t newParent, const char* newName)
+{
+    log_trace("rename(%lu, %s => %lu, %s)", parent, name, newParent, newName);
+    reply_status(req, inode_rename_at(id_of(parent), name, id_of(newParent), newName));
+}
+
+static void
+open_stats(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
 {
-    printf("rename(%s => %s)\n", from, to);
-    int rv = inode_link(from, to);
-    if (rv != 0) {
-      return rv;
+    if (ino != STATS_INO) {
+        reply_status(req, -EISDIR);
+        return;
     }
-    return inode_unlink(from);
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+        reply_status(req, -EACCES);
+        return;
+    }
+    stats_snapshot* snapshot = malloc(sizeof(stats_snapshot) + STATS_SIZE);
+    snapshot->size = stats_format(snapshot->text, STATS_SIZE, opStats, OP_COUNT);
+    fi->fh = (uint64_t) snapshot;
+    fi->direct_io = 1;
+    fuse_reply_open(req, fi);
 }
 
-int
-nufs_chmod(const char *path, mode_t mode)
+// Keeps an open_file in fi->fh, so reads and writes on the open file
+// go straight to its inode.
+void
+nufs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
 {
-    printf("chmod(%s, %04o)\n", path, mode);
-    return inode_chmod(path, mode);
+    log_trace("open(%lu)", ino);
+    if (is_control(ino)) {
+        open_stats(req, ino, fi);
+        return;
+    }
+    open_file* file = open_handle_id(id_of(ino));
+    if ((long) file < 0) {
+        reply_status(req, (long) file);
+        return;
+    }
+    fi->fh = (uint64_t) file;
+    set_caching(fi);
+    fuse_reply_open(req, fi);
 }
 
-int
-nufs_truncate(const char *path, off_t size)
+// open(2) with O_CREAT, makes the file and opens it in one go
+void
+nufs_create(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode,
+            struct fuse_file_info* fi)
 {
-    printf("truncate(%s, %ld bytes)\n", path, size);
-    return inode_truncate(path, size);
+    log_trace("create(%lu, %s, %04o)", parent, name, mode);
+    long inodeId = get_new_inode_at(id_of(parent), name, mode, 0);
+    if (inodeId < 0) {
+        reply_status(req, inodeId);
+        return;
+    }
+    open_file* file = open_handle_id(inodeId);
+    if ((long) file < 0) {
+        forget_inode(inodeId, 1);
+        reply_status(req, (long) file);
+        return;
+    }
+    fi->fh = (uint64_t) file;
+    set_caching(fi);
+    struct fuse_entry_param entry;
+    fill_entry(&entry, inodeId);
+    fuse_reply_create(req, &entry, fi);
 }
 
-// this is called on open, but doesn't need to do much
-// since FUSE doesn't assume you maintain state for
-// open files.
-int
-nufs_open(const char *path, struct fuse_file_info *fi)
+// The last close of an open file
+void
+nufs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
 {
-    printf("open(%s)\n", path);
-    inode* node = get_inode(path);
-    if ((long) node < 0) {
-      return (long) node;
+    log_trace("release(%lu)", ino);
+    if (is_control(ino)) {
+        free((stats_snapshot*) fi->fh);
     }
     else {
-      return 0;
+        release_handle((open_file*) fi->fh);
     }
+    fuse_reply_err(req, 0);
 }
 
 // Actually read data
-int
-nufs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+void
+nufs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info* fi)
 {
-    printf("read(%s, %ld bytes, @%ld)\n", path, size, offset);
-    return read_path(path, buf, size, offset);
+    log_trace("read(%lu, %ld bytes, @%ld)", ino, size, offset);
+    if (is_control(ino)) {
+        stats_snapshot* snapshot = (stats_snapshot*) fi->fh;
+        if (offset >= (off_t) snapshot->size) {
+            size = 0;
+        }
+        else if (offset + size > snapshot->size) {
+            size = snapshot->size - offset;
+        }
+        fuse_reply_buf(req, snapshot->text + offset, size);
+        return;
+    }
+    char* buf = arena_alloc(size);
+    int rv = read_handle((open_file*) fi->fh, buf, size, offset);
+    if (rv < 0) {
+        reply_status(req, rv);
+    }
+    else {
+        fuse_reply_buf(req, buf, rv);
+    }
+    arena_reset();
 }
 
 // Actually write data
-int
-nufs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+void
+nufs_write(fuse_req_t req, fuse_ino_t ino, const char* buf, size_t size, off_t offset,
+           struct fuse_file_info* fi)
 {
-    printf("write(%s, %ld bytes, @%ld)\n", path, size, offset);
-    inode* node = get_or_create_inode(path);
-    int writeSize = write_to_inode(node, (void*) buf, size, offset);
-    return writeSize;
+    log_trace("write(%lu, %ld bytes, @%ld)", ino, size, offset);
+    int rv = write_handle((open_file*) fi->fh, buf, size, offset);
+    if (rv < 0) {
+        reply_status(req, rv);
+        return;
+    }
+    fuse_reply_write(req, rv);
 }
 
-// Update the timestamps on a file or directory.
-int
-nufs_utimens(const char* path, const struct timespec ts[2])
-{
-  inode* node = get_inode(path);
-  if ((long) node < 0) {
-    return (long) node;
-  }
-  // inodes are mapped straight into memory, so updating the inode should
-  // update the memory
-  memcpy(&node->atim, &ts[0], sizeof(struct timespec));
-  memcpy(&node->mtim, &ts[1], sizeof(struct timespec));
-	return 0;
-}
-
-void
-nufs_init_ops(struct fuse_operations* ops)
-{
-    memset(ops, 0, sizeof(struct fuse_operations));
-    ops->access   = nufs_access;
-    ops->getattr  = nufs_getattr;
-    ops->readdir  = nufs_readdir;
-    ops->mknod    = nufs_mknod;
-    ops->mkdir    = nufs_mkdir;
-    ops->link     = nufs_link;
-    ops->unlink   = nufs_unlink;
-    ops->rmdir    = nufs_rmdir;
-    ops->rename   = nufs_rename;
-    ops->chmod    = nufs_chmod;
-    ops->truncate = nufs_truncate;
-    ops->open	  = nufs_open;
-    ops->read     = nufs_read;
-    ops->write    = nufs_write;
-    ops->utimens  = nufs_utimens;
+typedef struct dir_reply {
+    fuse_req_t req;
+    char* buf;
+    size_t size;
+    size_t used;
+} dir_reply;
+
+// Adds one entry to the reply, says when it is full. Only the type and
+// inode number of the stat are looked at.
+static int
+add_entry(void* context, const char* name, long inodeId, int type, long next)
+{
+    dir_reply* reply = context;
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    st.st_ino = ino_of(inodeId);
+    st.st_mode = DTTOIF(type);
+    size_t needed = fuse_add_direntry(reply->req, reply->buf + reply->used,
+                                      reply->size - reply->used, name, &st, next);
+    if (needed > reply->size - reply->used) {
+        return 1;
+    }
+    reply->used += needed;
+    return 0;
+}
+
+static int
+list_control(dir_reply* reply, off_t offset)
+{
+    const char* names[] = {".", "..", STATS_NAME};
+    fuse_ino_t inos[] = {CONTROL_DIR_INO, FUSE_ROOT_ID, STATS_INO};
+    for (off_t i = offset; i < 3; ++i) {
+        struct stat st;
+        control_stat(inos[i], &st);
+        size_t needed = fuse_add_direntry(reply->req, reply->buf + reply->used,
+                                          reply->size - reply->used, names[i], &st, i + 1);
+        if (needed > reply->size - reply->used) {
+            break;
+        }
+        reply->used += needed;
+    }
+    return 0;
+}
+
+// implementation for: man 2 readdir
+// lists the contents of a directory
+void
+nufs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+             struct fuse_file_info* fi)
+{
+    log_trace("readdir(%lu, @%ld)", ino, offset);
+    dir_reply reply = {req, arena_alloc(size), size, 0};
+    int rv;
+    if (is_control(ino)) {
+        rv = list_control(&reply, offset);
+    }
+    else {
+        rv = list_dir_at(id_of(ino), offset, add_entry, &reply);
+    }
+    if (rv < 0) {
+        reply_status(req, rv);
+    }
+    else {
+        fuse_reply_buf(req, reply.buf, reply.used);
+    }
+    arena_reset();
+}
+
+// implementation for: man 2 access
+// Checks if a file exists.
+void
+nufs_access(fuse_req_t req, fuse_ino_t ino, int mask)
+{
+    log_trace("access(%lu, %04o)", ino, mask);
+    fuse_reply_err(req, (is_control(ino) && (mask & W_OK)) ? EACCES : 0);
+}
+
+// Commits everything so far, concurrent fsyncs share one commit
+void
+nufs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info* fi)
+{
+    log_trace("fsync(%lu)", ino);
+    reply_status(req, storage_sync());
+}
+
+// Called on every close(). Only the fsync mode makes a close durable,
+// the others leave it to the next commit.
+void
+nufs_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+    log_trace("flush(%lu)", ino);
+    int rv = 0;
+    if (durabilityMode == DURABILITY_FSYNC) {
+        rv = storage_sync();
+    }
+    reply_status(req, rv);
+}
+
+// Runs once the kernel has connected, after fuse_daemonize has forked,
+// so this is where background threads start
+void
+nufs_init(void* userData, struct fuse_conn_info* conn)
+{
+    log_start(0);
+    storage_set_durability(durabilityMode, config.commitMs);
+}
+
+// Unmounting, anything not committed yet would be lost
+void
+nufs_destroy(void* userData)
+{
+    storage_commit();
+    log_stop();
+}
+
+// Wraps handler so every request it serves, reply included, is timed
+// into opStats[op]
+#define TIMED(name, op, handler, params, args) \
+    static void \
+    timed_##name params \
+    { \
+        long start = stats_now(); \
+        handler args; \
+        histogram_record(&opStats[op], stats_now() - start); \
+    }
+
+TIMED(lookup, OP_LOOKUP, nufs_lookup,
+      (fuse_req_t req, fuse_ino_t parent, const char* name), (req, parent, name))
+TIMED(forget, OP_FORGET, nufs_forget,
+      (fuse_req_t req, fuse_ino_t ino, unsigned long nlookup), (req, ino, nlookup))
+TIMED(forget_multi, OP_FORGET_MULTI, nufs_forget_multi,
+      (fuse_req_t req, size_t count, struct fuse_forget_data* forgets), (req, count, forgets))
+TIMED(getattr, OP_GETATTR, nufs_getattr,
+      (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi), (req, ino, fi))
+TIMED(setattr, OP_SETATTR, nufs_setattr,
+      (fuse_req_t req, fuse_ino_t ino, struct stat* attr, int toSet, struct fuse_file_info* fi),
+      (req, ino, attr, toSet, fi))
+TIMED(access, OP_ACCESS, nufs_access,
+      (fuse_req_t req, fuse_ino_t ino, int mask), (req, ino, mask))
+TIMED(readdir, OP_READDIR, nufs_readdir,
+      (fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info* fi),
+      (req, ino, size, offset, fi))
+TIMED(mknod, OP_MKNOD, nufs_mknod,
+      (fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode, dev_t rdev),
+      (req, parent, name, mode, rdev))
+TIMED(mkdir, OP_MKDIR, nufs_mkdir,
+      (fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode),
+      (req, parent, name, mode))
+TIMED(link, OP_LINK, nufs_link,
+      (fuse_req_t req, fuse_ino_t ino, fuse_ino_t newParent, const char* newName),
+      (req, ino, newParent, newName))
+TIMED(unlink, OP_UNLINK, nufs_unlink,
+      (fuse_req_t req, fuse_ino_t parent, const char* name), (req, parent, name))
+TIMED(rmdir, OP_RMDIR, nufs_rmdir,
+      (fuse_req_t req, fuse_ino_t parent, const char* name), (req, parent, name))
+TIMED(rename, OP_RENAME, nufs_rename,
+      (fuse_req_t req, fuse_ino_t parent, const char* name, fuse_ino_t newParent,
+       const char* newName),
+      (req, parent, name, newParent, newName))
+TIMED(open, OP_OPEN, nufs_open,
+      (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi), (req, ino, fi))
+TIMED(create, OP_CREATE, nufs_create,
+      (fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode,
+       struct fuse_file_info* fi),
+      (req, parent, name, mode, fi))
+TIMED(release, OP_RELEASE, nufs_release,
+      (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi), (req, ino, fi))
+TIMED(read, OP_READ, nufs_read,
+      (fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info* fi),
+      (req, ino, size, offset, fi))
+TIMED(write, OP_WRITE, nufs_write,
+      (fuse_req_t req, fuse_ino_t ino, const char* buf, size_t size, off_t offset,
+       struct fuse_file_info* fi),
+      (req, ino, buf, size, offset, fi))
+TIMED(flush, OP_FLUSH, nufs_flush,
+      (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi), (req, ino, fi))
+TIMED(fsync, OP_FSYNC, nufs_fsync,
+      (fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info* fi),
+      (req, ino, datasync, fi))
+TIMED(fsyncdir, OP_FSYNCDIR, nufs_fsync,
+      (fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info* fi),
+      (req, ino, datasync, fi))
+
+void
+nufs_init_ops(struct fuse_lowlevel_ops* ops)
+{
+    memset(ops, 0, sizeof(struct fuse_lowlevel_ops));
+    ops->lookup       = timed_lookup;
+    ops->forget       = timed_forget;
+    ops->forget_multi = timed_forget_multi;
+    ops->getattr      = timed_getattr;
+    ops->setattr      = timed_setattr;
+    ops->access       = timed_access;
+    ops->readdir      = timed_readdir;
+    ops->mknod        = timed_mknod;
+    ops->mkdir        = timed_mkdir;
+    ops->link         = timed_link;
+    ops->unlink       = timed_unlink;
+    ops->rmdir        = timed_rmdir;
+    ops->rename       = timed_rename;
+    ops->open         = timed_open;
+    ops->create       = timed_create;
+    ops->release      = timed_release;
+    ops->read         = timed_read;
+    ops->write        = timed_write;
+    ops->flush        = timed_flush;
+    ops->fsync        = timed_fsync;
+    ops->fsyncdir     = timed_fsyncdir;
+    ops->init         = nufs_init;
+    ops->destroy      = nufs_destroy;
 };
 
-struct fuse_operations nufs_ops;
+struct fuse_lowlevel_ops nufs_ops;
+
+// Mounts and serves requests until unmounted, the same as fuse_main does
+// for the high level API
+int
+serve(struct fuse_args* args)
+{
+    char* mountpoint;
+    int multithreaded;
+    int foreground;
+    if (fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) < 0) {
+        return 1;
+    }
+    int rv = 1;
+    struct fuse_chan* chan = fuse_mount(mountpoint, args);
+    if (chan) {
+        struct fuse_session* session = fuse_lowlevel_new(args, &nufs_ops, sizeof(nufs_ops), 0);
+        if (session && fuse_set_signal_handlers(session) == 0) {
+            fuse_session_add_chan(session, chan);
+            fuse_daemonize(foreground);
+            rv = multithreaded ? fuse_session_loop_mt(session) : fuse_session_loop(session);
+            fuse_remove_signal_handlers(session);
+            fuse_session_remove_chan(chan);
+        }
+        if (session) {
+            fuse_session_destroy(session);
+        }
+        fuse_unmount(mountpoint, chan);
+    }
+    free(mountpoint);
+    return rv ? 1 : 0;
+}
 
 int
 main(int argc, char *argv[])
 {
-    assert(argc > 2 && argc < 6);
-    storage_init(argv[--argc]);
+    assert(argc > 2);
+    const char* image = argv[--argc];
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    if (fuse_opt_parse(&args, &config, nufs_opts, 0) < 0) {
+        return 1;
+    }
+    if (config.durability) {
+        if (strcmp(config.durability, "none") == 0) {
+            durabilityMode = DURABILITY_NONE;
+        }
+        else if (strcmp(config.durability, "periodic") == 0) {
+            durabilityMode = DURABILITY_PERIODIC;
+        }
+        else if (strcmp(config.durability, "fsync") == 0) {
+            durabilityMode = DURABILITY_FSYNC;
+        }
+        else {
+            fprintf(stderr, "nufs: durability must be none, periodic or fsync\n");
+            return 1;
+        }
+    }
+    if (config.log) {
+        int level = log_parse_level(config.log);
+        if (level < 0) {
+            fprintf(stderr, "nufs: log must be error, warn, info, debug or trace\n");
+            return 1;
+        }
+        log_set_level(level);
+    }
+    // Periodic commits start in nufs_init, a thread started here wouldn't
+    // make it through fuse_daemonize
+    storage_set_durability(DURABILITY_NONE, 0);
+    int rv = storage_init(image);
+    if (rv < 0) {
+        fprintf(stderr, "nufs: can't open %s: %s\n", image, strerror(-rv));
+        return 1;
+    }
     nufs_init_ops(&nufs_ops);
-    return fuse_main(argc, argv, &nufs_ops, NULL);
+    rv = serve(&args);
+    fuse_opt_free_args(&args);
+    return rv;
 }
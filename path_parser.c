@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "path_parser.h"
 
 #include <string.h>
@@ -16,44 +17,24 @@ occurences(char* str, char c) {
   return count;
 }
 
-void
-add_string(string_array* arr, char* buf, long length) {
-  // This assumes the thing is already malloc-ed to the correct length
-  arr->data[arr->length] = malloc(sizeof(char) * (length + 1));
-  memcpy(arr->data[arr->length], buf, length);
-  arr->data[arr->length][length] = 0;
-  ++arr->length;
-}
-
 string_array*
 parse_path(char* path)
 {
-  // I think it's determined elsewhere that 256 is the max
-  char temp[256] = "";
   char* start = path;
-  int startWithSlash = start && *start == '/';
   while (start && *start == '/') {
     ++start;
   }
-  string_array* array = malloc(sizeof(string_array));
+  arena_mark mark = arena_save();
+  string_array* array = arena_alloc(sizeof(string_array));
+  array->mark = mark;
   array->length = 0;
-  array->data = malloc(sizeof(char*) * (occurences(start, '/') + 1));
-  int startIndex = 0;
-  int tempIndex = 0;
+  array->data = arena_alloc(sizeof(char*) * (occurences(start, '/') + 1));
   while (start && *start) {
-    if (*start == '/') {
-      add_string(array, temp, tempIndex);
-      tempIndex = 0;
-      memset(temp, 0, 256);
+    char* end = strchrnul(start, '/');
+    if (end > start) {
+      array->data[array->length++] = arena_strndup(start, end - start);
     }
-    else {
-      temp[tempIndex] = *start;
-      ++tempIndex;
-    }
-    ++start;
-  }
-  if (tempIndex > 0) {
-    add_string(array, temp, tempIndex);
+    start = (*end) ? end + 1 : end;
   }
   return array;
 }
@@ -66,8 +47,38 @@ get_last(string_array* arr) {
 
 void
 free_string_array(string_array* array) {
-  for (int i = 0; i < array->length; ++i) {
-    free(array->data[i]);
+  arena_release(array->mark);
+}
+
+static const char*
+skip_slashes(const char* path) {
+  while (*path == '/') {
+    ++path;
+  }
+  return path;
+}
+
+void
+path_iter_init(path_iter* iter, const char* path) {
+  iter->rest = path ? path : "";
+}
+
+// Points name at the next component, 0 once there are none left
+int
+path_next(path_iter* iter, const char** name, size_t* len) {
+  const char* start = skip_slashes(iter->rest);
+  if (!*start) {
+    iter->rest = start;
+    return 0;
   }
-  free(array);
+  const char* end = strchrnul(start, '/');
+  *name = start;
+  *len = end - start;
+  iter->rest = end;
+  return 1;
+}
+
+int
+path_has_next(const path_iter* iter) {
+  return *skip_slashes(iter->rest) != 0;
 }
@@ -1,9 +1,15 @@
 #ifndef PATH_PARSER_H
 #define PATH_PARSER_H
 
+#include <stddef.h>
+#include "arena.h"
+
+// Lives in the calling thread's arena, free_string_array releases it
+// along with anything allocated there after it
 typedef struct string_array {
   char** data;
   long length;
+  arena_mark mark;
 } string_array;
 
 /*
@@ -17,4 +23,17 @@ string_array* parse_path(char* string);
 char* get_last(string_array* array);
 void free_string_array(string_array* array);
 
+/*
+ Walks a path's components in place as (name, len) slices of the path
+ itself, nothing is copied or allocated. Runs of slashes separate
+ components the same as one does, a trailing slash is ignored.
+*/
+typedef struct path_iter {
+  const char* rest;
+} path_iter;
+
+void path_iter_init(path_iter* iter, const char* path);
+int path_next(path_iter* iter, const char** name, size_t* len);
+int path_has_next(const path_iter* iter);
+
 #endif
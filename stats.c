@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <time.h>
+
+#include "stats.h"
+
+long statsCounters[STAT_COUNTERS];
+
+static const char* counterNames[STAT_COUNTERS] = {
+  "blocks_allocated",
+  "alloc_calls",
+  "alloc_words_scanned",
+  "dir_lookups",
+  "dcache_hits",
+  "dcache_misses",
+  "bytes_read",
+  "bytes_written",
+  "commits",
+};
+
+// Anything slower than this lands in the last bucket
+#define STATS_MAX_NS ((1L << (STATS_MAX_SHIFT + STATS_SUB_BITS + 1)) - 1)
+
+long
+stats_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+// Values below 2 << STATS_SUB_BITS get a bucket each, above that the
+// top STATS_SUB_BITS bits after the leading one pick the bucket
+static int
+bucket_of(long ns) {
+  if (ns <= 0) {
+    return 0;
+  }
+  if (ns > STATS_MAX_NS) {
+    ns = STATS_MAX_NS;
+  }
+  int shift = 63 - __builtin_clzl(ns) - STATS_SUB_BITS;
+  if (shift < 0) {
+    shift = 0;
+  }
+  return (shift << STATS_SUB_BITS) + (ns >> shift);
+}
+
+// The biggest value that lands in bucket
+static long
+bucket_top(int bucket) {
+  int shift = (bucket >> STATS_SUB_BITS) - 1;
+  if (shift <= 0) {
+    return bucket;
+  }
+  long base = (long) (bucket - (shift << STATS_SUB_BITS)) << shift;
+  return base + (1L << shift) - 1;
+}
+
+void
+histogram_record(latency_histogram* hist, long ns) {
+  __atomic_add_fetch(&hist->count, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&hist->totalNs, ns, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&hist->buckets[bucket_of(ns)], 1, __ATOMIC_RELAXED);
+  long max = __atomic_load_n(&hist->maxNs, __ATOMIC_RELAXED);
+  while (ns > max && !__atomic_compare_exchange_n(&hist->maxNs, &max, ns, 1,
+                                                  __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+// Smallest value at least percent of the recordings were at or under
+long
+histogram_percentile(latency_histogram* hist, double percent) {
+  long count = __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+  long max = __atomic_load_n(&hist->maxNs, __ATOMIC_RELAXED);
+  long target = (long) (count * percent / 100.0 + 0.999999);
+  if (target < 1) {
+    target = 1;
+  }
+  long seen = 0;
+  for (int i = 0; i < STATS_BUCKETS; ++i) {
+    seen += __atomic_load_n(&hist->buckets[i], __ATOMIC_RELAXED);
+    if (seen >= target) {
+      long top = bucket_top(i);
+      return (top < max) ? top : max;
+    }
+  }
+  return max;
+}
+
+static size_t
+append(char* buf, size_t size, size_t used, const char* format, ...) {
+  if (used >= size) {
+    return used;
+  }
+  va_list args;
+  va_start(args, format);
+  int rv = vsnprintf(buf + used, size - used, format, args);
+  va_end(args);
+  if (rv < 0) {
+    return used;
+  }
+  return (used + rv < size) ? used + rv : size - 1;
+}
+
+static double
+ratio(long part, long whole) {
+  return whole ? (double) part / whole : 0.0;
+}
+
+// Writes every counter and histogram out as text, one "name value" or
+// "op name key value..." line each, and returns how long it came to
+size_t
+stats_format(char* buf, size_t size, latency_histogram* hists, int count) {
+  if (size == 0) {
+    return 0;
+  }
+  buf[0] = 0;
+  long counters[STAT_COUNTERS];
+  size_t used = 0;
+  for (int i = 0; i < STAT_COUNTERS; ++i) {
+    counters[i] = __atomic_load_n(&statsCounters[i], __ATOMIC_RELAXED);
+    used = append(buf, size, used, "%s %ld\n", counterNames[i], counters[i]);
+  }
+  used = append(buf, size, used, "dcache_hit_rate %.4f\n",
+                ratio(counters[STAT_DCACHE_HITS],
+                      counters[STAT_DCACHE_HITS] + counters[STAT_DCACHE_MISSES]));
+  used = append(buf, size, used, "alloc_words_per_call %.2f\n",
+                ratio(counters[STAT_ALLOC_WORDS_SCANNED], counters[STAT_ALLOC_CALLS]));
+  for (int i = 0; i < count; ++i) {
+    latency_histogram* hist = &hists[i];
+    long calls = __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+    long total = __atomic_load_n(&hist->totalNs, __ATOMIC_RELAXED);
+    used = append(buf, size, used,
+                  "op %s count %ld mean_ns %ld p50_ns %ld p90_ns %ld p99_ns %ld "
+                  "p999_ns %ld max_ns %ld\n",
+                  hist->name, calls, calls ? total / calls : 0,
+                  calls ? histogram_percentile(hist, 50) : 0,
+                  calls ? histogram_percentile(hist, 90) : 0,
+                  calls ? histogram_percentile(hist, 99) : 0,
+                  calls ? histogram_percentile(hist, 99.9) : 0,
+                  __atomic_load_n(&hist->maxNs, __ATOMIC_RELAXED));
+  }
+  return used;
+}
@@ -0,0 +1,51 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+
+/*
+ Counters and latency histograms for seeing where the time goes in a
+ live mount, nufs serves them up as /.nufs/stats.
+
+ Counters are bumped with relaxed atomics from wherever the thing they
+ count happens. Histograms are log-linear like HDR histograms: exact up
+ to 32ns, then every power of two is split into 16 buckets, so a
+ percentile is within about 6% of the real value.
+*/
+
+enum {
+  STAT_BLOCKS_ALLOCATED,
+  STAT_ALLOC_CALLS,
+  STAT_ALLOC_WORDS_SCANNED,
+  STAT_DIR_LOOKUPS,
+  STAT_DCACHE_HITS,
+  STAT_DCACHE_MISSES,
+  STAT_BYTES_READ,
+  STAT_BYTES_WRITTEN,
+  STAT_COMMITS,
+  STAT_COUNTERS
+};
+
+#define STATS_SUB_BITS 4
+#define STATS_MAX_SHIFT 36
+#define STATS_BUCKETS ((STATS_MAX_SHIFT + 2) << STATS_SUB_BITS)
+
+extern long statsCounters[STAT_COUNTERS];
+
+#define stats_add(counter, amount) \
+  __atomic_add_fetch(&statsCounters[counter], (amount), __ATOMIC_RELAXED)
+
+typedef struct latency_histogram {
+  const char* name;
+  long count;
+  long totalNs;
+  long maxNs;
+  long buckets[STATS_BUCKETS];
+} latency_histogram;
+
+long stats_now();
+void histogram_record(latency_histogram* hist, long ns);
+long histogram_percentile(latency_histogram* hist, double percent);
+size_t stats_format(char* buf, size_t size, latency_histogram* hists, int count);
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,91 +10,479 @@
 #include <assert.h>
 #include <time.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "bitmap.h"
 #include "directory.h"
 #include "storage.h"
 #include "path_parser.h"
+#include "arena.h"
+#include "dcache.h"
+#include "alloc.h"
+#include "journal.h"
+#include "log.h"
+#include "stats.h"
 
-#define NUM_INODES
-#define BLOCK_BITFIELD_LENGTH (DISK_SIZE / BLOCK_SIZE) / 8
+// How often periodic durability commits unless told otherwise
+#define COMMIT_INTERVAL_MS 5000
+// Commit early rather than keep this much file data in private pages
+#define DIRTY_DATA_BYTES (64 * 1024 * 1024)
+#define MAX_PENDING_FREES 1024
 
+// Kept in memory only, alongside each inode's lock. use moves on when the
+// inode is freed, so a handle can tell it now belongs to someone else,
+// and map whenever blocks are taken away from the file, so cached runs
+// can tell they are stale. Blocks being added never moves a run that
+// was already mapped.
+typedef struct inode_gens {
+  uint32_t use;
+  uint32_t map;
+  // How many times the id has been handed out through the *_at functions
+  // and not forgotten yet, see forget_inode
+  long lookups;
+} inode_gens;
+
+// Where everything ended up once the image is mapped. The pointers are
+// all into the mapping, the geometry is copied out of the superblock.
+//
+// The image is mapped privately, so nothing reaches the file until a
+// commit writes it there. Everything changed since the last commit is
+// marked in the dirty bitmaps (one bit per block, metadata and file data
+// kept apart since only metadata goes through the journal), and blocks
+// freed since then wait in pending so they can't be handed out again
+// before the transaction that freed them is on disk.
 typedef struct meta_block {
-  inode root;
-  byte block_status[BLOCK_COUNT / 8 + 1];
-  byte inode_status[INODE_COUNT / 8 + 1];
-  inode inodes[INODE_COUNT];
+  superblock* sb;
+  inode* root;
+  alloc_map blocks;
+  alloc_map inode_map;
+  inode* inodes;
   int starting_block_index;
+  size_t block_size;
+  long block_count;
+  long inode_count;
   byte* block_start;
+  size_t image_size;
+  int fd;
+  pthread_rwlock_t* locks;
+  inode_gens* gens;
+  long lock_count;
+  uint64_t* dirty_meta;
+  uint64_t* dirty_data;
+  long dirty_meta_count;
+  long dirty_data_count;
+  journal_extent* pending;
+  long pending_count;
+  long pending_size;
+  pthread_mutex_t pending_lock;
+  uint64_t sequence;
 } meta_block;
 
-typedef struct inode_pair {
-  inode* parent;
-  inode* child;
-} inode_pair;
+meta_block metaData = { .fd = -1, .pending_lock = PTHREAD_MUTEX_INITIALIZER };
+meta_block* meta = &metaData;
 
-meta_block* meta;
+// Operations that change the image hold this shared for as long as they
+// run, a commit holds it exclusively so it only ever sees whole
+// operations. It comes before every other lock.
+static pthread_rwlock_t txnLock;
+static pthread_once_t txnOnce = PTHREAD_ONCE_INIT;
 
-int
-block_taken(int blockId) {
-  return get_bit_state((byte*) &meta->block_status, blockId);
+static durability durabilityMode = DURABILITY_PERIODIC;
+static long commitInterval = COMMIT_INTERVAL_MS;
+
+// Group commit for storage_sync. Commits are numbered as they start, a
+// sync waits for the first one to start after it was called, so every
+// sync that arrives while one is running shares the next.
+static pthread_mutex_t syncLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t syncCond = PTHREAD_COND_INITIALIZER;
+static uint64_t syncStarted;
+static uint64_t syncFinished;
+static int syncRunning;
+static int syncResult;
+
+static void
+mark_dirty(uint64_t* bits, long* count, long blockId) {
+  uint64_t bit = (uint64_t) 1 << (blockId % 64);
+  if (!(__atomic_fetch_or(&bits[blockId / 64], bit, __ATOMIC_RELAXED) & bit)) {
+    __atomic_add_fetch(count, 1, __ATOMIC_RELAXED);
+  }
+}
+
+static void
+clear_dirty(uint64_t* bits, long* count, long blockId) {
+  uint64_t bit = (uint64_t) 1 << (blockId % 64);
+  if (__atomic_fetch_and(&bits[blockId / 64], ~bit, __ATOMIC_RELAXED) & bit) {
+    __atomic_sub_fetch(count, 1, __ATOMIC_RELAXED);
+  }
+}
+
+void
+meta_dirty(long blockId) {
+  mark_dirty(meta->dirty_meta, &meta->dirty_meta_count, blockId);
+}
+
+void
+data_dirty(long start, long count) {
+  for (long i = start; i < start + count; ++i) {
+    mark_dirty(meta->dirty_data, &meta->dirty_data_count, i);
+  }
+}
+
+void
+inode_dirty(inode* node) {
+  meta_dirty(((byte*) node - meta->block_start) / meta->block_size);
+}
+
+// Marks the blocks holding bits [first, first + count) of a bitmap
+void
+bitmap_dirty(long bitmapStart, long first, long count) {
+  long bitsPerBlock = meta->block_size * 8;
+  for (long block = first / bitsPerBlock; block <= (first + count - 1) / bitsPerBlock; ++block) {
+    meta_dirty(bitmapStart + block);
+  }
 }
 
 void*
 get_block_address(int blockId) {
-  return (void*)((long)meta + ((long)blockId * BLOCK_SIZE));
+  return meta->block_start + (long) blockId * meta->block_size;
 }
 
-size_t
-write_to_block(int blockId, void* data, size_t size, off_t offset) {
-  // We know that root's block is the first in the fs
-  byte* blockAddress = get_block_address(blockId);
-  size_t writeSize = (size >= BLOCK_SIZE) ? BLOCK_SIZE : size;
-  memcpy(&blockAddress[offset], data, writeSize);
-  return writeSize;
+const void*
+block_view(int blockId) {
+  return get_block_address(blockId);
 }
 
-void
-zero_block(int blockId) {
-  void* zeros = malloc(BLOCK_SIZE);
-  memset(zeros, 0, BLOCK_SIZE);
-  write_to_block(blockId, zeros, BLOCK_SIZE, 0);
-  free(zeros);
+void*
+block_mut(int blockId) {
+  meta_dirty(blockId);
+  return get_block_address(blockId);
+}
+
+// Like block_mut but for file contents, which don't get journaled
+byte*
+data_mut(long blockId, long count) {
+  data_dirty(blockId, count);
+  return get_block_address(blockId);
 }
 
 void
 take_block(int blockId) {
-  if (blockId >= meta->starting_block_index) {
-    zero_block(blockId);
+  alloc_set(&meta->blocks, blockId);
+  bitmap_dirty(meta->sb->block_bitmap_start, blockId, 1);
+}
+
+// Claims up to want blocks in a row, as close after goal as it can find
+// them. A negative goal carries on from the last allocation. Free blocks
+// are always zero (see release_blocks) so these come back zeroed without
+// anything being written.
+long
+get_block_run(long goal, long want, long* got) {
+  long start = alloc_run(&meta->blocks, goal, want, got);
+  if (start >= 0) {
+    stats_add(STAT_BLOCKS_ALLOCATED, *got);
+    bitmap_dirty(meta->sb->block_bitmap_start, start, *got);
+    // The allocation hint lives in the superblock
+    meta_dirty(0);
   }
-  set_bit_high((byte*) &meta->block_status, blockId);
+  return start;
 }
 
 int
 get_next_block() {
-  for (int i = 0; i < BLOCK_COUNT; ++i) {
-    if (!block_taken(i)) {
-      take_block(i);
-      return i;
-    }
+  long got;
+  return get_block_run(-1, 1, &got);
+}
+
+size_t
+storage_block_size() {
+  return meta->block_size;
+}
+
+// Blocks stay taken until the transaction freeing them commits, until
+// then the old contents still matter if we crash. The commit zeroes them
+// and gives them back (see punch_blocks).
+void
+release_blocks(long start, long count) {
+  // Never hand back the superblock, bitmaps or inode table
+  if (start < meta->starting_block_index) {
+    return;
+  }
+  for (long i = start; i < start + count; ++i) {
+    // Whatever was written to them no longer needs to go anywhere
+    clear_dirty(meta->dirty_meta, &meta->dirty_meta_count, i);
+    clear_dirty(meta->dirty_data, &meta->dirty_data_count, i);
+  }
+  pthread_mutex_lock(&meta->pending_lock);
+  if (meta->pending_count == meta->pending_size) {
+    meta->pending_size = (meta->pending_size) ? meta->pending_size * 2 : 64;
+    meta->pending = realloc(meta->pending, meta->pending_size * sizeof(journal_extent));
   }
-  return -ENOSPC;
+  meta->pending[meta->pending_count].start = start;
+  meta->pending[meta->pending_count].length = count;
+  __atomic_add_fetch(&meta->pending_count, 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&meta->pending_lock);
 }
 
 void
 release_block(int blockId) {
-  if (meta->root.nlink > 0 && meta->root.direct < blockId) {
-    set_bit_low((byte*) &meta->block_status, blockId);
+  release_blocks(blockId, 1);
+}
+
+static void
+init_txn() {
+  pthread_rwlockattr_t attr;
+  pthread_rwlockattr_init(&attr);
+  // Commits would never get in under a steady stream of operations
+  pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  pthread_rwlock_init(&txnLock, &attr);
+  pthread_rwlockattr_destroy(&attr);
+}
+
+// First block at or after from marked in bits, or block_count
+static long
+next_marked(uint64_t* bits, long from) {
+  long words = (meta->block_count + 63) / 64;
+  long word = from / 64;
+  if (word >= words) {
+    return meta->block_count;
+  }
+  uint64_t marked = bits[word] & (~(uint64_t) 0 << (from % 64));
+  while (!marked) {
+    if (++word >= words) {
+      return meta->block_count;
+    }
+    marked = bits[word];
+  }
+  return word * 64 + __builtin_ctzll(marked);
+}
+
+static int
+is_marked(uint64_t* bits, long blockId) {
+  return (bits[blockId / 64] >> (blockId % 64)) & 1;
+}
+
+// Finds the next run of marked blocks at or after from, returning its
+// start (block_count when there are none) and setting end past it
+static long
+next_run(uint64_t* bits, long from, long* end) {
+  long start = next_marked(bits, from);
+  *end = start;
+  while (*end < meta->block_count && is_marked(bits, *end)) {
+    ++*end;
+  }
+  return start;
+}
+
+// Writes every block marked in bits back to its place in the file, one
+// pwrite per run of neighbours
+static int
+write_back(uint64_t* bits) {
+  long end;
+  for (long start = next_run(bits, 0, &end); start < meta->block_count;
+       start = next_run(bits, end, &end)) {
+    size_t size = (end - start) * meta->block_size;
+    off_t offset = (off_t) start * meta->block_size;
+    if (pwrite(meta->fd, get_block_address(start), size, offset) != (ssize_t) size) {
+      return -EIO;
+    }
+  }
+  return 0;
+}
+
+// Once the file holds the same thing, the private copies of these pages
+// can go, the mapping reads them from the file again after that.
+static void
+drop_private(long start, long count) {
+  long page = sysconf(_SC_PAGESIZE);
+  uintptr_t from = (uintptr_t) get_block_address(start) & ~(page - 1);
+  uintptr_t to = ((uintptr_t) get_block_address(start + count) + page - 1) & ~(page - 1);
+  madvise((void*) from, to - from, MADV_DONTNEED);
+}
+
+// Drops every marked block's private copy and clears the marks
+static void
+drop_marked(uint64_t* bits) {
+  long end;
+  for (long start = next_run(bits, 0, &end); start < meta->block_count;
+       start = next_run(bits, end, &end)) {
+    drop_private(start, end - start);
+  }
+  memset(bits, 0, (meta->block_count + 63) / 64 * sizeof(uint64_t));
+}
+
+// Zeroes freed blocks in the file and gives them back to the allocator
+static void
+punch_blocks(long start, long count) {
+  off_t offset = (off_t) start * meta->block_size;
+  off_t length = (off_t) count * meta->block_size;
+  if (fallocate(meta->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) < 0) {
+    static byte zeros[MAX_BLOCK_SIZE];
+    for (long i = 0; i < count; ++i) {
+      pwrite(meta->fd, zeros, meta->block_size, offset + i * meta->block_size);
+    }
+  }
+  alloc_clear_run(&meta->blocks, start, count);
+  bitmap_dirty(meta->sb->block_bitmap_start, start, count);
+}
+
+/*
+ Ordered like ext3's ordered mode: file data goes straight to where it
+ belongs, then the metadata is logged and synced, which is the commit
+ point. Only after that is the metadata written over its old copy, so
+ a crash leaves either the old or the new version of every operation
+ in this transaction. Must hold txnLock exclusively.
+*/
+static int
+commit_locked() {
+  if (meta->fd < 0 ||
+      (!meta->dirty_meta_count && !meta->dirty_data_count && !meta->pending_count)) {
+    return 0;
+  }
+  int rv = write_back(meta->dirty_data);
+  if (rv < 0) {
+    return rv;
+  }
+  uint32_t* homes = malloc((meta->dirty_meta_count + 1) * sizeof(uint32_t));
+  long count = 0;
+  for (long i = next_marked(meta->dirty_meta, 0); i < meta->block_count;
+       i = next_marked(meta->dirty_meta, i + 1)) {
+    homes[count++] = i;
+  }
+  rv = journal_commit(meta->fd, meta->sb, ++meta->sequence, homes, count,
+                      meta->pending, meta->pending_count, meta->block_start);
+  free(homes);
+  if (rv == -ENOSPC) {
+    // Too big to log in one go, the best we can do is write it in place
+    log_warn("nufs: transaction too big for the journal, writing it unlogged");
+    rv = journal_invalidate(meta->fd, meta->sb);
+  }
+  if (rv < 0) {
+    return rv;
+  }
+  for (long i = 0; i < meta->pending_count; ++i) {
+    punch_blocks(meta->pending[i].start, meta->pending[i].length);
+  }
+  rv = write_back(meta->dirty_meta);
+  if (rv == 0 && fdatasync(meta->fd) < 0) {
+    rv = -errno;
+  }
+  if (rv < 0) {
+    return rv;
+  }
+  // Pages can hold more than one block, so nothing is dropped until
+  // every block is back in the file
+  for (long i = 0; i < meta->pending_count; ++i) {
+    drop_private(meta->pending[i].start, meta->pending[i].length);
+  }
+  __atomic_store_n(&meta->pending_count, 0, __ATOMIC_RELAXED);
+  drop_marked(meta->dirty_data);
+  drop_marked(meta->dirty_meta);
+  __atomic_store_n(&meta->dirty_meta_count, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&meta->dirty_data_count, 0, __ATOMIC_RELAXED);
+  stats_add(STAT_COMMITS, 1);
+  return 0;
+}
+
+int
+storage_commit() {
+  pthread_once(&txnOnce, init_txn);
+  pthread_rwlock_wrlock(&txnLock);
+  int rv = commit_locked();
+  pthread_rwlock_unlock(&txnLock);
+  return rv;
+}
+
+// Makes everything done before the call durable. Concurrent callers are
+// batched into as few commits as possible.
+int
+storage_sync() {
+  if (durabilityMode == DURABILITY_NONE) {
+    return 0;
+  }
+  pthread_mutex_lock(&syncLock);
+  uint64_t wanted = syncStarted + 1;
+  int rv = 0;
+  while (syncFinished < wanted) {
+    if (syncRunning) {
+      pthread_cond_wait(&syncCond, &syncLock);
+      rv = syncResult;
+      continue;
+    }
+    syncRunning = 1;
+    uint64_t mine = ++syncStarted;
+    pthread_mutex_unlock(&syncLock);
+    rv = storage_commit();
+    pthread_mutex_lock(&syncLock);
+    syncRunning = 0;
+    syncFinished = mine;
+    syncResult = rv;
+    pthread_cond_broadcast(&syncCond);
+  }
+  pthread_mutex_unlock(&syncLock);
+  return rv;
+}
+
+static void*
+commit_thread(void* arg) {
+  for (;;) {
+    usleep(__atomic_load_n(&commitInterval, __ATOMIC_RELAXED) * 1000);
+    if (__atomic_load_n(&durabilityMode, __ATOMIC_RELAXED) == DURABILITY_PERIODIC) {
+      storage_commit();
+    }
+  }
+  return 0;
+}
+
+static void
+start_commit_thread() {
+  static pthread_t committer;
+  static pthread_mutex_t startLock = PTHREAD_MUTEX_INITIALIZER;
+  pthread_mutex_lock(&startLock);
+  if (durabilityMode == DURABILITY_PERIODIC && !committer) {
+    pthread_create(&committer, 0, commit_thread, 0);
+  }
+  pthread_mutex_unlock(&startLock);
+}
+
+void
+storage_set_durability(durability mode, long intervalMs) {
+  __atomic_store_n(&commitInterval, (intervalMs > 0) ? intervalMs : COMMIT_INTERVAL_MS,
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&durabilityMode, mode, __ATOMIC_RELAXED);
+  if (meta->fd >= 0) {
+    start_commit_thread();
   }
 }
 
-const char*
-read_block(int blockId, size_t size) {
-  void* blockAddress = get_block_address(blockId);
-  size_t readSize = (size >= BLOCK_SIZE) ? BLOCK_SIZE : size;
-  const char* outData = malloc(sizeof(char) * readSize);
-  memcpy((void*) outData, blockAddress, readSize);
-  return outData;
+// Starts an operation that changes the image. Commits first when the
+// running transaction is getting too big for the journal, an operation
+// can't be split over two transactions.
+void
+txn_begin() {
+  // Only a guess at how big the transaction is, so no locks
+  long pending = __atomic_load_n(&meta->pending_count, __ATOMIC_RELAXED);
+  long capacity = journal_capacity(meta->sb, pending);
+  if (__atomic_load_n(&meta->dirty_meta_count, __ATOMIC_RELAXED) > capacity / 2 ||
+      pending > MAX_PENDING_FREES ||
+      __atomic_load_n(&meta->dirty_data_count, __ATOMIC_RELAXED) >
+        DIRTY_DATA_BYTES / (long) meta->block_size) {
+    storage_commit();
+  }
+  pthread_rwlock_rdlock(&txnLock);
+}
+
+void
+txn_end() {
+  pthread_rwlock_unlock(&txnLock);
+}
+
+// Blocks freed earlier in the transaction only come back once it
+// commits, so running out of space may just mean it's time for one.
+// Says whether the operation that failed with rv is worth another go.
+int
+reclaim_space(long rv) {
+  return rv == -ENOSPC && __atomic_load_n(&meta->pending_count, __ATOMIC_RELAXED) > 0 &&
+    storage_commit() == 0;
 }
 
 read_data*
@@ -102,186 +491,438 @@ read_inode(inode* node) {
   data->type = node->mode;
   data->size = node->size;
   data->data = malloc(node->size);
-  byte* readData = (byte*) read_block(node->direct, node->size);
-  int readSize = (node->size < BLOCK_SIZE) ? node->size : BLOCK_SIZE;
-  memcpy(data->data, readData, readSize);
-  free(readData);
-  if (node->indirect != 0) {
-    int* indirectNodes = (int*) read_block(node->indirect, BLOCK_SIZE);
-    int indirectIndex = 0;
-    while (indirectNodes[indirectIndex] != 0 && readSize < data->size) {
-      int nextReadSize = (data->size > readSize + BLOCK_SIZE) ? BLOCK_SIZE : data->size - readSize;
-      readData = (byte*) read_block(indirectNodes[indirectIndex], node->size);
-      memcpy(&data->data[readSize], readData, nextReadSize);
-      free(readData);
-      ++indirectIndex;
-      readSize += nextReadSize;
-    }
-    free(indirectNodes);
-  }
+  read_from_inode(node, (char*) data->data, node->size, 0);
   return data;
 }
 
+_Static_assert(sizeof(inode) == 256, "inode records are 256 bytes");
+
 int
-read_path(const char* path, char* buf, size_t size, off_t offset) {
-  inode* node = get_inode(path);
-  read_data* inodeData = read_inode(node);
-  int readSize = (inodeData->size < size) ? inodeData->size : size;
-  memcpy(buf, &inodeData->data[offset], readSize);
-  if (readSize < size) {
-    buf[readSize] = 0;
-    ++readSize;
+is_inline(inode* node) {
+  return node->flags & INODE_INLINE;
+}
+
+int
+get_block_id(inode* node, long blockIndex) {
+  long runLength;
+  return extent_map(&node->extents, blockIndex, &runLength);
+}
+
+long
+inode_id(inode* node) {
+  if (node == meta->root) {
+    return -1;
   }
-  free_read_data(inodeData);
-  return readSize;
+  return node - meta->inodes;
+}
+
+inode*
+get_inode_by_id(long inodeId) {
+  return (inodeId < 0) ? meta->root : &meta->inodes[inodeId];
 }
 
 int
 is_dir_inode(inode* node) {
-  return node->mode & S_IFDIR;
+  return S_ISDIR(node->mode);
 }
 
-directory*
-get_dir_from_inode(inode* node) {
-  read_data* nodeData = read_inode(node);
-  directory* dir = deserialize(nodeData->data, nodeData->size);
-  free_read_data(nodeData);
-  return dir;
+int resize_dir_inode(inode* node, long numBlocks);
+
+// An inline directory's only block is the inode's own data
+static const void*
+dir_block_view(void* context, long blockIndex) {
+  inode* node = context;
+  if (is_inline(node)) {
+    return node->data;
+  }
+  return block_view(get_block_id(node, blockIndex));
 }
 
+static void*
+dir_block_mut(void* context, long blockIndex) {
+  inode* node = context;
+  if (is_inline(node)) {
+    inode_dirty(node);
+    return node->data;
+  }
+  return block_mut(get_block_id(node, blockIndex));
+}
+
+static long
+dir_block_count(inode* node) {
+  return is_inline(node) ? 1 : node->size / meta->block_size;
+}
+
+static long
+dir_block_grow(void* context) {
+  inode* node = context;
+  if (is_inline(node)) {
+    // Moved out into blocks before it gets this far
+    return -ENOSPC;
+  }
+  long numBlocks = node->size / meta->block_size;
+  int rv = resize_dir_inode(node, numBlocks + 1);
+  return (rv < 0) ? rv : numBlocks;
+}
+
+// The directory's blocks, edited in place in the image
+static dir_store
+store_of(inode* node) {
+  dir_store store = {dir_block_view, dir_block_mut, dir_block_grow, node, meta->block_size};
+  return store;
+}
+
+// Looks the name up in place, through the index to the one leaf it can be in
+long
+dir_inode_lookup(inode* node, const char* name) {
+  stats_add(STAT_DIR_LOOKUPS, 1);
+  dir_store store = store_of(node);
+  return dir_lookup(&store, name, strlen(name));
+}
+
+// Looks up the len bytes at name, which needn't be terminated, in node
 inode*
-get_inode_from_dir_inode(inode* node, char* name) {
-  directory* dir = get_dir_from_inode(node);
-  long inodeIndex = -1;
-  if (has_file(dir, name)) {
-    inodeIndex = get_file_inode(dir, name);
+lookup_child(inode* node, const char* name, size_t len) {
+  if (len > DIR_NAME_MAX) {
+    return (inode*) -ENAMETOOLONG;
+  }
+  long parentId = inode_id(node);
+  long inodeIndex;
+  if (dcache_lookup(parentId, name, len, &inodeIndex)) {
+    stats_add(STAT_DCACHE_HITS, 1);
+  }
+  else {
+    stats_add(STAT_DCACHE_MISSES, 1);
+    stats_add(STAT_DIR_LOOKUPS, 1);
+    dir_store store = store_of(node);
+    inodeIndex = dir_lookup(&store, name, len);
+    dcache_add(parentId, name, len, inodeIndex);
   }
-  free_directory(dir);
   if (inodeIndex >= 0) {
     return &meta->inodes[inodeIndex];
   }
   else {
+    return (inode*) -ENOENT;
+  }
+}
+
+inode*
+get_inode_from_dir_inode(inode* node, char* name) {
+  return lookup_child(node, name, strlen(name));
+}
+
+/*
+ Every inode has a reader/writer lock, kept in memory only and indexed by
+ inode id + 1 so root gets the first one. Locks are always taken in this
+ order, outermost first:
+
+  - renameLock, which only rename takes
+  - directories, a parent before its children. Rename is the only thing
+    that holds two directories that aren't parent and child, it takes
+    the ancestor first, or the lower id when neither contains the other.
+  - everything else
+  - the allocator and dcache locks, which never call back out
+
+ A path walk only holds one directory at a time.
+*/
+static pthread_mutex_t renameLock = PTHREAD_MUTEX_INITIALIZER;
+
+void
+init_locks() {
+  for (long i = 0; i < meta->lock_count; ++i) {
+    pthread_rwlock_destroy(&meta->locks[i]);
+  }
+  free(meta->locks);
+  free(meta->gens);
+  meta->lock_count = meta->inode_count + 1;
+  meta->locks = malloc(meta->lock_count * sizeof(pthread_rwlock_t));
+  meta->gens = calloc(meta->lock_count, sizeof(inode_gens));
+  for (long i = 0; i < meta->lock_count; ++i) {
+    pthread_rwlock_init(&meta->locks[i], 0);
+  }
+}
+
+pthread_rwlock_t*
+lock_of(inode* node) {
+  return &meta->locks[inode_id(node) + 1];
+}
+
+inode_gens*
+gens_of(inode* node) {
+  return &meta->gens[inode_id(node) + 1];
+}
+
+void
+read_lock(inode* node) {
+  pthread_rwlock_rdlock(lock_of(node));
+}
+
+void
+write_lock(inode* node) {
+  pthread_rwlock_wrlock(lock_of(node));
+}
+
+void
+unlock_inode(inode* node) {
+  pthread_rwlock_unlock(lock_of(node));
+}
+
+// Looks one name up in dir, holding dir's lock just for the lookup
+inode*
+walk_step(inode* dir, const char* name, size_t len) {
+  if (!is_dir_inode(dir)) {
     return (inode*) -ENOTDIR;
   }
+  read_lock(dir);
+  inode* child = lookup_child(dir, name, len);
+  unlock_inode(dir);
+  return child;
 }
 
-inode_pair*
-get_inode_pair(const char* path) {
-  inode_pair* pair = malloc(sizeof(inode_pair));
-  inode* parent = &meta->root;
-  string_array* parsedPath = parse_path((char*) path);
+// Resolves path one component at a time, straight out of the string.
+// With last set it stops short of the final component and copies that
+// into last (DIR_NAME_MAX + 1 bytes) instead, for the caller to look up
+// once it holds the parent's lock.
+inode*
+walk_path(const char* path, char* last) {
+  path_iter iter;
+  path_iter_init(&iter, path);
+  inode* node = meta->root;
+  const char* name;
+  size_t len;
+  while ((long) node >= 0 && path_next(&iter, &name, &len)) {
+    if (len > DIR_NAME_MAX) {
+      return (inode*) -ENAMETOOLONG;
+    }
+    if (last && !path_has_next(&iter)) {
+      if (!is_dir_inode(node)) {
+        return (inode*) -ENOTDIR;
+      }
+      memcpy(last, name, len);
+      last[len] = 0;
+      return node;
+    }
+    node = walk_step(node, name, len);
+  }
+  if ((long) node >= 0 && last) {
+    // Nothing but slashes, there's no last component
+    return (inode*) -EINVAL;
+  }
+  return node;
+}
+
+// Resolves everything but the last component, see walk_path
+inode*
+get_parent_inode(const char* path, char* last) {
+  return walk_path(path, last);
+}
 
-  for (int i = 0; i < parsedPath->length - 2; ++i) {
-    if (is_dir_inode(parent)) {
-      parent = get_inode_from_dir_inode(parent, parsedPath->data[i]);
+// extent_map, but answered from run when blockIndex falls inside it.
+// Mapped runs found on the way replace it.
+long
+map_cached(inode* node, block_run* run, long blockIndex, long* runLength) {
+  uint32_t generation = gens_of(node)->map;
+  if (run->generation == generation && blockIndex >= run->logical &&
+      blockIndex < run->logical + run->length) {
+    *runLength = run->logical + run->length - blockIndex;
+    return run->physical + (blockIndex - run->logical);
+  }
+  long blockId = extent_map(&node->extents, blockIndex, runLength);
+  if (blockId > 0) {
+    run->logical = blockIndex;
+    run->physical = blockId;
+    run->length = *runLength;
+    run->generation = generation;
+  }
+  return blockId;
+}
+
+// Copies at most size bytes starting at offset straight out of the mapped
+// blocks. Only the blocks covering [offset, offset + size) are touched,
+// and each physically contiguous run goes over in a single memcpy. Holes
+// have no blocks at all and read as zeros. run caches the mapping
+// between calls, see map_cached.
+int
+read_mapped(inode* node, block_run* run, char* buf, size_t size, off_t offset) {
+  if (offset >= node->size) {
+    return 0;
+  }
+  if (offset + (off_t) size > node->size) {
+    size = node->size - offset;
+  }
+  if (is_inline(node)) {
+    memcpy(buf, &node->data[offset], size);
+    stats_add(STAT_BYTES_READ, size);
+    return size;
+  }
+  long blockIndex = offset / meta->block_size;
+  size_t blockOffset = offset % meta->block_size;
+  size_t readBytes = 0;
+  while (readBytes < size) {
+    long runLength;
+    long blockId = map_cached(node, run, blockIndex, &runLength);
+    size_t readSize = runLength * meta->block_size - blockOffset;
+    if (readSize > size - readBytes) {
+      readSize = size - readBytes;
+    }
+    if (blockId > 0) {
+      const byte* blockAddress = block_view(blockId);
+      memcpy(&buf[readBytes], &blockAddress[blockOffset], readSize);
     }
     else {
-      return (inode_pair*) -1;
+      memset(&buf[readBytes], 0, readSize);
     }
+    readBytes += readSize;
+    blockIndex += (blockOffset + readSize) / meta->block_size;
+    blockOffset = 0;
   }
+  stats_add(STAT_BYTES_READ, readBytes);
+  return readBytes;
+}
 
-  char* basename = parsedPath->data[parsedPath->length - 1];
-  inode* child = get_inode_from_dir_inode(parent, basename);
-  pair->parent = parent;
-  pair->child = child;
-  free_string_array(parsedPath);
-  return pair;
+int
+read_from_inode(inode* node, char* buf, size_t size, off_t offset) {
+  block_run run = {0, 0, 0, 0};
+  return read_mapped(node, &run, buf, size, offset);
 }
 
-void
-free_all_inode_blocks(inode* node) {
-  if (node->direct != 0) {
-    release_block(node->direct);
-  }
-  if (node->indirect != 0) {
-    int* indirectBlockIds = (int*) read_block(node->indirect, BLOCK_SIZE);
-    for (int i = 0; i < BLOCK_SIZE / sizeof(int); ++i) {
-      if (indirectBlockIds[i] >= meta->starting_block_index && indirectBlockIds[i] <= BLOCK_COUNT) {
-        release_block(indirectBlockIds[i]);
-      }
-      else {
-        // We got junk (probably 0) abort
-        break;
-      }
-    }
-    release_block(node->indirect);
+int
+read_path(const char* path, char* buf, size_t size, off_t offset) {
+  inode* node = get_inode(path);
+  if ((long) node < 0) {
+    return (long) node;
   }
+  read_lock(node);
+  int rv = read_from_inode(node, buf, size, offset);
+  unlock_inode(node);
+  return rv;
 }
 
 void
-free_blocks_from_indirect(long indirectId, int currentCount, int desiredIndirectBlocks) {
-  int* indirectBlock = (int*) read_block(indirectId, BLOCK_SIZE);
-  for (int i = currentCount - 1; i >= desiredIndirectBlocks; --i) {
-    release_block(indirectBlock[i]);
-    indirectBlock[i] = 0;
+free_all_inode_blocks(inode* node) {
+  inode_dirty(node);
+  ++gens_of(node)->map;
+  if (is_inline(node)) {
+    memset(node->data, 0, INODE_INLINE_MAX);
+    return;
   }
-  // We don't know if the block is going to be released, so it's best
-  // to just save the state
-  write_to_block(indirectId, indirectBlock, BLOCK_SIZE, 0);
-  free(indirectBlock);
+  extent_truncate(&node->extents, 0);
+}
+
+long
+count_blocks(off_t size) {
+  return (size + meta->block_size - 1) / meta->block_size;
 }
 
+// Gives every hole in file blocks [first, last) a block of its own. The
+// inode is only dirtied when something gets mapped, so overwriting blocks
+// that are already there doesn't put it in the next commit.
 int
-free_blocks(inode* node, int currentCount, int desiredCount) {
-  if (node->indirect) {
-    int currentIndirectBlocks = currentCount - 1;
-    int desiredIndirectBlocks = (desiredCount <= 0) ? 0 : desiredCount - 1;
-    free_blocks_from_indirect(node->indirect, currentIndirectBlocks, desiredIndirectBlocks);
-    if (desiredIndirectBlocks <= 0) {
-      release_block(node->indirect);
-      node->indirect = 0;
+map_blocks(inode* node, long first, long last) {
+  long i = first;
+  while (i < last) {
+    long runLength;
+    if (extent_map(&node->extents, i, &runLength) > 0) {
+      i += runLength;
+      continue;
     }
-  }
-  if (desiredCount == 0) {
-    release_block(node->direct);
-    node->direct = 0;
+    if (runLength > last - i) {
+      runLength = last - i;
+    }
+    // Aim right after the previous block so its extent just grows
+    long previous = (i > 0) ? get_block_id(node, i - 1) : 0;
+    long got;
+    long start = get_block_run((previous > 0) ? previous + 1 : -1, runLength, &got);
+    if (start < 0) {
+      return start;
+    }
+    inode_dirty(node);
+    int rv = extent_insert(&node->extents, i, start, got);
+    if (rv < 0) {
+      // A failed insert leaves the tree as it was, so nothing maps these
+      release_blocks(start, got);
+      return rv;
+    }
+    i += got;
   }
   return 0;
 }
 
+// Moves an inline file's contents out into a block of its own, from then
+// on it is mapped by extents like any other file.
 int
-get_blocks(inode* node, int currentCount, int desiredCount) {
-  if (desiredCount >= 1 && !node->direct) {
-    node->direct = get_next_block();
-    ++currentCount;
+promote_inline(inode* node) {
+  if (!is_inline(node)) {
+    return 0;
   }
-  if (desiredCount > 1 && !node->indirect) {
-    node->indirect = get_next_block();
+  byte contents[INODE_INLINE_MAX];
+  size_t size = node->size;
+  memcpy(contents, node->data, size);
+  inode_dirty(node);
+  node->flags &= ~INODE_INLINE;
+  memset(node->data, 0, INODE_INLINE_MAX);
+  extent_init(&node->extents);
+  if (size == 0) {
+    return 0;
   }
-  if (desiredCount > 1) {
-    int* indirectBlock = (int*) read_block(node->indirect, BLOCK_SIZE);
-    for (int i = currentCount - 1; i < desiredCount - 1; ++i) {
-      indirectBlock[i] = get_next_block();
-      if (indirectBlock[i] < 0) {
-        int rv = indirectBlock[i];
-        free(indirectBlock);
-        return rv;
-      }
-    }
-    write_to_block(node->indirect, indirectBlock, BLOCK_SIZE, 0);
-    //free(indirectBlock);
+  int rv = map_blocks(node, 0, 1);
+  if (rv < 0) {
+    extent_truncate(&node->extents, 0);
+    memcpy(node->data, contents, size);
+    memset(&node->data[size], 0, INODE_INLINE_MAX - size);
+    node->flags |= INODE_INLINE;
+    return rv;
   }
+  memcpy(data_mut(get_block_id(node, 0), 1), contents, size);
   return 0;
 }
 
+// Growing only moves the size, everything past the old end is a hole
+// until something is written there. Shrinking frees whole blocks past
+// the new end and clears the rest of the last block, so the bytes past
+// the end always read back as zero if the file grows again.
 int
 change_inode_size(inode* node, off_t size) {
-  int currentBlockCount = node->size / BLOCK_SIZE;
-  currentBlockCount = (node->size % BLOCK_SIZE == 0) ? currentBlockCount : currentBlockCount + 1;
-  int desiredBlockCount = size / BLOCK_SIZE;
-  desiredBlockCount = (size % BLOCK_SIZE == 0) ? desiredBlockCount : desiredBlockCount + 1;
-  int rv = 0;
-  if (currentBlockCount < desiredBlockCount) {
-    rv = get_blocks(node, currentBlockCount, desiredBlockCount);
+  long desiredBlockCount = count_blocks(size);
+  if (desiredBlockCount > UINT32_MAX) {
+    return -EFBIG;
   }
-  else if (desiredBlockCount < currentBlockCount) {
-    rv = free_blocks(node, currentBlockCount, desiredBlockCount);
-    if (size == 0) {
-      release_block(node->direct);
-      node->direct = 0;
+  if (is_inline(node) && size > INODE_INLINE_MAX) {
+    int rv = promote_inline(node);
+    if (rv < 0) {
+      return rv;
+    }
+  }
+  inode_dirty(node);
+  if (is_inline(node)) {
+    // Everything past the end is kept zeroed
+    if (size < node->size) {
+      memset(&node->data[size], 0, node->size - size);
+    }
+  }
+  else if (size < node->size) {
+    ++gens_of(node)->map;
+    extent_truncate(&node->extents, desiredBlockCount);
+    long blockId = get_block_id(node, size / meta->block_size);
+    if (size % meta->block_size && blockId > 0) {
+      byte* block = data_mut(blockId, 1);
+      memset(&block[size % meta->block_size], 0, meta->block_size - size % meta->block_size);
     }
   }
   node->size = size;
+  return 0;
+}
+
+int
+truncate_inode(inode* node, off_t size) {
+  if (is_dir_inode(node)) {
+    return -EISDIR;
+  }
+  txn_begin();
+  write_lock(node);
+  int rv = change_inode_size(node, size);
+  unlock_inode(node);
+  txn_end();
   return rv;
 }
 
@@ -291,61 +932,233 @@ inode_truncate(const char* path, off_t size) {
   if ((long) node < 0) {
     return (long) node;
   }
-  return change_inode_size(node, size);
+  return truncate_inode(node, size);
 }
 
+// Copies data over [offset, offset + size), one memcpy per run of
+// contiguous blocks. Every block in the range must already be mapped.
 int
-write_to_blocks(int* blockIds, int numBlocks, void* data, size_t size, off_t offset) {
-  int blockIndex = offset / BLOCK_SIZE;
-  if (blockIndex >= numBlocks) {
-    // TODO: better error value
-    return -1;
-  }
-  int blockOffset = offset % BLOCK_SIZE;
-  offset -= blockIndex * BLOCK_SIZE;
-  int writeSize = (size < BLOCK_SIZE - offset) ? size : BLOCK_SIZE - offset;
-  int writtenBytes = write_to_block(blockIds[blockIndex], data, writeSize, blockOffset);
-  ++blockIndex;
-  blockOffset = 0;
-  // While we still have blocks to write on and things to write to blocks
-  while (blockIndex < numBlocks && writtenBytes < size) {
-    writeSize = (size - writtenBytes < BLOCK_SIZE) ? size - writtenBytes : BLOCK_SIZE;
-    writtenBytes += write_to_block(blockIds[blockIndex], data + writtenBytes, writeSize, blockOffset);
-    ++blockIndex;
+write_to_blocks(inode* node, block_run* run, void* data, size_t size, off_t offset) {
+  long blockIndex = offset / meta->block_size;
+  size_t blockOffset = offset % meta->block_size;
+  size_t writtenBytes = 0;
+  while (writtenBytes < size) {
+    long runLength;
+    long blockId = map_cached(node, run, blockIndex, &runLength);
+    if (blockId <= 0) {
+      break;
+    }
+    size_t writeSize = runLength * meta->block_size - blockOffset;
+    if (writeSize > size - writtenBytes) {
+      writeSize = size - writtenBytes;
+    }
+    byte* blockAddress = data_mut(blockId, (blockOffset + writeSize + meta->block_size - 1) / meta->block_size);
+    memcpy(&blockAddress[blockOffset], (byte*) data + writtenBytes, writeSize);
+    writtenBytes += writeSize;
+    blockIndex += (blockOffset + writeSize) / meta->block_size;
+    blockOffset = 0;
   }
   return writtenBytes;
 }
 
+// Only the blocks the write lands on get allocated, anything it skips
+// over past the old end stays a hole. run caches the mapping between
+// calls the same as for read_mapped, so overwriting blocks a handle
+// already knows about doesn't go near the extent tree.
 int
-write_to_inode(inode* node, void* data, size_t size, off_t offset) {
-  size_t oldSize = node->size;
-  if (size + offset > node->size) {
-    int rv = change_inode_size(node, size + offset);
+write_mapped(inode* node, block_run* run, void* data, size_t size, off_t offset) {
+  if (size == 0) {
+    return 0;
+  }
+  if (is_inline(node)) {
+    if (offset + size <= INODE_INLINE_MAX) {
+      inode_dirty(node);
+      memcpy(&node->data[offset], data, size);
+      if (offset + (off_t) size > node->size) {
+        node->size = offset + size;
+      }
+      stats_add(STAT_BYTES_WRITTEN, size);
+      return size;
+    }
+    int rv = promote_inline(node);
     if (rv < 0) {
       return rv;
     }
   }
-  int numBlocks = node->size / BLOCK_SIZE;
-  if (node->size % BLOCK_SIZE != 0) {
-    ++numBlocks;
+  long lastBlock = count_blocks(offset + size);
+  if (lastBlock > UINT32_MAX) {
+    return -EFBIG;
   }
-  int* blockIds = malloc(sizeof(int) * numBlocks);
-  if (numBlocks) {
-    blockIds[0] = node->direct;
+  long firstBlock = offset / meta->block_size;
+  long runLength;
+  if (map_cached(node, run, firstBlock, &runLength) <= 0 || firstBlock + runLength < lastBlock) {
+    int rv = map_blocks(node, firstBlock, lastBlock);
+    if (rv < 0) {
+      // Don't keep blocks from a failed write hanging past the end
+      ++gens_of(node)->map;
+      extent_truncate(&node->extents, count_blocks(node->size));
+      return rv;
+    }
   }
-  if (node->indirect && numBlocks > 1) {
-    int size = sizeof(int) * (numBlocks - 1);
-    int* indirectBlock = (int*) read_block(node->indirect, size);
-    memcpy(&blockIds[1], indirectBlock, size);
-    free(indirectBlock);
+  // Only as far as the copy got, in case it stopped at an unmapped block
+  size_t written = write_to_blocks(node, run, data, size, offset);
+  if (offset + (off_t) written > node->size) {
+    inode_dirty(node);
+    node->size = offset + written;
   }
-  size_t writtenBytes = write_to_blocks(blockIds, numBlocks, data, size, offset);
-  free(blockIds);
-  return writtenBytes;
+  stats_add(STAT_BYTES_WRITTEN, written);
+  return written;
+}
+
+int
+write_to_inode(inode* node, void* data, size_t size, off_t offset) {
+  block_run run = {0, 0, 0, 0};
+  return write_mapped(node, &run, data, size, offset);
+}
+
+// Sizes a directory to numBlocks blocks, every one of them mapped.
+int
+resize_dir_inode(inode* node, long numBlocks) {
+  int rv = map_blocks(node, 0, numBlocks);
+  if (rv < 0) {
+    extent_truncate(&node->extents, count_blocks(node->size));
+    return rv;
+  }
+  return change_inode_size(node, (off_t) numBlocks * meta->block_size);
+}
+
+int
+init_dir_inode(inode* node, long inodeId, long pnum) {
+  if (is_inline(node)) {
+    inode_dirty(node);
+    node->size = INODE_INLINE_MAX;
+    dir_block_init(node->data, INODE_INLINE_MAX, inodeId, pnum);
+    return 0;
+  }
+  int rv = resize_dir_inode(node, 1);
+  if (rv < 0) {
+    return rv;
+  }
+  dir_block_init(block_mut(get_block_id(node, 0)), meta->block_size, inodeId, pnum);
+  return 0;
+}
+
+// Moves an inline directory's entries out into a full sized block
+int
+promote_inline_dir(inode* node) {
+  byte contents[INODE_INLINE_MAX];
+  memcpy(contents, node->data, INODE_INLINE_MAX);
+  const dir_block* old = (const dir_block*) contents;
+  inode_dirty(node);
+  node->flags &= ~INODE_INLINE;
+  memset(node->data, 0, INODE_INLINE_MAX);
+  extent_init(&node->extents);
+  node->size = 0;
+  int rv = resize_dir_inode(node, 1);
+  if (rv < 0) {
+    memcpy(node->data, contents, INODE_INLINE_MAX);
+    node->size = INODE_INLINE_MAX;
+    node->flags |= INODE_INLINE;
+    return rv;
+  }
+  void* block = block_mut(get_block_id(node, 0));
+  dir_block_init(block, meta->block_size, old->inodeId, old->pnum);
+  uint32_t cursor = 0;
+  const dir_entry* entry;
+  while ((entry = dir_block_next(contents, &cursor))) {
+    dir_block_insert(block, entry->name, entry->nameLen, entry->inodeId, entry->type);
+  }
+  return 0;
+}
+
+// Every name in the directory, copied into the arena since removing them
+// rearranges the blocks they came from
+int
+dir_inode_names(inode* node, char*** namesPointer) {
+  long count = 0;
+  long numBlocks = dir_block_count(node);
+  for (long i = 0; i < numBlocks; ++i) {
+    const dir_block* block = dir_block_view(node, i);
+    if (dir_block_is_valid(block)) {
+      count += block->count;
+    }
+  }
+  char** names = arena_alloc((count + 1) * sizeof(char*));
+  long found = 0;
+  for (long i = 0; i < numBlocks; ++i) {
+    const dir_block* block = dir_block_view(node, i);
+    if (!dir_block_is_valid(block)) {
+      continue;
+    }
+    uint32_t cursor = 0;
+    const dir_entry* entry;
+    while ((entry = dir_block_next(block, &cursor))) {
+      names[found++] = arena_strndup(entry->name, entry->nameLen);
+    }
+  }
+  *namesPointer = names;
+  return found;
+}
+
+// Adds the entry to the leaf its name hashes to, editing it in place. The
+// directory grows a block whenever a leaf has to split, an inline one
+// moves out into blocks once it is full.
+int
+dir_inode_insert(inode* node, const char* name, long inodeId, int type) {
+  size_t len = strlen(name);
+  dir_store store = store_of(node);
+  int rv = dir_insert(&store, name, len, inodeId, type);
+  if (rv == -ENOSPC && is_inline(node)) {
+    rv = promote_inline_dir(node);
+    if (rv == 0) {
+      rv = dir_insert(&store, name, len, inodeId, type);
+    }
+  }
+  if (rv == 0) {
+    dcache_add(inode_id(node), name, len, inodeId);
+  }
+  return rv;
+}
+
+// Unlinks the entry from the leaf holding it, returns its inode id
+long
+dir_inode_remove(inode* node, const char* name) {
+  size_t len = strlen(name);
+  dir_store store = store_of(node);
+  long inodeId = dir_remove(&store, name, len);
+  if (inodeId >= 0) {
+    dcache_add(inode_id(node), name, len, -ENOENT);
+  }
+  return inodeId;
+}
+
+// Repoints an entry at another inode in place, returns the one it had
+long
+dir_inode_replace(inode* node, const char* name, long inodeId, int type) {
+  size_t len = strlen(name);
+  dir_store store = store_of(node);
+  long oldId = dir_replace(&store, name, len, inodeId, type);
+  if (oldId >= 0) {
+    dcache_add(inode_id(node), name, len, inodeId);
+  }
+  return oldId;
+}
+
+int
+dir_inode_is_empty(inode* node) {
+  long numBlocks = dir_block_count(node);
+  for (long i = 0; i < numBlocks; ++i) {
+    const dir_block* block = dir_block_view(node, i);
+    if (dir_block_is_valid(block) && block->count > 0) {
+      return 0;
+    }
+  }
+  return 1;
 }
 
 void
 set_inode_defaults(inode* node, int mode) {
+  inode_dirty(node);
   node->mode = mode;
   node->nlink = 1;
   node->uid = getuid();
@@ -357,59 +1170,428 @@ set_inode_defaults(inode* node, int mode) {
   memcpy(&node->atim, &spec, sizeof(struct timespec));
   memcpy(&node->mtim, &spec, sizeof(struct timespec));
   memcpy(&node->ctim, &spec, sizeof(struct timespec));
-  node->direct = 0;
-  node->indirect = 0;
+  memset(node->data, 0, INODE_INLINE_MAX);
+  node->flags = INODE_INLINE;
+}
+
+int
+get_dirent_type(long inodeId) {
+  return IFTODT(meta->inodes[inodeId].mode);
+}
+
+void
+upgrade_legacy_directory(inode* node) {
+  if (!is_dir_inode(node) || node->size == 0) {
+    return;
+  }
+  if (dir_is_valid(dir_block_view(node, 0))) {
+    return;
+  }
+  read_data* oldData = read_inode(node);
+  if (is_legacy_directory(oldData->data, oldData->size)) {
+    directory* dir = convert_legacy_directory(oldData->data, oldData->size,
+                                              meta->block_size, get_dirent_type);
+    change_inode_size(node, 0);
+    write_to_inode(node, dir->blocks, get_size_directory(dir), 0);
+    free_directory(dir);
+  }
+  free_read_data(oldData);
+}
+
+// Images written before directories went binary stored them as strings,
+// rewrite any of those once when the image is opened.
+void
+upgrade_legacy_directories() {
+  upgrade_legacy_directory(meta->root);
+  for (int i = 0; i < meta->inode_count; ++i) {
+    if (alloc_test(&meta->inode_map, i)) {
+      upgrade_legacy_directory(&meta->inodes[i]);
+    }
+  }
+}
+
+void
+release_inode(long inodeId) {
+  ++meta->gens[inodeId + 1].use;
+  alloc_clear(&meta->inode_map, inodeId);
+  bitmap_dirty(meta->sb->inode_bitmap_start, inodeId, 1);
+  // Anything cached under it as a parent is stale now
+  dcache_forget_inode(inodeId);
+}
+
+// Inodes left unlinked but still in use when we last stopped. Must hold
+// txnLock exclusively.
+void
+release_orphans() {
+  for (long i = 0; i < meta->inode_count; ++i) {
+    if (meta->inodes[i].nlink <= 0 && alloc_test(&meta->inode_map, i)) {
+      free_all_inode_blocks(&meta->inodes[i]);
+      release_inode(i);
+    }
+  }
 }
 
-void configure_root() {
-  meta->starting_block_index = sizeof(meta_block) / BLOCK_SIZE + 1;
+// The image stays open while it is mapped so released blocks can be
+// punched out of it.
+void
+set_image_fd(int fd) {
+  if (meta->fd >= 0) {
+    close(meta->fd);
+  }
+  meta->fd = fd;
+}
 
+int
+check_geometry(size_t imageSize, size_t blockSize, long inodeCount) {
+  if (blockSize < MIN_BLOCK_SIZE || blockSize > MAX_BLOCK_SIZE ||
+      (blockSize & (blockSize - 1)) != 0) {
+    return -EINVAL;
+  }
+  if (inodeCount <= 0 || imageSize / blockSize > INT32_MAX) {
+    return -EINVAL;
+  }
+  return 0;
+}
+
+void
+layout_superblock(superblock* sb, size_t imageSize, size_t blockSize, long inodeCount) {
+  long blockCount = imageSize / blockSize;
+  long bitsPerBlock = blockSize * 8;
+  sb->magic = NUFS_MAGIC;
+  sb->version = NUFS_VERSION;
+  sb->block_size = blockSize;
+  sb->inode_size = sizeof(inode);
+  sb->image_size = (uint64_t) blockCount * blockSize;
+  sb->block_count = blockCount;
+  sb->inode_count = inodeCount;
+  sb->block_bitmap_start = 1;
+  sb->inode_bitmap_start = sb->block_bitmap_start + (blockCount + bitsPerBlock - 1) / bitsPerBlock;
+  sb->inode_table_start = sb->inode_bitmap_start + (inodeCount + bitsPerBlock - 1) / bitsPerBlock;
+  sb->journal_start = sb->inode_table_start +
+    (inodeCount * sizeof(inode) + blockSize - 1) / blockSize;
+  // A sixty-fourth of the image, within reason
+  sb->journal_blocks = blockCount / 64;
+  if (sb->journal_blocks < MIN_JOURNAL_BLOCKS) {
+    sb->journal_blocks = MIN_JOURNAL_BLOCKS;
+  }
+  if (sb->journal_blocks > MAX_JOURNAL_BLOCKS) {
+    sb->journal_blocks = MAX_JOURNAL_BLOCKS;
+  }
+  sb->data_start = sb->journal_start + sb->journal_blocks;
+}
+
+void
+map_superblock(superblock* sb, byte* image) {
+  meta->sb = sb;
+  meta->root = &sb->root;
+  meta->block_start = image;
+  meta->block_size = sb->block_size;
+  meta->block_count = sb->block_count;
+  meta->inode_count = sb->inode_count;
+  meta->image_size = sb->image_size;
+  meta->starting_block_index = sb->data_start;
+  long dirtyWords = (sb->block_count + 63) / 64;
+  free(meta->dirty_meta);
+  free(meta->dirty_data);
+  meta->dirty_meta = calloc(dirtyWords, sizeof(uint64_t));
+  meta->dirty_data = calloc(dirtyWords, sizeof(uint64_t));
+  meta->dirty_meta_count = 0;
+  meta->dirty_data_count = 0;
+  meta->pending_count = 0;
+  alloc_map_init(&meta->blocks, image + (long) sb->block_bitmap_start * sb->block_size,
+                 sb->block_count, &sb->next_free_block);
+  alloc_map_init(&meta->inode_map, image + (long) sb->inode_bitmap_start * sb->block_size,
+                 sb->inode_count, &sb->next_free_inode);
+  meta->inodes = (inode*) (image + (long) sb->inode_table_start * sb->block_size);
+  init_locks();
+}
+
+void
+configure_root() {
   for (int i = 0; i < meta->starting_block_index; ++i) {
     take_block(i);
   }
 
-  inode* root = &meta->root;
-  if (root->size < 9) {
-    set_inode_defaults(root, S_IFDIR | S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
-    //root->uid = 0000;
-    //root->gid = 0000;
-    root->direct = meta->starting_block_index;
-    take_block(meta->starting_block_index);
-    root->indirect = 0;
-    directory* rootDirectory = create_directory("", -1, -1);
-    void* serialData =  serialize(rootDirectory);
-    write_to_inode(root, serialData, get_size_directory(rootDirectory), 0);
-  }
+  inode* root = meta->root;
+  set_inode_defaults(root, S_IFDIR | S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+  //root->uid = 0000;
+  //root->gid = 0000;
+  root->flags = 0;
+  extent_init(&root->extents);
+  take_block(meta->starting_block_index);
+  extent_insert(&root->extents, 0, meta->starting_block_index, 1);
+  dir_block_init(block_mut(meta->starting_block_index), meta->block_size, -1, -1);
+  root->size = meta->block_size;
 }
 
-void storage_init(const char* path) {
+int
+format_image(const char* path, size_t imageSize, size_t blockSize, long inodeCount) {
+  int rv = check_geometry(imageSize, blockSize, inodeCount);
+  if (rv < 0) {
+    return rv;
+  }
+  superblock sb;
+  memset(&sb, 0, sizeof(superblock));
+  layout_superblock(&sb, imageSize, blockSize, inodeCount);
+  if (sizeof(superblock) > blockSize || sb.data_start + 1 >= sb.block_count) {
+    // Not even room for the metadata and root's directory block
+    return -ENOSPC;
+  }
   int fd = open(path, O_CREAT | O_RDWR, 0666);
-  // This guarantees things are filled with zero if increasing.
-  // Therefore we can assume that if meta->root.direct == 0,
-  // we need to configure root
-  ftruncate(fd, DISK_SIZE);
-  meta = mmap(0, DISK_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_SHARED, fd, 0);
+  if (fd < 0) {
+    return -errno;
+  }
+  // Truncating to nothing first guarantees every block reads back as zero
+  if (ftruncate(fd, 0) < 0 || ftruncate(fd, sb.image_size) < 0) {
+    rv = -errno;
+    close(fd);
+    return rv;
+  }
+  // Nothing else can see a fresh image, so this one is written straight
+  // through rather than going via the journal
+  byte* image = mmap(0, sb.image_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (image == MAP_FAILED) {
+    return -errno;
+  }
+  set_image_fd(-1);
+  memcpy(image, &sb, sizeof(superblock));
+  map_superblock((superblock*) image, image);
   configure_root();
+  msync(image, sb.image_size, MS_SYNC);
+  munmap(image, sb.image_size);
+  return 0;
 }
 
-inode*
-get_inode(const char* path) {
-  inode* currentNode = &meta->root;
-  string_array* parsedPath = parse_path((char*) path);
-  int lastIndex = parsedPath->length - 1;
-  for (int i = 0; i < parsedPath->length; ++i) {
-    if (is_dir_inode(currentNode)) {
-      currentNode = get_inode_from_dir_inode(currentNode, parsedPath->data[i]);
-      if ((long) currentNode < 0) {
-        return currentNode;
-      }
+int
+storage_format(const char* path, size_t imageSize, size_t blockSize, long inodeCount) {
+  pthread_once(&txnOnce, init_txn);
+  pthread_rwlock_wrlock(&txnLock);
+  int rv = format_image(path, imageSize, blockSize, inodeCount);
+  pthread_rwlock_unlock(&txnLock);
+  return rv;
+}
+
+int
+map_image(const char* path) {
+  int rv;
+  int fd = open(path, O_RDWR);
+  if (fd < 0) {
+    return -errno;
+  }
+  superblock sb;
+  if (pread(fd, &sb, sizeof(superblock), 0) != sizeof(superblock) ||
+      sb.magic != NUFS_MAGIC) {
+    close(fd);
+    return -EINVAL;
+  }
+  if (sb.version != NUFS_VERSION || sb.inode_size != sizeof(inode)) {
+    log_error("%s: image version %u isn't supported, reformat it with mkfs.nufs",
+              path, sb.version);
+    close(fd);
+    return -EINVAL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size < (off_t) sb.image_size) {
+    close(fd);
+    return -EINVAL;
+  }
+  // Finish off whatever the last run committed but didn't write back
+  rv = journal_replay(fd, &sb);
+  if (rv < 0) {
+    close(fd);
+    return rv;
+  }
+  byte* image = mmap(0, sb.image_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (image == MAP_FAILED) {
+    rv = -errno;
+    close(fd);
+    return rv;
+  }
+  set_image_fd(fd);
+  map_superblock((superblock*) image, image);
+  return 0;
+}
+
+/*
+ The original layout, before geometry was recorded in a superblock. It
+ was always a 1MB image holding one struct with the root inode, both
+ bitmaps and the inode table, data blocks came right after it.
+*/
+#define V0_DISK_SIZE (1024 * 1024)
+#define V0_BLOCK_SIZE 4096
+#define V0_INODE_COUNT 2048
+#define V0_BLOCK_COUNT (V0_DISK_SIZE / V0_BLOCK_SIZE)
+
+typedef struct v0_inode {
+  mode_t mode;
+  nlink_t nlink;
+  uid_t uid;
+  gid_t gid;
+  dev_t rdev;
+  off_t size;
+  struct timespec atim;
+  struct timespec mtim;
+  struct timespec ctim;
+  int direct;
+  int indirect;
+} v0_inode;
+
+typedef struct v0_meta_block {
+  v0_inode root;
+  byte block_status[V0_BLOCK_COUNT / 8 + 1];
+  byte inode_status[V0_INODE_COUNT / 8 + 1];
+  v0_inode inodes[V0_INODE_COUNT];
+  int starting_block_index;
+  byte* block_start;
+} v0_meta_block;
+
+int
+is_v0_image(const byte* image, size_t size) {
+  const v0_meta_block* old = (const v0_meta_block*) image;
+  return size == V0_DISK_SIZE && S_ISDIR(old->root.mode) &&
+    old->root.direct == sizeof(v0_meta_block) / V0_BLOCK_SIZE + 1;
+}
+
+void
+copy_v0_inode(const byte* image, const v0_inode* oldNode, inode* node) {
+  inode_dirty(node);
+  node->mode = oldNode->mode;
+  node->nlink = oldNode->nlink;
+  node->uid = oldNode->uid;
+  node->gid = oldNode->gid;
+  node->rdev = oldNode->rdev;
+  node->atim = oldNode->atim;
+  node->mtim = oldNode->mtim;
+  node->ctim = oldNode->ctim;
+  off_t size = oldNode->size;
+  if (size > (off_t) (V0_BLOCK_SIZE * (1 + V0_BLOCK_SIZE / sizeof(int)))) {
+    size = 0;
+  }
+  const int* indirect = (const int*) &image[(long) oldNode->indirect * V0_BLOCK_SIZE];
+  for (off_t offset = 0; offset < size; offset += V0_BLOCK_SIZE) {
+    long blockIndex = offset / V0_BLOCK_SIZE;
+    int blockId = (blockIndex == 0) ? oldNode->direct : indirect[blockIndex - 1];
+    if (blockId <= 0 || blockId >= V0_BLOCK_COUNT) {
+      break;
     }
-    else {
-      // TODO: this needs to be a different error (i think)
-      return (inode*) -ENOENT;
+    size_t chunk = (size - offset < V0_BLOCK_SIZE) ? size - offset : V0_BLOCK_SIZE;
+    write_to_inode(node, (void*) &image[(long) blockId * V0_BLOCK_SIZE], chunk, offset);
+  }
+  if (node->size > size) {
+    change_inode_size(node, size);
+  }
+}
+
+// So a rename into it survives a crash
+static int
+sync_parent_dir(const char* path) {
+  const char* slash = strrchr(path, '/');
+  char* dir = slash ? strndup(path, (slash == path) ? 1 : slash - path) : strdup(".");
+  int fd = open(dir, O_RDONLY | O_DIRECTORY);
+  free(dir);
+  if (fd < 0) {
+    return -errno;
+  }
+  int rv = (fsync(fd) < 0) ? -errno : 0;
+  close(fd);
+  return rv;
+}
+
+// Rewrites a pre-superblock image with the same geometry, keeping every
+// inode at its old id so directory contents carry over untouched. The new
+// image is built and committed next to the old one and only then renamed
+// over it, so a crash part way leaves the v0 image as it was. Must hold
+// txnLock exclusively.
+int
+upgrade_v0_image(const char* path, const byte* image) {
+  const v0_meta_block* old = (const v0_meta_block*) image;
+  size_t size = strlen(path) + sizeof(".upgrade");
+  char* temp = malloc(size);
+  snprintf(temp, size, "%s.upgrade", path);
+  int rv = format_image(temp, V0_DISK_SIZE, V0_BLOCK_SIZE, V0_INODE_COUNT);
+  if (rv == 0) {
+    rv = map_image(temp);
+  }
+  if (rv == 0) {
+    for (int i = 0; i < V0_INODE_COUNT; ++i) {
+      if (get_bit_state((byte*) old->inode_status, i)) {
+        alloc_set(&meta->inode_map, i);
+        bitmap_dirty(meta->sb->inode_bitmap_start, i, 1);
+        set_inode_defaults(&meta->inodes[i], old->inodes[i].mode);
+        copy_v0_inode(image, &old->inodes[i], &meta->inodes[i]);
+      }
     }
+    copy_v0_inode(image, &old->root, meta->root);
+    rv = commit_locked();
+  }
+  // The image stays open, so carrying on after the rename needs nothing
+  if (rv == 0 && rename(temp, path) < 0) {
+    rv = -errno;
+  }
+  if (rv == 0) {
+    rv = sync_parent_dir(path);
+  }
+  else {
+    unlink(temp);
+  }
+  free(temp);
+  return rv;
+}
+
+int
+open_image(const char* path) {
+  int rv = map_image(path);
+  if (rv != -EINVAL && rv != -ENOENT) {
+    return rv;
+  }
+  struct stat st;
+  if (rv == -ENOENT || stat(path, &st) < 0 || st.st_size == 0) {
+    // Nothing there yet, give it the default geometry
+    rv = format_image(path, DEFAULT_DISK_SIZE, DEFAULT_BLOCK_SIZE, DEFAULT_INODE_COUNT);
+    return (rv < 0) ? rv : map_image(path);
+  }
+  if (st.st_size != V0_DISK_SIZE) {
+    return -EINVAL;
+  }
+  byte* oldImage = malloc(V0_DISK_SIZE);
+  int fd = open(path, O_RDONLY);
+  rv = -EINVAL;
+  if (fd >= 0 && pread(fd, oldImage, V0_DISK_SIZE, 0) == V0_DISK_SIZE &&
+      is_v0_image(oldImage, V0_DISK_SIZE)) {
+    rv = upgrade_v0_image(path, oldImage);
   }
-  return currentNode;
+  if (fd >= 0) {
+    close(fd);
+  }
+  free(oldImage);
+  return rv;
+}
+
+int
+storage_init(const char* path) {
+  pthread_once(&txnOnce, init_txn);
+  pthread_rwlock_wrlock(&txnLock);
+  // Whatever was open before is finished with
+  commit_locked();
+  int rv = open_image(path);
+  if (rv == 0) {
+    upgrade_legacy_directories();
+    release_orphans();
+    // Upgrades get written out straight away
+    rv = commit_locked();
+    dcache_init(meta->inode_count);
+  }
+  pthread_rwlock_unlock(&txnLock);
+  if (rv == 0) {
+    start_commit_thread();
+  }
+  return rv;
+}
+
+inode*
+get_inode(const char* path) {
+  return walk_path(path, 0);
 }
 
 inode*
@@ -434,13 +1616,11 @@ long get_stat(const char* path, struct stat* st) {
 }
 
 long get_stat_inode_id(long inodeId, struct stat* st) {
-  return get_stat_inode(&meta->inodes[inodeId], st);
+  return get_stat_inode(get_inode_by_id(inodeId), st);
 }
 
-long get_stat_inode(inode* node, struct stat* st) {
-  if ((long) node <= 0) {
-      return (long) node;
-  }
+void
+fill_stat(inode* node, struct stat* st) {
   long diff = (long) node - (long) meta->inodes;
   // Fudge a little on root
   if (diff < 0) {
@@ -454,12 +1634,21 @@ long get_stat_inode(inode* node, struct stat* st) {
   st->st_uid = node->uid;
   st->st_rdev = node->rdev;
   st->st_size = node->size;
-  st->st_blksize = BLOCK_SIZE;
-  st->st_blocks = (node->size / BLOCK_SIZE) + 1;
+  st->st_blksize = meta->block_size;
+  // Counted in 512 byte units, holes don't take up anything
+  st->st_blocks = is_inline(node) ? 0 : extent_count(&node->extents) * (meta->block_size / 512);
   memcpy(&st->st_atim, &node->atim, sizeof(struct timespec));
   memcpy(&st->st_mtim, &node->mtim, sizeof(struct timespec));
   memcpy(&st->st_ctim, &node->ctim, sizeof(struct timespec));
+}
 
+long get_stat_inode(inode* node, struct stat* st) {
+  if ((long) node <= 0) {
+      return (long) node;
+  }
+  read_lock(node);
+  fill_stat(node, st);
+  unlock_inode(node);
   return 0;
 }
 
@@ -472,7 +1661,10 @@ get_data(const char* path) {
   if ((long) node < 0) {
     return (read_data*) -1;
   }
-  return read_inode(node);
+  read_lock(node);
+  read_data* data = read_inode(node);
+  unlock_inode(node);
+  return data;
 }
 
 void
@@ -483,7 +1675,7 @@ free_read_data(read_data* data) {
 
 int
 get_file_type(inode* node) {
-    if (node->mode & S_IFDIR) {
+    if (S_ISDIR(node->mode)) {
         return DT_DIR;
     }
     else {
@@ -526,171 +1718,711 @@ is_directory(const char* path) {
   return is_dir_inode(node);
 }
 
-void
-release_inode(long inodeId) {
-  set_bit_low(meta->inode_status, inodeId);
+// Both must be write locked
+int
+link_entry(inode* node, inode* parent, char* name) {
+  if (is_dir_inode(node)) {
+    return -EPERM;
+  }
+  if (node->nlink <= 0) {
+    // Unlinked after we found it
+    return -ENOENT;
+  }
+  long inodeId = inode_id(node);
+  int rv = dir_inode_insert(parent, name, inodeId, get_dirent_type(inodeId));
+  if (rv == 0) {
+    inode_dirty(node);
+    ++node->nlink;
+  }
+  return rv;
+}
+
+int
+link_inode(inode* node, inode* parent, char* name, int remember) {
+  txn_begin();
+  write_lock(parent);
+  write_lock(node);
+  int rv = link_entry(node, parent, name);
+  if (rv == 0 && remember) {
+    __atomic_add_fetch(&gens_of(node)->lookups, 1, __ATOMIC_RELAXED);
+  }
+  unlock_inode(node);
+  unlock_inode(parent);
+  txn_end();
+  return rv;
 }
 
 int
 inode_link(const char* from, const char* to) {
-  string_array* parsedFromPath = parse_path((char*) from);
-  string_array* parsedToPath = parse_path((char*) to);
-  inode_pair* fromPair = get_inode_pair(from);
-  inode_pair* toPair = get_inode_pair(to);
-  if ((long) fromPair < 0) {
-    return (long) fromPair;
-  }
-  if ((long) toPair < 0) {
-    return (long) toPair;
-  }
-  char* fromBasename = get_last(parsedFromPath);
-  char* toBasename = get_last(parsedToPath);
-  directory* fromDir = get_dir_from_inode(fromPair->parent);
-  directory* toDir = get_dir_from_inode(toPair->parent);
-  long inodeId = get_file_inode(fromDir, fromBasename);
-  add_file(toDir, toBasename, inodeId);
-  ++meta->inodes[inodeId].nlink;
-  void* serializedToDir = serialize(toDir);
-  write_to_inode(toPair->parent, serializedToDir, get_size_directory(toDir), 0);
-
-  free_string_array(parsedFromPath);
-  free_string_array(parsedToPath);
-  free_directory(fromDir);
-  free_directory(toDir);
-  free(serializedToDir);
-  return 0;
+  inode* node = get_inode(from);
+  if ((long) node < 0) {
+    return (long) node;
+  }
+  char name[DIR_NAME_MAX + 1];
+  inode* parent = get_parent_inode(to, name);
+  if ((long) parent < 0) {
+    return (long) parent;
+  }
+  return link_inode(node, parent, name, 0);
+}
+
+// Counts off a link whose entry is already gone, child must be write locked
+void
+drop_link(inode* child) {
+  inode_dirty(child);
+  --child->nlink;
+  // Whoever still knows the id keeps it alive until they forget it
+  if (child->nlink <= 0 && !__atomic_load_n(&gens_of(child)->lookups, __ATOMIC_RELAXED)) {
+    free_all_inode_blocks(child);
+    //printf("Releasing inode %d\n", inodeId);
+    release_inode(inode_id(child));
+  }
 }
 
+// Both parent and child must be write locked
 int
 delete_link(inode* parent, inode* child, char* basename) {
-  --child->nlink;
   // We only want to remove the inode if there are no links left to it
   // we ALWAYS want to remove the reference in this directory though
-  directory* dir = get_dir_from_inode(parent);
-  int inodeId = get_file_inode(dir, basename);
-  remove_file(dir, basename);
-  void* reserializedDir = serialize(dir);
-  write_to_inode(parent, reserializedDir, get_size_directory(dir), 0);
-  free(reserializedDir);
-  if (child->nlink <= 0) {
-    free_all_inode_blocks(child);
-    //printf("Releasing inode %d\n", inodeId);
-    release_inode(inodeId);
+  long inodeId = dir_inode_remove(parent, basename);
+  if (inodeId < 0) {
+    return inodeId;
   }
-  free_directory(dir);
+  drop_link(child);
   return 0;
 }
 
+// Removes name from parent, which must be write locked. Only an empty
+// directory can go, and only when dir asks for one.
+int
+unlink_entry(inode* parent, char* name, int dir) {
+  inode* child = get_inode_from_dir_inode(parent, name);
+  if ((long) child < 0) {
+    return (long) child;
+  }
+  if (!dir && is_dir_inode(child)) {
+    return -EISDIR;
+  }
+  if (dir && !is_dir_inode(child)) {
+    return -ENOTDIR;
+  }
+  write_lock(child);
+  int rv = (dir && !dir_inode_is_empty(child)) ? -ENOTEMPTY : delete_link(parent, child, name);
+  unlock_inode(child);
+  return rv;
+}
+
+int
+remove_entry(inode* parent, char* name, int dir) {
+  txn_begin();
+  write_lock(parent);
+  int rv = unlink_entry(parent, name, dir);
+  unlock_inode(parent);
+  txn_end();
+  return rv;
+}
+
+static int
+remove_path(const char* path, int dir) {
+  char name[DIR_NAME_MAX + 1];
+  inode* parent = get_parent_inode(path, name);
+  if ((long) parent < 0) {
+    return (long) parent;
+  }
+  return remove_entry(parent, name, dir);
+}
+
+int
+inode_unlink(const char* path) {
+  return remove_path(path, 0);
+}
+
+// The directory holding dir, from the header of its first block
+long
+dir_parent_id(inode* dir) {
+  const dir_block* first = dir_block_view(dir, 0);
+  return first->pnum;
+}
+
+// Whether ancestor is dir itself or any directory above it. Directories
+// only move under renameLock, which has to be held.
 int
-remove_dir_inode(inode* node) {
-  char** fileNames;
-  directory* parentDir = get_dir_from_inode(node);
-  int numFiles = get_file_names(parentDir, &fileNames);
-  for (int i = 0; i < numFiles; ++i) {
-    int inodeId = get_file_inode(parentDir, fileNames[i]);
-    inode* child = &meta->inodes[inodeId];
-    if (is_dir_inode(child)) {
-      int rv = remove_dir_inode(child);
+is_ancestor(inode* ancestor, inode* dir) {
+  long ancestorId = inode_id(ancestor);
+  long id = inode_id(dir);
+  // Bounded in case the parent links are ever left in a loop
+  for (long depth = 0; depth <= meta->inode_count; ++depth) {
+    if (id == ancestorId) {
+      return 1;
+    }
+    if (id < 0) {
+      return 0;
     }
-    delete_link(node, child, fileNames[i]);
+    id = dir_parent_id(&meta->inodes[id]);
   }
-  free_directory(parentDir);
-  //free_(node);
   return 0;
 }
 
+// Points every block of dir, which must be write locked, at a new parent
+void
+set_dir_parent(inode* dir, long pnum) {
+  long numBlocks = dir_block_count(dir);
+  for (long i = 0; i < numBlocks; ++i) {
+    ((dir_block*) dir_block_mut(dir, i))->pnum = pnum;
+  }
+}
+
+// Both parents must be write locked, and renameLock held
 int
-inode_unlink(const char* path) {
-  string_array* parsedPath = parse_path((char*) path);
-  inode_pair* pair = get_inode_pair(path);
-  inode* parent = pair->parent;
-  inode* child = pair->child;
-  int rv = 0;
-  if (is_dir_inode(child)) {
-    rv = remove_dir_inode(child);
+move_entry(inode* fromParent, char* fromName, inode* toParent, char* toName) {
+  inode* child = get_inode_from_dir_inode(fromParent, fromName);
+  if ((long) child < 0) {
+    return (long) child;
+  }
+  inode* replaced = get_inode_from_dir_inode(toParent, toName);
+  if (replaced == child) {
+    return 0;
+  }
+  if (is_dir_inode(child) && is_ancestor(child, toParent)) {
+    // Into itself
+    return -EINVAL;
+  }
+  long inodeId = inode_id(child);
+  int type = get_dirent_type(inodeId);
+  if ((long) replaced > 0) {
+    if (is_dir_inode(child) && !is_dir_inode(replaced)) {
+      return -ENOTDIR;
+    }
+    if (!is_dir_inode(child) && is_dir_inode(replaced)) {
+      return -EISDIR;
+    }
+    if (is_dir_inode(replaced) && is_ancestor(replaced, fromParent)) {
+      // Over one of its own ancestors, which can't be empty and would
+      // be locked out of order
+      return -ENOTEMPTY;
+    }
+    write_lock(replaced);
+    int rv = 0;
+    if (is_dir_inode(replaced) && !dir_inode_is_empty(replaced)) {
+      rv = -ENOTEMPTY;
+    }
+    else {
+      // Taken over in place, the old inode only loses its link once the
+      // name already leads to the new one
+      rv = dir_inode_replace(toParent, toName, inodeId, type);
+      if (rv >= 0) {
+        drop_link(replaced);
+        rv = 0;
+      }
+    }
+    unlock_inode(replaced);
+    if (rv < 0) {
+      return rv;
+    }
   }
   else {
-    char* basename = get_last(parsedPath);
-    rv = delete_link(parent, child, basename);
+    int rv = dir_inode_insert(toParent, toName, inodeId, type);
+    if (rv < 0) {
+      return rv;
+    }
+  }
+  dir_inode_remove(fromParent, fromName);
+  if (is_dir_inode(child) && fromParent != toParent) {
+    write_lock(child);
+    set_dir_parent(child, inode_id(toParent));
+    unlock_inode(child);
+  }
+  return 0;
+}
+
+// Moves the entry rather than going through link + unlink, which
+// directories can't do.
+int
+rename_entry(inode* fromParent, char* fromName, inode* toParent, char* toName) {
+  // Nothing can move a directory around while we hold this, so the two
+  // parents can't change places between checking and locking them
+  txn_begin();
+  pthread_mutex_lock(&renameLock);
+  inode* first = fromParent;
+  inode* second = toParent;
+  if (is_ancestor(toParent, fromParent) ||
+      (!is_ancestor(fromParent, toParent) && inode_id(toParent) < inode_id(fromParent))) {
+    first = toParent;
+    second = fromParent;
+  }
+  write_lock(first);
+  if (second != first) {
+    write_lock(second);
   }
-  free_string_array(parsedPath);
+  int rv = move_entry(fromParent, fromName, toParent, toName);
+  if (second != first) {
+    unlock_inode(second);
+  }
+  unlock_inode(first);
+  pthread_mutex_unlock(&renameLock);
+  txn_end();
   return rv;
 }
 
+int
+inode_rename(const char* from, const char* to) {
+  char fromName[DIR_NAME_MAX + 1];
+  char toName[DIR_NAME_MAX + 1];
+  inode* fromParent = get_parent_inode(from, fromName);
+  inode* toParent = get_parent_inode(to, toName);
+  if ((long) fromParent < 0 || (long) toParent < 0) {
+    return ((long) fromParent < 0) ? (long) fromParent : (long) toParent;
+  }
+  return rename_entry(fromParent, fromName, toParent, toName);
+}
+
+int
+chmod_inode(inode* node, mode_t mode) {
+  txn_begin();
+  write_lock(node);
+  inode_dirty(node);
+  // Only the permission bits, a file can't change type
+  node->mode = (node->mode & S_IFMT) | (mode & ~S_IFMT);
+  unlock_inode(node);
+  txn_end();
+  return 0;
+}
+
 int
 inode_chmod(const char* path, mode_t mode) {
   inode* node = get_inode(path);
   if ((long) node < 0) {
     return (long) node;
   }
-  node->mode = mode;
+  return chmod_inode(node, mode);
+}
+
+static void
+set_time(struct timespec* field, const struct timespec* value, const struct timespec* now) {
+  if (value->tv_nsec == UTIME_NOW) {
+    *field = *now;
+  }
+  else if (value->tv_nsec != UTIME_OMIT) {
+    *field = *value;
+  }
+}
+
+// Takes UTIME_NOW and UTIME_OMIT the same as utimensat(2)
+int
+utimens_inode(inode* node, const struct timespec ts[2]) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  txn_begin();
+  write_lock(node);
+  inode_dirty(node);
+  set_time(&node->atim, &ts[0], &now);
+  set_time(&node->mtim, &ts[1], &now);
+  unlock_inode(node);
+  txn_end();
   return 0;
 }
 
-long
-get_new_inode(const char* path, mode_t mode, dev_t dev) {
-  string_array* array = parse_path((char*) path);
-  inode* parent = &meta->root;
-  for (int i = 0; i < array->length - 1; ++i) {
-    parent = get_inode_from_dir_inode(parent, array->data[i]);
-    if ((long) parent < 0) {
-      return (long) parent;
-    }
+int
+inode_utimens(const char* path, const struct timespec ts[2]) {
+  inode* node = get_inode(path);
+  if ((long) node < 0) {
+    return (long) node;
   }
-  char* basename = array->data[array->length - 1];
+  return utimens_inode(node, ts);
+}
 
-  if ((long) parent < 0) {
-    printf("Error on parent inode get\n");
-    // TODO: This should probably return a directory not found error
-    return (long) parent;
+int
+write_path(const char* path, const char* buf, size_t size, off_t offset) {
+  inode* node = get_inode(path);
+  if ((long) node < 0) {
+    return (long) node;
   }
+  int rv;
+  int retried = 0;
+  do {
+    txn_begin();
+    write_lock(node);
+    rv = write_to_inode(node, (void*) buf, size, offset);
+    unlock_inode(node);
+    txn_end();
+  } while (!retried++ && reclaim_space(rv));
+  return rv;
+}
 
-  // Check the directory data
-  read_data* directoryData = read_inode(parent);
-  directory* dir = deserialize(directoryData->data, directoryData->size);
-  int newInodeId = 0;
-  while (get_bit_state(meta->inode_status, newInodeId)) {
-    ++newInodeId;
+// Sets the new inode up completely before its entry goes into parent
+// (which must be write locked), so nobody can find it half made.
+long
+make_entry(inode* parent, char* basename, mode_t mode, dev_t dev) {
+  if ((long) get_inode_from_dir_inode(parent, basename) >= 0) {
+    return -EEXIST;
   }
-  if (newInodeId >= INODE_COUNT) {
-    return -1;
+  long got;
+  long newInodeId = alloc_run(&meta->inode_map, -1, 1, &got);
+  if (newInodeId < 0) {
+    return newInodeId;
   }
-  set_bit_high(meta->inode_status, newInodeId);
-  // Add new file to the directory
-  add_file(dir, basename, newInodeId);
-  void* serializedParent = serialize(dir);
-  write_to_inode(parent, serializedParent, get_size_directory(dir), 0);
-  free_directory(dir);
-  free(serializedParent);
-
+  bitmap_dirty(meta->sb->inode_bitmap_start, newInodeId, 1);
+  meta_dirty(0);
   inode* newFileNode = &meta->inodes[newInodeId];
   set_inode_defaults(newFileNode, mode);
   newFileNode->rdev = dev;
+  int rv = 0;
+  if (is_dir_inode(newFileNode)) {
+    rv = init_dir_inode(newFileNode, newInodeId, inode_id(parent));
+  }
+  if (rv == 0) {
+    rv = dir_inode_insert(parent, basename, newInodeId, IFTODT(mode));
+  }
+  if (rv < 0) {
+    free_all_inode_blocks(newFileNode);
+    release_inode(newInodeId);
+    return rv;
+  }
   //printf("Giving inode %d\n", newInodeId);
   return newInodeId;
 }
 
+long
+new_entry(inode* parent, char* name, mode_t mode, dev_t dev, int remember) {
+  long rv;
+  int retried = 0;
+  do {
+    txn_begin();
+    write_lock(parent);
+    rv = make_entry(parent, name, mode, dev);
+    if (rv >= 0 && remember) {
+      __atomic_add_fetch(&meta->gens[rv + 1].lookups, 1, __ATOMIC_RELAXED);
+    }
+    unlock_inode(parent);
+    txn_end();
+  } while (!retried++ && reclaim_space(rv));
+  return rv;
+}
+
+long
+get_new_inode(const char* path, mode_t mode, dev_t dev) {
+  char name[DIR_NAME_MAX + 1];
+  inode* parent = get_parent_inode(path, name);
+  if ((long) parent < 0) {
+    return (long) parent;
+  }
+  return new_entry(parent, name, mode, dev, 0);
+}
+
 int
 create_dir_inode(const char* path, mode_t mode) {
-  int inodeId = get_new_inode(path, mode, 0);
-  inode* node = &meta->inodes[inodeId];
-  printf("mode=%d\n", mode);
-  node->mode = mode | S_IFDIR;
-  string_array* arr = parse_path((char*) path);
-  char* basename = get_last(arr);
-  // TODO: do we actually are about the pnum field?
-  directory* dir = create_directory(basename, inodeId, 0);
-  void* serialDir = serialize(dir);
-
-  write_to_inode(node, serialDir, get_size_directory(dir), 0);
-
-  free(serialDir);
-  free_directory(dir);
-  free_string_array(arr);
-  return 0;
+  log_debug("mkdir(%s, %04o)", path, mode);
+  long inodeId = get_new_inode(path, mode | S_IFDIR, 0);
+  return (inodeId < 0) ? inodeId : 0;
 }
 
 int
 remove_dir(const char* path) {
-  return inode_unlink(path);
+  return remove_path(path, 1);
+}
+
+// Kernel supplied ids can't be trusted to still be in use
+static inode*
+inode_at(long inodeId) {
+  if (inodeId < -1 || inodeId >= meta->inode_count ||
+      (inodeId >= 0 && !alloc_test(&meta->inode_map, inodeId))) {
+    return (inode*) -ENOENT;
+  }
+  return get_inode_by_id(inodeId);
+}
+
+static inode*
+dir_at(long inodeId) {
+  inode* node = inode_at(inodeId);
+  if ((long) node >= 0 && !is_dir_inode(node)) {
+    return (inode*) -ENOTDIR;
+  }
+  return node;
+}
+
+long
+lookup_inode_at(long parentId, const char* name) {
+  inode* parent = dir_at(parentId);
+  if ((long) parent < 0) {
+    return (long) parent;
+  }
+  read_lock(parent);
+  inode* child = get_inode_from_dir_inode(parent, (char*) name);
+  long rv = (long) child;
+  if ((long) child >= 0) {
+    // Counted while parent is still locked, so it can't be unlinked and
+    // freed before the caller gets to use the id
+    __atomic_add_fetch(&gens_of(child)->lookups, 1, __ATOMIC_RELAXED);
+    rv = inode_id(child);
+  }
+  unlock_inode(parent);
+  return rv;
+}
+
+long
+get_new_inode_at(long parentId, const char* name, mode_t mode, dev_t dev) {
+  inode* parent = dir_at(parentId);
+  if ((long) parent < 0) {
+    return (long) parent;
+  }
+  return new_entry(parent, (char*) name, mode, dev, 1);
+}
+
+int
+inode_link_at(long inodeId, long parentId, const char* name) {
+  inode* node = inode_at(inodeId);
+  inode* parent = dir_at(parentId);
+  if ((long) node < 0 || (long) parent < 0) {
+    return ((long) node < 0) ? (long) node : (long) parent;
+  }
+  return link_inode(node, parent, (char*) name, 1);
+}
+
+static int
+remove_at(long parentId, const char* name, int dir) {
+  inode* parent = dir_at(parentId);
+  if ((long) parent < 0) {
+    return (long) parent;
+  }
+  return remove_entry(parent, (char*) name, dir);
+}
+
+int
+inode_unlink_at(long parentId, const char* name) {
+  return remove_at(parentId, name, 0);
+}
+
+int
+remove_dir_at(long parentId, const char* name) {
+  return remove_at(parentId, name, 1);
+}
+
+int
+inode_rename_at(long fromParentId, const char* fromName, long toParentId, const char* toName) {
+  inode* fromParent = dir_at(fromParentId);
+  inode* toParent = dir_at(toParentId);
+  if ((long) fromParent < 0 || (long) toParent < 0) {
+    return ((long) fromParent < 0) ? (long) fromParent : (long) toParent;
+  }
+  return rename_entry(fromParent, (char*) fromName, toParent, (char*) toName);
+}
+
+int
+inode_chmod_id(long inodeId, mode_t mode) {
+  inode* node = inode_at(inodeId);
+  return ((long) node < 0) ? (long) node : chmod_inode(node, mode);
+}
+
+int
+inode_truncate_id(long inodeId, off_t size) {
+  inode* node = inode_at(inodeId);
+  return ((long) node < 0) ? (long) node : truncate_inode(node, size);
+}
+
+int
+inode_utimens_id(long inodeId, const struct timespec ts[2]) {
+  inode* node = inode_at(inodeId);
+  return ((long) node < 0) ? (long) node : utimens_inode(node, ts);
+}
+
+// Gives back count of the lookups handed out for inodeId. An inode with
+// no links left is only freed once nobody knows its id any more.
+void
+forget_inode(long inodeId, long count) {
+  if (inodeId < 0 || inodeId >= meta->inode_count) {
+    return;
+  }
+  inode* node = &meta->inodes[inodeId];
+  if (__atomic_sub_fetch(&gens_of(node)->lookups, count, __ATOMIC_RELAXED) > 0) {
+    return;
+  }
+  txn_begin();
+  write_lock(node);
+  // Unlinking holds the same lock, so nlink can't drop to 0 without this
+  // seeing it or it seeing the lookups gone
+  if (node->nlink <= 0 && alloc_test(&meta->inode_map, inodeId) &&
+      !__atomic_load_n(&gens_of(node)->lookups, __ATOMIC_RELAXED)) {
+    free_all_inode_blocks(node);
+    release_inode(inodeId);
+  }
+  unlock_inode(node);
+  txn_end();
+}
+
+// Past "." and "..", an offset is where to carry on in hash order: the
+// dir_hash and dir_minor_hash of the next entry to hand out. No two names
+// in a directory share both, and entries never move in that order, so
+// removing some or splitting a leaf between calls doesn't make the rest
+// skip or repeat.
+#define DIR_COOKIE_FIRST 2
+
+typedef struct ordered_entry {
+  uint64_t key;
+  const dir_entry* entry;
+} ordered_entry;
+
+static uint64_t
+entry_key(const dir_entry* entry) {
+  return ((uint64_t) entry->hash << DIR_MINOR_BITS) | dir_minor_hash(entry->name, entry->nameLen);
+}
+
+static int
+compare_entries(const void* a, const void* b) {
+  uint64_t first = ((const ordered_entry*) a)->key;
+  uint64_t second = ((const ordered_entry*) b)->key;
+  return (first > second) - (first < second);
+}
+
+// Calls fill for every entry of the directory from offset on, "." and
+// ".." included, until it returns non-zero. next is the offset to carry
+// on from after the entry.
+int
+list_dir_at(long dirId, long offset, dir_filler fill, void* context) {
+  inode* dir = dir_at(dirId);
+  if ((long) dir < 0) {
+    return (long) dir;
+  }
+  read_lock(dir);
+  int full = 0;
+  if (offset <= 0) {
+    full = fill(context, ".", dirId, DT_DIR, 1);
+  }
+  if (!full && offset <= 1) {
+    full = fill(context, "..", dir_parent_id(dir), DT_DIR, DIR_COOKIE_FIRST);
+  }
+  uint64_t key = (offset > DIR_COOKIE_FIRST) ? offset - DIR_COOKIE_FIRST : 0;
+  uint64_t hash = key >> DIR_MINOR_BITS;
+  dir_store store = store_of(dir);
+  arena_mark mark = arena_save();
+  int rv = 0;
+  // A leaf at a time, since only the hashes from one leaf on are needed
+  while (!full && hash <= UINT32_MAX) {
+    uint64_t end;
+    long leaf = dir_leaf_for(&store, (uint32_t) hash, &end);
+    if (leaf < 0) {
+      rv = leaf;
+      break;
+    }
+    const dir_block* block = dir_block_view(dir, leaf);
+    ordered_entry* entries = arena_alloc((block->count + 1) * sizeof(ordered_entry));
+    long count = 0;
+    uint32_t cursor = 0;
+    const dir_entry* entry;
+    while ((entry = dir_block_next(block, &cursor))) {
+      uint64_t entryKey = entry_key(entry);
+      if (entryKey >= key) {
+        entries[count].key = entryKey;
+        entries[count++].entry = entry;
+      }
+    }
+    qsort(entries, count, sizeof(ordered_entry), compare_entries);
+    for (long i = 0; i < count && !full; ++i) {
+      entry = entries[i].entry;
+      char name[DIR_NAME_MAX + 1];
+      memcpy(name, entry->name, entry->nameLen);
+      name[entry->nameLen] = 0;
+      full = fill(context, name, entry->inodeId, entry->type,
+                  DIR_COOKIE_FIRST + entries[i].key + 1);
+    }
+    hash = end;
+    key = end << DIR_MINOR_BITS;
+    arena_release(mark);
+  }
+  unlock_inode(dir);
+  return rv;
+}
+
+open_file*
+open_handle_id(long inodeId) {
+  inode* node = inode_at(inodeId);
+  if ((long) node < 0) {
+    return (open_file*) node;
+  }
+  open_file* fh = calloc(1, sizeof(open_file));
+  fh->inodeId = inodeId;
+  read_lock(node);
+  fh->generation = gens_of(node)->use;
+  unlock_inode(node);
+  pthread_mutex_init(&fh->lock, 0);
+  return fh;
+}
+
+open_file*
+open_handle(const char* path) {
+  inode* node = get_inode(path);
+  if ((long) node < 0) {
+    return (open_file*) node;
+  }
+  return open_handle_id(inode_id(node));
+}
+
+void
+release_handle(open_file* fh) {
+  pthread_mutex_destroy(&fh->lock);
+  free(fh);
+}
+
+// The inode behind a handle, as long as it hasn't been freed since the
+// handle was opened. Must be called with the inode locked.
+static int
+check_handle(open_file* fh, inode* node) {
+  return (gens_of(node)->use == fh->generation) ? 0 : -ENOENT;
+}
+
+// Several threads can share a handle, so each read works on its own copy
+// of the cached run and puts back whatever it ended up with.
+int
+read_handle(open_file* fh, char* buf, size_t size, off_t offset) {
+  inode* node = get_inode_by_id(fh->inodeId);
+  pthread_mutex_lock(&fh->lock);
+  block_run run = fh->run;
+  pthread_mutex_unlock(&fh->lock);
+  read_lock(node);
+  int rv = check_handle(fh, node);
+  if (rv == 0) {
+    rv = read_mapped(node, &run, buf, size, offset);
+  }
+  unlock_inode(node);
+  pthread_mutex_lock(&fh->lock);
+  fh->run = run;
+  pthread_mutex_unlock(&fh->lock);
+  return rv;
+}
+
+int
+write_handle(open_file* fh, const char* buf, size_t size, off_t offset) {
+  inode* node = get_inode_by_id(fh->inodeId);
+  pthread_mutex_lock(&fh->lock);
+  block_run run = fh->run;
+  pthread_mutex_unlock(&fh->lock);
+  int rv;
+  int retried = 0;
+  do {
+    txn_begin();
+    write_lock(node);
+    rv = check_handle(fh, node);
+    if (rv == 0) {
+      rv = write_mapped(node, &run, (void*) buf, size, offset);
+    }
+    unlock_inode(node);
+    txn_end();
+  } while (!retried++ && reclaim_space(rv));
+  pthread_mutex_lock(&fh->lock);
+  fh->run = run;
+  pthread_mutex_unlock(&fh->lock);
+  return rv;
+}
+
+int
+truncate_handle(open_file* fh, off_t size) {
+  inode* node = get_inode_by_id(fh->inodeId);
+  txn_begin();
+  write_lock(node);
+  int rv = check_handle(fh, node);
+  if (rv == 0) {
+    rv = change_inode_size(node, size);
+  }
+  unlock_inode(node);
+  txn_end();
+  return rv;
 }
@@ -5,14 +5,33 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <dirent.h>
+#include <stdint.h>
+#include <pthread.h>
 #include "directory.h"
+#include "extent.h"
 
-#define STARTING_BLOCKS 12
-#define DISK_SIZE 1024 * 1024
-#define BLOCK_SIZE 4096
-#define INODE_COUNT 2048
-#define BLOCK_COUNT DISK_SIZE / BLOCK_SIZE
-#define BIG_SIZE BLOCK_SIZE * STARTING_BLOCKS
+// Geometry used when nufs is pointed at an empty file, mkfs.nufs can
+// format an image with anything else.
+#define DEFAULT_DISK_SIZE (1024 * 1024)
+#define DEFAULT_BLOCK_SIZE 4096
+#define DEFAULT_INODE_COUNT 2048
+#define MIN_BLOCK_SIZE 512
+#define MAX_BLOCK_SIZE 65536
+
+#define NUFS_MAGIC 0x5346554e
+// Bump whenever the on disk layout changes
+#define NUFS_VERSION 8
+#define MIN_JOURNAL_BLOCKS 16
+#define MAX_JOURNAL_BLOCKS 1024
+
+/*
+ Inodes are 256 bytes. A new file or directory keeps its contents in the
+ inode itself, in the space its extent tree would take (INODE_INLINE is
+ set), and only moves out into blocks once it outgrows INODE_INLINE_MAX
+ bytes. An inline directory is one small leaf block of exactly that size.
+*/
+#define INODE_INLINE 0x1
+#define INODE_INLINE_MAX 164
 
 typedef struct inode {
     mode_t    mode;
@@ -24,17 +43,85 @@ typedef struct inode {
     struct timespec atim;
     struct timespec mtim;
     struct timespec ctim;
-    int direct;
-    int indirect;
+    uint32_t  flags;
+    union {
+        extent_root extents;
+        byte data[INODE_INLINE_MAX];
+    };
 } inode;
 
+/*
+ Block 0 of every image. Everything else is found from here: the block
+ bitmap, inode bitmap, inode table and journal follow it, each starting
+ on a block boundary, and data blocks start at data_start. Root's inode
+ lives in the superblock itself. The next_free_* fields are only hints
+ for where the allocators should start looking.
+*/
+typedef struct superblock {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint32_t inode_size;
+    uint64_t image_size;
+    uint32_t block_count;
+    uint32_t inode_count;
+    uint32_t block_bitmap_start;
+    uint32_t inode_bitmap_start;
+    uint32_t inode_table_start;
+    uint32_t journal_start;
+    uint32_t journal_blocks;
+    uint32_t data_start;
+    uint32_t next_free_block;
+    uint32_t next_free_inode;
+    inode root;
+} superblock;
+
 typedef struct read_data {
   mode_t type;
   size_t size;
   unsigned char* data;
 } read_data;
 
-void storage_init(const char* path);
+int storage_format(const char* path, size_t imageSize, size_t blockSize, long inodeCount);
+int storage_init(const char* path);
+/*
+ Changes sit in a private mapping of the image until they are committed.
+ Whatever the mode, a commit also happens when the journal fills up and
+ on storage_commit().
+
+ DURABILITY_NONE      commits only then, storage_sync() does nothing
+ DURABILITY_PERIODIC  also commits every intervalMs, and on storage_sync()
+ DURABILITY_FSYNC     also commits on storage_sync(), and nothing else
+*/
+typedef enum durability {
+    DURABILITY_NONE,
+    DURABILITY_PERIODIC,
+    DURABILITY_FSYNC,
+} durability;
+
+void storage_set_durability(durability mode, long intervalMs);
+int storage_commit();
+int storage_sync();
+
+// Views straight into the mapped image, no copy is made and nothing is
+// allocated, so never free() them. The image is mapped once for the life
+// of the process, so a view stays addressable until exit, but it only
+// means something while the block is still owned: once release_block()
+// hands it back it can be reused by anyone. block_mut() also puts the
+// block in the next commit's journal, so use it for every change.
+const void* block_view(int blockId);
+void* block_mut(int blockId);
+size_t storage_block_size();
+int get_next_block();
+long get_block_run(long goal, long want, long* got);
+void release_block(int blockId);
+void release_blocks(long start, long count);
+
+/*
+ Everything from here on takes the locks it needs, so it is safe to call
+ from several threads at once. The ones working on an inode* directly
+ (read_from_inode, write_to_inode) leave locking to the caller.
+*/
 long get_stat(const char* path, struct stat* st);
 long get_stat_inode_id(long inodeId, struct stat* st);
 long get_stat_inode(inode* node, struct stat* st);
@@ -46,15 +133,69 @@ int is_directory(const char* path);
 long get_new_inode(const char* path, mode_t mode, dev_t dev);
 int inode_link(const char* from, const char* to);
 int inode_unlink(const char* path);
+int inode_rename(const char* from, const char* to);
 int inode_chmod(const char* path, mode_t mode);
 int inode_truncate(const char* path, off_t size);
+int inode_utimens(const char* path, const struct timespec ts[2]);
 
 int create_dir_inode(const char* path, mode_t mode);
 int remove_dir(const char* path);
 
+/*
+ The same again by inode id instead of path, for callers that keep ids
+ around (the FUSE low level API). Root's id is -1. Every id one of these
+ hands back, whether looked up, created or linked, counts as a lookup
+ and has to be given back through forget_inode. Until it is, an inode
+ with no links left stays allocated so the id keeps working.
+*/
+typedef int (*dir_filler)(void* context, const char* name, long inodeId, int type, long next);
+
+long lookup_inode_at(long parentId, const char* name);
+long get_new_inode_at(long parentId, const char* name, mode_t mode, dev_t dev);
+int inode_link_at(long inodeId, long parentId, const char* name);
+int inode_unlink_at(long parentId, const char* name);
+int remove_dir_at(long parentId, const char* name);
+int inode_rename_at(long fromParentId, const char* fromName, long toParentId, const char* toName);
+int inode_chmod_id(long inodeId, mode_t mode);
+int inode_truncate_id(long inodeId, off_t size);
+int inode_utimens_id(long inodeId, const struct timespec ts[2]);
+int list_dir_at(long dirId, long offset, dir_filler fill, void* context);
+void forget_inode(long inodeId, long count);
+
 int read_path(const char* path, char* buf, size_t size, off_t offset);
+int write_path(const char* path, const char* buf, size_t size, off_t offset);
+int read_from_inode(inode* node, char* buf, size_t size, off_t offset);
 int write_to_inode(inode* node, void* buf, size_t size, off_t offset);
 
 void free_read_data(read_data* data);
 
+// The last run of blocks a handle was mapped to, so sequential reads
+// don't go back to the extent tree for every call
+typedef struct block_run {
+    long logical;
+    long physical;
+    long length;
+    uint32_t generation;
+} block_run;
+
+/*
+ An open file. It holds the inode the path resolved to when it was
+ opened, so reads and writes through it skip the path walk entirely.
+ Once the inode is freed (its last link removed) the handle only
+ returns -ENOENT, even if the inode is handed out again.
+*/
+typedef struct open_file {
+    long inodeId;
+    uint32_t generation;
+    pthread_mutex_t lock;
+    block_run run;
+} open_file;
+
+open_file* open_handle(const char* path);
+open_file* open_handle_id(long inodeId);
+void release_handle(open_file* fh);
+int read_handle(open_file* fh, char* buf, size_t size, off_t offset);
+int write_handle(open_file* fh, const char* buf, size_t size, off_t offset);
+int truncate_handle(open_file* fh, off_t size);
+
 #endif
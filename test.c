@@ -1,56 +1,72 @@
+#define _GNU_SOURCE
 #include <assert.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <pthread.h>
 
 #include "directory.h"
 #include "storage.h"
 #include "path_parser.h"
+#include "dcache.h"
+#include "alloc.h"
+#include "journal.h"
+#include "arena.h"
+#include "log.h"
+#include "stats.h"
 
 void
 test_add_file() {
-  directory* test = create_directory("", 0, 1);
-  add_file(test, "testfile.txt", 1);
-  assert(strcmp(test->paths,"/0testfile.txt/1") == 0);
-  add_file(test, "testfile2.txt", 2);
-  assert(strcmp(test->paths,"/0testfile.txt/1testfile2.txt/2") == 0);
+  directory* test = create_directory(0, 1, 4096);
+  assert(add_file(test, "testfile.txt", 1, DT_REG) == 0);
+  assert(get_num_files(test) == 1);
+  assert(add_file(test, "testfile2.txt", 2, DT_REG) == 0);
+  assert(get_num_files(test) == 2);
+  assert(add_file(test, "testfile2.txt", 3, DT_REG) == -EEXIST);
   free_directory(test);
 }
 
 void
 test_get_inode_num() {
-  directory* test = create_directory("", 0, 1);
-  add_file(test, "testfile.txt", 1);
+  directory* test = create_directory(0, 1, 4096);
+  add_file(test, "testfile.txt", 1, DT_REG);
   assert(get_file_inode(test, "testfile.txt") == 1);
-  add_file(test, "testfile2.txt", 2);
-  assert(strcmp(test->paths,"/0testfile.txt/1testfile2.txt/2") == 0);
+  add_file(test, "testfile2.txt", 2, DT_REG);
   assert(get_file_inode(test, "testfile2.txt") == 2);
+  assert(get_file_inode(test, "testfile3.txt") == -ENOENT);
   free_directory(test);
 }
 
 void
 test_remove_file() {
-  directory* test = create_directory("", 0, 1);
-  add_file(test, "testfile.txt", 1);
-  assert(strcmp(test->paths,"/0testfile.txt/1") == 0);
-  add_file(test, "testfile2.txt", 2);
-  assert(strcmp(test->paths,"/0testfile.txt/1testfile2.txt/2") == 0);
+  directory* test = create_directory(0, 1, 4096);
+  add_file(test, "testfile.txt", 1, DT_REG);
+  add_file(test, "testfile2.txt", 2, DT_REG);
 
   remove_file(test, "testfile.txt");
-  assert(strcmp(test->paths,"/0testfile2.txt/2") == 0);
+  assert(!has_file(test, "testfile.txt"));
+  assert(get_file_inode(test, "testfile2.txt") == 2);
+  assert(get_num_files(test) == 1);
   free_directory(test);
 }
 
 void
 test_num_files() {
-  directory* test = create_directory("", 0, 1);
-  add_file(test, "testfile.txt", 1);
+  directory* test = create_directory(0, 1, 4096);
+  assert(is_dir_empty(test));
+  add_file(test, "testfile.txt", 1, DT_REG);
   assert(get_num_files(test) == 1);
   free_directory(test);
 }
 
 void
 test_get_file_names() {
-  directory* test = create_directory("", 0, 1);
-  add_file(test, "testfile.txt", 1);
+  directory* test = create_directory(0, 1, 4096);
+  add_file(test, "testfile.txt", 1, DT_REG);
   char** names;
   long numFiles = get_file_names(test, &names);
   assert(numFiles == 1);
@@ -60,9 +76,9 @@ test_get_file_names() {
 
 void
 test_get_multiple_file_names() {
-  directory* test = create_directory("", -1, -1);
-  add_file(test, "test", 0);
-  add_file(test, "test2", 1);
+  directory* test = create_directory(-1, -1, 4096);
+  add_file(test, "test", 0, DT_REG);
+  add_file(test, "test2", 1, DT_REG);
   char** names;
   long numFiles = get_file_names(test, &names);
   assert(numFiles == 2);
@@ -73,34 +89,38 @@ test_get_multiple_file_names() {
 
 void
 test_serialize() {
-  void* test = create_directory("", 0, 1);
-  int* intData = test;
-  char* data = (char*) &intData[2];
-  assert(intData[0] == 0);
-  assert(intData[1] == 1);
-  assert(strcmp(data, "/0") == 0);
-  free_directory(test);
+  directory* dir = create_directory(3, 1, 4096);
+  add_file(dir, "test", 4, DT_DIR);
+  directory* copy = deserialize(dir->blocks, get_size_directory(dir));
+  assert(copy->inodeId == 3);
+  assert(copy->pnum == 1);
+  assert(get_file_inode(copy, "test") == 4);
+  const dir_entry* entry = dir_block_find(copy->blocks, "test", 4);
+  assert(entry && entry->type == DT_DIR);
+  free_directory(copy);
+  free_directory(dir);
 }
 
 void
 test_get_size() {
-  directory* dir = create_directory("", 0, 1);
-  // Expected contents are long,long,"/0"
-  assert(get_size_directory(dir) == sizeof(int) + sizeof(int) + 3);
+  directory* dir = create_directory(0, 1, 4096);
+  // A directory is always a whole number of blocks
+  assert(get_size_directory(dir) == 4096);
+  free_directory(dir);
 }
 
 void
 test_dot_names() {
-  directory* dir = create_directory("", 0, 1);
-  add_file(dir, ".test.swp", 1);
+  directory* dir = create_directory(0, 1, 4096);
+  add_file(dir, ".test.swp", 1, DT_REG);
   assert(get_file_inode(dir, ".test.swp") == 1);
   free_directory(dir);
 }
 
 void
 test_number_ending_names() {
-  directory* dir = create_directory("", 0, 1);
-  add_file(dir, "test2", 1);
+  directory* dir = create_directory(0, 1, 4096);
+  add_file(dir, "test2", 1, DT_REG);
   char** names;
   get_file_names(dir, &names);
   // We know num files is 1
@@ -109,69 +129,215 @@ test_number_ending_names() {
 }
 
 void
-test_can_have_negative_inode_number() {
-  directory* dir = create_directory("", 0, -1);
-  add_file(dir, "test2", 1);
-  char** names;
-  get_file_names(dir, &names);
-  // We know num files is 1
-  assert(strcmp(names[0], "test2") == 0);
+test_has_file() {
+  directory* dir = create_directory(-1, -1, 4096);
+  add_file(dir, "test", 0, DT_REG);
+  assert(has_file(dir, "test"));
   free_directory(dir);
 }
 
 void
-test_can_use_negative_inode_ids() {
-  directory* dir = create_directory("", -1, -1);
-  assert(strcmp(dir->paths, "/-1") == 0);
+test_has_file_is_not_substring_match() {
+  directory* dir = create_directory(-1, -1, 4096);
+  add_file(dir, "footest", 0, DT_REG);
+  assert(!has_file(dir, "test"));
+  assert(!has_file(dir, "foo"));
   free_directory(dir);
 }
 
 void
-test_get_names_with_negative() {
-  directory* dir = create_directory("", -1, -1);
-  add_file(dir, "test", 0);
-  char** names;
-  get_file_names(dir, &names);
-  assert(strcmp("test", names[0]) == 0);
+test_distinguish_swap_files() {
+  directory* dir = create_directory(-1, -1, 4096);
+  add_file(dir, ".testing.swp", 0, DT_REG);
+  add_file(dir, "testing", 1, DT_REG);
+  assert(get_file_inode(dir, "testing") == 1);
   free_directory(dir);
 }
 
 void
-test_has_file() {
-  directory* dir = create_directory("", -1, -1);
-  add_file(dir, "test", 0);
-  assert(has_file(dir, "test"));
+test_can_have_file_name_start_with_digit() {
+  directory* dir = create_directory(-1, -1, 4096);
+  add_file(dir, "2k.txt", 0, DT_REG);
+  assert(get_file_inode(dir, "2k.txt") == 0);
   free_directory(dir);
 }
 
 void
-test_distinguish_swap_files() {
-  directory* dir = create_directory("", -1, -1);
-  add_file(dir, ".testing.swp", 0);
-  add_file(dir, "testing", 1);
-  assert(get_file_inode(dir, "testing") == 1);
+test_directory_grows_blocks() {
+  directory* dir = create_directory(-1, -1, 4096);
+  char name[32];
+  for (int i = 0; i < 1000; ++i) {
+    sprintf(name, "file%d", i);
+    assert(add_file(dir, name, i, DT_REG) == 0);
+  }
+  assert(get_size_directory(dir) > 4096);
+  assert(get_num_files(dir) == 1000);
+  for (int i = 0; i < 1000; ++i) {
+    sprintf(name, "file%d", i);
+    assert(get_file_inode(dir, name) == i);
+  }
   free_directory(dir);
 }
 
 void
-test_can_have_file_name_start_with_digit() {
-  directory* dir = create_directory("", -1, -1);
-  add_file(dir, "2k.txt", 0);
-  assert(get_file_inode(dir, "2k.txt") == 0);
+test_removed_space_is_reused() {
+  char block[4096];
+  char name[32];
+  dir_block_init(block, sizeof(block), -1, -1);
+  int count = 0;
+  sprintf(name, "file%d", count);
+  while (dir_block_insert(block, name, strlen(name), count, DT_REG) == 0) {
+    ++count;
+    sprintf(name, "file%d", count);
+  }
+  // Punch holes in the full block, the inserts have to compact it
+  for (int i = 0; i < count; i += 2) {
+    sprintf(name, "file%d", i);
+    assert(dir_block_remove(block, name, strlen(name)) == i);
+  }
+  for (int i = 0; i < count; i += 2) {
+    sprintf(name, "fill%d", i);
+    assert(dir_block_insert(block, name, strlen(name), i, DT_REG) == 0);
+  }
+  for (int i = 1; i < count; i += 2) {
+    sprintf(name, "file%d", i);
+    assert(dir_block_lookup(block, name, strlen(name)) == i);
+  }
+}
+
+void
+test_convert_legacy_directory() {
+  char legacy[64];
+  int* header = (int*) legacy;
+  header[0] = -1;
+  header[1] = -1;
+  strcpy(&legacy[2 * sizeof(int)], "/-1one.txt/0\\2k.txt/1normal/12");
+  size_t size = 2 * sizeof(int) + strlen(&legacy[2 * sizeof(int)]) + 1;
+  assert(is_legacy_directory(legacy, size));
+  directory* dir = convert_legacy_directory(legacy, size, 4096, 0);
+  assert(!is_legacy_directory(dir->blocks, dir->size));
+  assert(get_num_files(dir) == 3);
+  assert(get_file_inode(dir, "one.txt") == 0);
+  assert(get_file_inode(dir, "2k.txt") == 1);
+  assert(get_file_inode(dir, "normal") == 12);
   free_directory(dir);
 }
 
+typedef struct counted_dir {
+  directory* dir;
+  long touched;
+} counted_dir;
+
+const void*
+counted_view(void* context, long blockIndex) {
+  counted_dir* counted = context;
+  ++counted->touched;
+  return counted->dir->blocks + blockIndex * counted->dir->blockSize;
+}
+
+void*
+counted_mut(void* context, long blockIndex) {
+  return (void*) counted_view(context, blockIndex);
+}
+
+long
+counted_grow(void* context) {
+  directory* dir = ((counted_dir*) context)->dir;
+  dir->blocks = realloc(dir->blocks, dir->size + dir->blockSize);
+  dir->size += dir->blockSize;
+  return dir->size / dir->blockSize - 1;
+}
+
+// Small blocks so the index needs both levels, finding a name still only
+// touches an index block per level and one leaf
 void
-test_no_leading_bslash_in_filename() {
-  directory* dir = create_directory("", -1, -1);
-  add_file(dir, "normal", 0);
-  add_file(dir, "2k.txt", 1);
-  add_file(dir, "othernormal", 2);
-  char** fileNames;
-  assert(get_file_names(dir, &fileNames) == 3);
-  assert(strcmp(fileNames[0], "normal") == 0);
-  assert(strcmp(fileNames[1], "2k.txt") == 0);
-  assert(strcmp(fileNames[2], "othernormal") == 0);
+test_indexed_directory() {
+  directory* dir = create_directory(-1, -1, 512);
+  counted_dir counted = {dir, 0};
+  dir_store store = {counted_view, counted_mut, counted_grow, &counted, 512};
+  char name[32];
+  for (int i = 0; i < 20000; ++i) {
+    sprintf(name, "entry%d", i);
+    assert(dir_insert(&store, name, strlen(name), i, DT_REG) == 0);
+  }
+  assert(dir_insert(&store, "entry7", 6, 1, DT_REG) == -EEXIST);
+  assert(get_num_files(dir) == 20000);
+  const dir_index* root = (dir_index*) dir->blocks;
+  assert(root->magic == DIR_INDEX_MAGIC);
+  assert(((dir_index*) (dir->blocks + root->entries[0].block * 512))->magic == DIR_INDEX_MAGIC);
+  for (int i = 0; i < 20000; i += 7) {
+    sprintf(name, "entry%d", i);
+    counted.touched = 0;
+    assert(dir_lookup(&store, name, strlen(name)) == i);
+    assert(counted.touched <= DIR_INDEX_LEVELS + 1);
+  }
+  for (int i = 0; i < 20000; i += 2) {
+    sprintf(name, "entry%d", i);
+    assert(dir_remove(&store, name, strlen(name)) == i);
+  }
+  for (int i = 0; i < 20000; ++i) {
+    sprintf(name, "entry%d", i);
+    assert(dir_lookup(&store, name, strlen(name)) == ((i % 2) ? i : -ENOENT));
+  }
+  directory* copy = deserialize(dir->blocks, get_size_directory(dir));
+  assert(get_file_inode(copy, "entry19999") == 19999);
+  free_directory(copy);
+  free_directory(dir);
+}
+
+typedef struct named_hash {
+  uint32_t hash;
+  int id;
+} named_hash;
+
+int
+compare_named_hashes(const void* a, const void* b) {
+  uint32_t first = ((const named_hash*) a)->hash;
+  uint32_t second = ((const named_hash*) b)->hash;
+  return (first > second) - (first < second);
+}
+
+// Two different names with the same dir_hash, from names spread over the
+// hash space since short ones that differ in a character or two never
+// collide under FNV
+void
+find_colliding_names(char* first, char* second) {
+  int count = 1 << 18;
+  named_hash* hashes = malloc(count * sizeof(named_hash));
+  char name[32];
+  for (int i = 0; i < count; ++i) {
+    sprintf(name, "%08x", (unsigned) (i * 2654435761u));
+    hashes[i].hash = dir_hash(name, strlen(name));
+    hashes[i].id = i;
+  }
+  qsort(hashes, count, sizeof(named_hash), compare_named_hashes);
+  int found = 0;
+  while (found + 1 < count && hashes[found].hash != hashes[found + 1].hash) {
+    ++found;
+  }
+  assert(found + 1 < count);
+  sprintf(first, "%08x", (unsigned) (hashes[found].id * 2654435761u));
+  sprintf(second, "%08x", (unsigned) (hashes[found + 1].id * 2654435761u));
+  free(hashes);
+}
+
+// A leaf full of names that share one hash can't be split, and finding
+// that out mustn't grow the directory or start an index
+void
+test_unsplittable_leaf() {
+  char first[32];
+  char second[32];
+  find_colliding_names(first, second);
+
+  // Room for those two and nothing else
+  directory* dir = create_directory(-1, -1, 96);
+  counted_dir counted = {dir, 0};
+  dir_store store = {counted_view, counted_mut, counted_grow, &counted, 96};
+  assert(dir_insert(&store, first, strlen(first), 1, DT_REG) == 0);
+  assert(dir_insert(&store, second, strlen(second), 2, DT_REG) == 0);
+  assert(dir_insert(&store, "other", 5, 3, DT_REG) == -ENOSPC);
+  assert(dir->size == 96 && dir_block_is_valid(dir->blocks));
+  assert(dir_lookup(&store, second, strlen(second)) == 2);
   free_directory(dir);
 }
 
@@ -182,17 +348,20 @@ test_directory() {
   test_remove_file();
   test_num_files();
   test_get_file_names();
+  test_serialize();
   test_get_size();
   test_dot_names();
   test_number_ending_names();
-  test_can_have_negative_inode_number();
-  test_can_use_negative_inode_ids();
-  test_get_names_with_negative();
   test_get_multiple_file_names();
   test_has_file();
+  test_has_file_is_not_substring_match();
   test_distinguish_swap_files();
   test_can_have_file_name_start_with_digit();
-  test_no_leading_bslash_in_filename();
+  test_directory_grows_blocks();
+  test_indexed_directory();
+  test_unsplittable_leaf();
+  test_removed_space_is_reused();
+  test_convert_legacy_directory();
 }
 
 void
@@ -227,12 +396,68 @@ test_can_end_with_slash() {
   free_string_array(testArray);
 }
 
+void
+test_arena() {
+  arena_mark start = arena_save();
+  char* kept = arena_strndup("kept", 4);
+  arena_mark mark = arena_save();
+  char* first = arena_alloc(100);
+  // Bigger than a chunk gets one of its own
+  char* big = arena_alloc(ARENA_CHUNK + 1);
+  memset(big, 'b', ARENA_CHUNK + 1);
+  arena_release(mark);
+  // Released memory gets handed out again
+  assert(arena_alloc(100) == first);
+  arena_mark later = arena_save();
+  arena_release(mark);
+  arena_release(later);
+  assert(arena_alloc(100) == first);
+  assert(strcmp(kept, "kept") == 0);
+  arena_release(start);
+}
+
+void
+test_path_iter() {
+  path_iter iter;
+  const char* name;
+  size_t len;
+  const char* path = "//dir///test/";
+  path_iter_init(&iter, path);
+  assert(path_next(&iter, &name, &len) && name == path + 2 && len == 3);
+  assert(path_has_next(&iter));
+  assert(path_next(&iter, &name, &len) && strncmp(name, "test", len) == 0 && len == 4);
+  assert(!path_has_next(&iter));
+  assert(!path_next(&iter, &name, &len));
+  path_iter_init(&iter, "/");
+  assert(!path_next(&iter, &name, &len));
+}
+
 void
 test_parser() {
+  test_arena();
   test_root_parse();
   test_single_parse();
   test_multi_parse();
+  test_path_iter();
+}
+void
+test_dcache() {
+  long childId;
+  dcache_init(16);
+  assert(!dcache_lookup(-1, "test", 4, &childId));
+  dcache_add(-1, "test", 4, 3);
+  assert(dcache_lookup(-1, "test", 4, &childId) && childId == 3);
+  assert(!dcache_lookup(-1, "tes", 3, &childId));
+  assert(!dcache_lookup(0, "test", 4, &childId));
+  dcache_add(-1, "gone", 4, -ENOENT);
+  assert(dcache_lookup(-1, "gone", 4, &childId) && childId == -ENOENT);
+  dcache_invalidate(-1, "test", 4);
+  assert(!dcache_lookup(-1, "test", 4, &childId));
+  dcache_add(5, "child", 5, 6);
+  dcache_forget_inode(5);
+  assert(!dcache_lookup(5, "child", 5, &childId));
 }
+
 /*
 void
 test_root() {
@@ -242,13 +467,827 @@ test_root() {
   free_directory(dir);
 }
 */
+void
+test_format_geometry() {
+  struct stat st;
+  assert(storage_format("test_fs", 2 * 1024 * 1024, 1024, 64) == 0);
+  assert(storage_init("test_fs") == 0);
+  assert(get_stat("/", &st) == 0);
+  assert(S_ISDIR(st.st_mode));
+  assert(st.st_blksize == 1024);
+  assert(storage_format("test_fs", 2 * 1024 * 1024, 1000, 64) == -EINVAL);
+  assert(storage_format("test_fs", 4096, 1024, 64) == -ENOSPC);
+  unlink("test_fs");
+}
+
+// Two files written a block at a time interleave on disk, so neither gets
+// runs longer than one block and the extent tree has to grow out of the
+// inode and past a single level of index.
+void
+test_fragmented_extents() {
+  static char block[1024];
+  static char readBuf[1024];
+  assert(storage_format("test_fs", 2 * 1024 * 1024, 1024, 64) == 0);
+  assert(storage_init("test_fs") == 0);
+  assert(get_new_inode("/a", S_IFREG | 0644, 0) >= 0);
+  assert(get_new_inode("/b", S_IFREG | 0644, 0) >= 0);
+  inode* a = get_inode("/a");
+  inode* b = get_inode("/b");
+  for (int i = 0; i < 600; ++i) {
+    memset(block, i, sizeof(block));
+    assert(write_to_inode(a, block, sizeof(block), (off_t) i * sizeof(block)) == sizeof(block));
+    memset(block, ~i, sizeof(block));
+    assert(write_to_inode(b, block, sizeof(block), (off_t) i * sizeof(block)) == sizeof(block));
+  }
+  assert(a->extents.header.depth > 1);
+  struct stat st;
+  assert(get_stat("/a", &st) == 0 && st.st_blocks == 600 * 2);
+  for (int i = 0; i < 600; i += 37) {
+    memset(block, i, sizeof(block));
+    assert(read_path("/a", readBuf, sizeof(readBuf), (off_t) i * sizeof(block)) == sizeof(block));
+    assert(memcmp(block, readBuf, sizeof(block)) == 0);
+  }
+  assert(inode_truncate("/a", 3 * sizeof(block)) == 0);
+  assert(a->extents.header.depth == 0);
+  assert(get_stat("/a", &st) == 0 && st.st_blocks == 3 * 2);
+  assert(inode_truncate("/b", 0) == 0);
+  // Only fits if the truncates gave back the tree blocks as well, which
+  // happens once they commit
+  assert(storage_commit() == 0);
+  static char big[1500 * 1024];
+  assert(get_new_inode("/c", S_IFREG | 0644, 0) >= 0);
+  assert(write_to_inode(get_inode("/c"), big, sizeof(big), 0) == sizeof(big));
+  assert(get_new_inode("/d", S_IFREG | 0644, 0) >= 0);
+  assert(write_to_inode(get_inode("/d"), big, 200 * 1024, 0) == 200 * 1024);
+  // Grown in one go from free space, so it should be a single run
+  assert(get_inode("/d")->extents.header.count == 1);
+  unlink("test_fs");
+}
+
+// With room for one more data block and no more, the root can't split
+// and move down, so the write has to fail without touching the tree and
+// everything written before still reads back
+void
+test_extent_split_enospc() {
+  static char block[1024];
+  static char readBuf[1024];
+  assert(storage_format("test_fs", 2 * 1024 * 1024, 1024, 64) == 0);
+  assert(storage_init("test_fs") == 0);
+  assert(get_new_inode("/f", S_IFREG | 0644, 0) >= 0);
+  inode* f = get_inode("/f");
+  // Every other block, so each one needs an extent of its own
+  for (int i = 0; i < INLINE_EXTENTS; ++i) {
+    memset(block, 'a' + i, sizeof(block));
+    assert(write_to_inode(f, block, sizeof(block), (off_t) 2 * i * sizeof(block)) == sizeof(block));
+  }
+  assert(f->extents.header.depth == 0 && f->extents.header.count == INLINE_EXTENTS);
+
+  // Take up all the space there is, then give back two blocks
+  assert(get_new_inode("/fill", S_IFREG | 0644, 0) >= 0);
+  inode* fill = get_inode("/fill");
+  long filled = 0;
+  while (write_to_inode(fill, block, sizeof(block), (off_t) filled * sizeof(block)) > 0) {
+    ++filled;
+  }
+  assert(inode_truncate("/fill", (filled - 2) * sizeof(block)) == 0);
+  assert(storage_commit() == 0);
+
+  // Into the middle, so the split moves half the root's extents
+  memset(block, 'z', sizeof(block));
+  assert(write_to_inode(f, block, sizeof(block), sizeof(block)) == -ENOSPC);
+  assert(f->extents.header.depth == 0 && f->extents.header.count == INLINE_EXTENTS);
+  for (int i = 0; i < INLINE_EXTENTS; ++i) {
+    memset(block, 'a' + i, sizeof(block));
+    assert(read_path("/f", readBuf, sizeof(readBuf), (off_t) 2 * i * sizeof(block)) == sizeof(block));
+    assert(memcmp(block, readBuf, sizeof(block)) == 0);
+  }
+
+  // And goes through once there is room
+  assert(inode_truncate("/fill", 0) == 0);
+  assert(storage_commit() == 0);
+  memset(block, 'z', sizeof(block));
+  assert(write_to_inode(f, block, sizeof(block), sizeof(block)) == sizeof(block));
+  assert(f->extents.header.depth == 1);
+  assert(read_path("/f", readBuf, sizeof(readBuf), sizeof(block)) == sizeof(block));
+  assert(readBuf[0] == 'z');
+  assert(read_path("/f", readBuf, sizeof(readBuf), 6 * sizeof(block)) == sizeof(block));
+  assert(readBuf[0] == 'd');
+  unlink("test_fs");
+}
+
+// Logs a new root mtime by hand, as if we crashed right after the commit
+// point, and checks that the next storage_init picks it up. A torn
+// transaction has to be left alone.
+void
+test_journal_replay() {
+  static char buf[1024];
+  struct stat st;
+  assert(storage_format("test_fs", 2 * 1024 * 1024, 1024, 64) == 0);
+  assert(storage_init("test_fs") == 0);
+  assert(get_new_inode("/f", S_IFREG | 0644, 0) >= 0);
+  assert(write_path("/f", "hello", 5, 0) == 5);
+  assert(storage_commit() == 0);
+  assert(storage_init("test_fs") == 0);
+  assert(read_path("/f", buf, sizeof(buf), 0) == 5);
+  assert(memcmp(buf, "hello", 5) == 0);
+
+  int fd = open("test_fs", O_RDWR);
+  assert(pread(fd, buf, sizeof(buf), 0) == sizeof(buf));
+  superblock* sb = (superblock*) buf;
+  uint32_t homes[1] = {0};
+  sb->root.mtim.tv_sec = 12345;
+  assert(journal_commit(fd, sb, 1, homes, 1, 0, 0, buf) == 0);
+  assert(storage_init("test_fs") == 0);
+  assert(get_stat("/", &st) == 0);
+  assert(st.st_mtim.tv_sec == 12345);
+  assert(read_path("/f", buf, sizeof(buf), 0) == 5);
+
+  assert(pread(fd, buf, sizeof(buf), 0) == sizeof(buf));
+  sb->root.mtim.tv_sec = 54321;
+  assert(journal_commit(fd, sb, 2, homes, 1, 0, 0, buf) == 0);
+  off_t logged = (off_t) (sb->journal_start + 1) * sizeof(buf);
+  assert(pwrite(fd, "x", 1, logged + 100) == 1);
+  assert(storage_init("test_fs") == 0);
+  assert(get_stat("/", &st) == 0);
+  assert(st.st_mtim.tv_sec == 12345);
+  close(fd);
+  unlink("test_fs");
+}
+
+void
+test_alloc_map() {
+  uint64_t bitmap[3] = {0, 0, 0};
+  uint32_t hint = 0;
+  alloc_map map = {0};
+  long got;
+  alloc_map_init(&map, bitmap, 150, &hint);
+  assert(map.freeCount == 150);
+  alloc_set(&map, 3);
+  assert(alloc_run(&map, -1, 10, &got) == 0 && got == 3);
+  assert(hint == 3);
+  assert(alloc_run(&map, -1, 100, &got) == 4 && got == 100);
+  assert(alloc_find(&map, 0) == 104);
+  // Only 46 left before the end, and the search never runs past it
+  assert(alloc_run(&map, 120, 100, &got) == 120 && got == 30);
+  assert(alloc_run(&map, -1, 100, &got) == 104 && got == 16);
+  assert(map.freeCount == 0);
+  assert(alloc_find(&map, 0) == -ENOSPC);
+  alloc_clear(&map, 70);
+  assert(alloc_find(&map, 140) == 70);
+  alloc_map_free(&map);
+}
+
+void
+test_sparse_files() {
+  static char buf[4096];
+  struct stat st;
+  assert(storage_format("test_fs", 2 * 1024 * 1024, 1024, 64) == 0);
+  assert(storage_init("test_fs") == 0);
+  assert(get_new_inode("/sparse", S_IFREG | 0644, 0) >= 0);
+  inode* node = get_inode("/sparse");
+  // Far bigger than the image, none of it is allocated
+  assert(inode_truncate("/sparse", 64 * 1024 * 1024) == 0);
+  assert(get_stat("/sparse", &st) == 0);
+  assert(st.st_size == 64 * 1024 * 1024 && st.st_blocks == 0);
+  memset(buf, 1, sizeof(buf));
+  assert(read_path("/sparse", buf, sizeof(buf), 5000) == sizeof(buf));
+  assert(buf[0] == 0 && buf[sizeof(buf) - 1] == 0);
+  // A write in the middle only allocates the block it lands on
+  assert(write_to_inode(node, "x", 1, 10 * 1024 * 1024) == 1);
+  assert(get_stat("/sparse", &st) == 0);
+  assert(st.st_blocks == 2);
+  assert(read_path("/sparse", buf, 3, 10 * 1024 * 1024 - 1) == 3);
+  assert(buf[0] == 0 && buf[1] == 'x' && buf[2] == 0);
+  // Shrinking into a block and growing again must not bring back old data
+  memset(buf, 'y', sizeof(buf));
+  assert(inode_truncate("/sparse", 0) == 0);
+  assert(write_to_inode(node, buf, sizeof(buf), 0) == sizeof(buf));
+  assert(inode_truncate("/sparse", 10) == 0);
+  assert(inode_truncate("/sparse", sizeof(buf)) == 0);
+  assert(read_path("/sparse", buf, sizeof(buf), 0) == sizeof(buf));
+  assert(buf[9] == 'y' && buf[10] == 0 && buf[sizeof(buf) - 1] == 0);
+  unlink("test_fs");
+}
+
+// Reads and writes through a handle go through its cached run, which
+// has to notice the file being cut short under it, and a handle whose
+// file is gone mustn't end up reading whoever gets the inode next.
+void
+test_open_files() {
+  static char block[1024];
+  static char readBuf[1024];
+  assert(storage_format("test_fs", 2 * 1024 * 1024, 1024, 64) == 0);
+  assert(storage_init("test_fs") == 0);
+  long inodeId = get_new_inode("/h", S_IFREG | 0644, 0);
+  assert(inodeId >= 0);
+  open_file* file = open_handle("/h");
+  assert((long) file > 0);
+  assert(open_handle("/missing") == (open_file*) -ENOENT);
+  for (int i = 0; i < 8; ++i) {
+    memset(block, 'a' + i, sizeof(block));
+    assert(write_handle(file, block, sizeof(block), (off_t) i * sizeof(block)) == sizeof(block));
+  }
+  for (int i = 0; i < 8; ++i) {
+    assert(read_handle(file, readBuf, sizeof(readBuf), (off_t) i * sizeof(block)) == sizeof(block));
+    assert(readBuf[0] == 'a' + i && readBuf[sizeof(readBuf) - 1] == 'a' + i);
+  }
+  assert(truncate_handle(file, 0) == 0);
+  // Takes the blocks the old run pointed at out of the running
+  assert(get_new_inode("/other", S_IFREG | 0644, 0) >= 0);
+  assert(storage_commit() == 0);
+  memset(block, 'x', sizeof(block));
+  assert(write_path("/other", block, sizeof(block), 0) == sizeof(block));
+  assert(truncate_handle(file, 4 * sizeof(block)) == 0);
+  assert(read_handle(file, readBuf, sizeof(readBuf), 2 * sizeof(block)) == sizeof(block));
+  assert(readBuf[0] == 0 && readBuf[sizeof(readBuf) - 1] == 0);
+  // Writes go through the run too, the stale one mustn't land on /other
+  memset(block, 'w', sizeof(block));
+  assert(write_handle(file, block, sizeof(block), 0) == sizeof(block));
+  assert(read_path("/other", readBuf, sizeof(readBuf), 0) == sizeof(block));
+  assert(readBuf[0] == 'x' && readBuf[sizeof(readBuf) - 1] == 'x');
+  assert(read_handle(file, readBuf, sizeof(readBuf), 0) == sizeof(block));
+  assert(readBuf[0] == 'w');
+
+  assert(inode_unlink("/h") == 0);
+  assert(read_handle(file, readBuf, sizeof(readBuf), 0) == -ENOENT);
+  // Fill the inodes up until the old one is handed out again
+  char path[32];
+  long reused = -1;
+  for (int i = 0; reused != inodeId; ++i) {
+    snprintf(path, sizeof(path), "/r%d", i);
+    reused = get_new_inode(path, S_IFREG | 0644, 0);
+    assert(reused >= 0);
+  }
+  assert(write_handle(file, block, sizeof(block), 0) == -ENOENT);
+  release_handle(file);
+  unlink("test_fs");
+}
+
+typedef struct listing {
+  char names[8][16];
+  long ids[8];
+  long next[8];
+  int count;
+  int max;
+} listing;
+
+int
+collect_entry(void* context, const char* name, long inodeId, int type, long next) {
+  listing* list = context;
+  if (list->count == list->max) {
+    return 1;
+  }
+  strncpy(list->names[list->count], name, sizeof(list->names[0]) - 1);
+  list->ids[list->count] = inodeId;
+  list->next[list->count++] = next;
+  return 0;
+}
+
+// The id based calls the FUSE low level API uses. An id handed out by a
+// lookup has to keep working after its last name is gone, until it is
+// forgotten or the filesystem is mounted again.
+void
+test_inode_ids() {
+  assert(storage_format("test_fs", 2 * 1024 * 1024, 1024, 64) == 0);
+  assert(storage_init("test_fs") == 0);
+  long dirId = get_new_inode_at(-1, "d", S_IFDIR | 0755, 0);
+  assert(dirId >= 0);
+  long fileId = get_new_inode_at(dirId, "f", S_IFREG | 0644, 0);
+  assert(fileId >= 0);
+  assert(get_new_inode_at(dirId, "f", S_IFREG | 0644, 0) == -EEXIST);
+  assert(get_new_inode_at(fileId, "x", S_IFREG | 0644, 0) == -ENOTDIR);
+  // Sockets and block devices share a bit with S_IFDIR, but aren't one
+  long socketId = get_new_inode_at(dirId, "s", S_IFSOCK | 0644, 0);
+  assert(socketId >= 0);
+  assert(get_new_inode_at(socketId, "x", S_IFREG | 0644, 0) == -ENOTDIR);
+  assert(get_new_inode_at(dirId, "b", S_IFBLK | 0644, 0) >= 0);
+  assert(list_dir_at(lookup_inode_at(dirId, "b"), 0, collect_entry, 0) == -ENOTDIR);
+  assert(inode_unlink_at(dirId, "s") == 0);
+  assert(inode_unlink_at(dirId, "b") == 0);
+  assert(lookup_inode_at(dirId, "f") == fileId);
+  assert(lookup_inode_at(dirId, "missing") == -ENOENT);
+  assert(get_new_inode_at(dirId, "g", S_IFREG | 0644, 0) >= 0);
+
+  listing list = {.max = 8};
+  assert(list_dir_at(dirId, 0, collect_entry, &list) == 0);
+  assert(list.count == 4);
+  assert(strcmp(list.names[0], ".") == 0 && strcmp(list.names[1], "..") == 0);
+  // Carrying on from the second entry's offset picks up at the third
+  listing rest = {.max = 8};
+  assert(list_dir_at(dirId, list.next[1], collect_entry, &rest) == 0);
+  assert(rest.count == 2 && strcmp(rest.names[0], list.names[2]) == 0);
+  listing one = {.max = 1};
+  assert(list_dir_at(dirId, list.next[2], collect_entry, &one) == 0);
+  assert(one.count == 1 && strcmp(one.names[0], list.names[3]) == 0);
+
+  // Moving a directory repoints its ".." and it can't go under itself
+  long otherId = get_new_inode_at(-1, "o", S_IFDIR | 0755, 0);
+  assert(otherId >= 0);
+  assert(inode_rename_at(-1, "o", dirId, "o") == 0);
+  listing moved = {.max = 2};
+  assert(list_dir_at(otherId, 0, collect_entry, &moved) == 0);
+  assert(moved.count == 2 && moved.ids[1] == dirId);
+  assert(inode_rename_at(-1, "d", otherId, "d") == -EINVAL);
+
+  // Still known to the caller, so unlinking leaves the inode readable
+  assert(write_path("/d/f", "kept", 4, 0) == 4);
+  assert(inode_unlink_at(dirId, "f") == 0);
+  assert(lookup_inode_at(dirId, "f") == -ENOENT);
+  open_file* file = open_handle_id(fileId);
+  assert((long) file > 0);
+  char buf[8];
+  assert(read_handle(file, buf, sizeof(buf), 0) == 4 && memcmp(buf, "kept", 4) == 0);
+  release_handle(file);
+  forget_inode(fileId, 2);
+  assert(open_handle_id(fileId) == (open_file*) -ENOENT);
+
+  // Never forgotten before the next mount, which cleans it up instead
+  long lostId = lookup_inode_at(dirId, "g");
+  assert(inode_unlink_at(dirId, "g") == 0);
+  assert(storage_init("test_fs") == 0);
+  assert(open_handle_id(lostId) == (open_file*) -ENOENT);
+  unlink("test_fs");
+}
+
+typedef struct chunk {
+  int seen[300];
+  long next;
+  int left;
+} chunk;
+
+int
+mark_entry(void* context, const char* name, long inodeId, int type, long next) {
+  chunk* list = context;
+  if (list->left == 0) {
+    return 1;
+  }
+  if (name[0] == 'e') {
+    ++list->seen[atoi(name + 1)];
+  }
+  assert(type == (name[0] == '.' ? DT_DIR : DT_REG));
+  list->next = next;
+  --list->left;
+  return 0;
+}
+
+// A directory spread over many blocks, listed a few entries at a time
+void
+test_list_in_chunks() {
+  char name[32];
+  assert(storage_format("test_fs", 2 * 1024 * 1024, 1024, 512) == 0);
+  assert(storage_init("test_fs") == 0);
+  long dirId = get_new_inode_at(-1, "d", S_IFDIR | 0755, 0);
+  for (int i = 0; i < 300; ++i) {
+    snprintf(name, sizeof(name), "e%d", i);
+    assert(get_new_inode_at(dirId, name, S_IFREG | 0644, 0) >= 0);
+  }
+  chunk list = {{0}, 0, 0};
+  long calls = 0;
+  do {
+    list.left = 7;
+    assert(list_dir_at(dirId, list.next, mark_entry, &list) == 0);
+    ++calls;
+  } while (list.left == 0);
+  assert(calls == 302 / 7 + 1);
+  for (int i = 0; i < 300; ++i) {
+    assert(list.seen[i] == 1);
+  }
+  // Indexed by now, and still after the journal has been replayed
+  assert(storage_init("test_fs") == 0);
+  assert(lookup_inode_at(dirId, "e299") >= 0);
+  assert(inode_unlink_at(dirId, "e150") == 0);
+  assert(lookup_inode_at(dirId, "e150") == -ENOENT);
+  unlink("test_fs");
+}
+
+// What one chunk of a listing handed out, to unlink after the call
+typedef struct batch {
+  char names[7][32];
+  int count;
+  long next;
+} batch;
+
+int
+batch_entry(void* context, const char* name, long inodeId, int type, long next) {
+  batch* list = context;
+  if (list->count == 7) {
+    return 1;
+  }
+  if (name[0] != '.') {
+    strcpy(list->names[list->count++], name);
+  }
+  list->next = next;
+  return 0;
+}
+
+// Removing what has been listed so far, like rm -r does, or adding enough
+// to split leaves between calls, mustn't make the listing skip anything
+void
+test_list_while_changing() {
+  char name[32];
+  assert(storage_format("test_fs", 2 * 1024 * 1024, 1024, 1024) == 0);
+  assert(storage_init("test_fs") == 0);
+  long dirId = get_new_inode_at(-1, "d", S_IFDIR | 0755, 0);
+  for (int i = 0; i < 300; ++i) {
+    snprintf(name, sizeof(name), "e%d", i);
+    assert(get_new_inode_at(dirId, name, S_IFREG | 0644, 0) >= 0);
+  }
+  batch list = {.next = 0};
+  long removed = 0;
+  do {
+    list.count = 0;
+    assert(list_dir_at(dirId, list.next, batch_entry, &list) == 0);
+    for (int i = 0; i < list.count; ++i) {
+      assert(inode_unlink_at(dirId, list.names[i]) == 0);
+      ++removed;
+    }
+  } while (list.count > 0);
+  assert(removed == 300);
+
+  chunk seen = {{0}, 0, 0};
+  for (int i = 0; i < 300; ++i) {
+    snprintf(name, sizeof(name), "e%d", i);
+    assert(get_new_inode_at(dirId, name, S_IFREG | 0644, 0) >= 0);
+  }
+  int added = 0;
+  do {
+    seen.left = 7;
+    assert(list_dir_at(dirId, seen.next, mark_entry, &seen) == 0);
+    for (int i = 0; i < 5 && added < 600; ++i, ++added) {
+      snprintf(name, sizeof(name), "n%d", added);
+      assert(get_new_inode_at(dirId, name, S_IFREG | 0644, 0) >= 0);
+    }
+  } while (seen.left == 0);
+  for (int i = 0; i < 300; ++i) {
+    assert(seen.seen[i] == 1);
+  }
+  unlink("test_fs");
+}
+
+int
+first_entry(void* context, const char* name, long inodeId, int type, long next) {
+  batch* list = context;
+  if (list->count == 1) {
+    return 1;
+  }
+  if (name[0] != '.') {
+    strcpy(list->names[list->count++], name);
+  }
+  list->next = next;
+  return 0;
+}
+
+// Names with the same hash are told apart by their own offsets, so
+// unlinking the one already listed can't hide the other
+void
+test_list_colliding_names() {
+  char first[32];
+  char second[32];
+  find_colliding_names(first, second);
+  assert(storage_format("test_fs", 2 * 1024 * 1024, 1024, 64) == 0);
+  assert(storage_init("test_fs") == 0);
+  long dirId = get_new_inode_at(-1, "d", S_IFDIR | 0755, 0);
+  assert(get_new_inode_at(dirId, first, S_IFREG | 0644, 0) >= 0);
+  assert(get_new_inode_at(dirId, second, S_IFREG | 0644, 0) >= 0);
+  batch list = {.next = 0};
+  assert(list_dir_at(dirId, list.next, first_entry, &list) == 0);
+  assert(list.count == 1);
+  char listed[32];
+  strcpy(listed, list.names[0]);
+  assert(inode_unlink_at(dirId, listed) == 0);
+  list.count = 0;
+  assert(list_dir_at(dirId, list.next, first_entry, &list) == 0);
+  assert(list.count == 1);
+  assert(strcmp(list.names[0], strcmp(listed, first) ? first : second) == 0);
+  list.count = 0;
+  assert(list_dir_at(dirId, list.next, first_entry, &list) == 0);
+  assert(list.count == 0);
+  unlink("test_fs");
+}
+
+// Small files and directories live in the inode until they outgrow it
+void
+test_inline_data() {
+  char buf[400];
+  char name[32];
+  struct stat st;
+  assert(storage_format("test_fs", 2 * 1024 * 1024, 1024, 64) == 0);
+  assert(storage_init("test_fs") == 0);
+  assert(get_new_inode("/small", S_IFREG | 0644, 0) >= 0);
+  memset(buf, 's', 100);
+  assert(write_path("/small", buf, 100, 0) == 100);
+  assert(inode_truncate("/small", 60) == 0);
+  assert(inode_truncate("/small", 120) == 0);
+  assert(get_stat("/small", &st) == 0);
+  assert(st.st_size == 120 && st.st_blocks == 0);
+  assert(read_path("/small", buf, sizeof(buf), 0) == 120);
+  assert(buf[59] == 's' && buf[60] == 0 && buf[119] == 0);
+
+  // Past the inline space it moves out into a block, keeping what it had
+  memset(buf, 'b', sizeof(buf));
+  assert(write_path("/small", buf, 200, 150) == 200);
+  assert(get_stat("/small", &st) == 0);
+  assert(st.st_size == 350 && st.st_blocks > 0);
+  assert(read_path("/small", buf, sizeof(buf), 0) == 350);
+  assert(buf[59] == 's' && buf[60] == 0 && buf[149] == 0 && buf[150] == 'b' && buf[349] == 'b');
+
+  assert(create_dir_inode("/d", 0755) == 0);
+  assert(get_stat("/d", &st) == 0);
+  assert(st.st_size == INODE_INLINE_MAX && st.st_blocks == 0);
+  for (int i = 0; i < 40; ++i) {
+    snprintf(name, sizeof(name), "/d/entry%d", i);
+    assert(get_new_inode(name, S_IFREG | 0644, 0) >= 0);
+  }
+  assert(get_stat("/d", &st) == 0);
+  assert(st.st_blocks > 0);
+  assert(storage_init("test_fs") == 0);
+  for (int i = 0; i < 40; ++i) {
+    snprintf(name, sizeof(name), "/d/entry%d", i);
+    assert((long) get_inode(name) >= 0);
+  }
+  assert(read_path("/small", buf, sizeof(buf), 0) == 350 && buf[0] == 's');
+  unlink("test_fs");
+}
+
+void
+test_long_paths() {
+  char path[2048];
+  assert(storage_format("test_fs", 2 * 1024 * 1024, 1024, 256) == 0);
+  assert(storage_init("test_fs") == 0);
+  // Deeper than anything a fixed component array would hold
+  strcpy(path, "");
+  for (int i = 0; i < 100; ++i) {
+    strcat(path, "/d");
+    assert(create_dir_inode(path, 0755) == 0);
+  }
+  strcat(path, "/leaf");
+  assert(get_new_inode(path, S_IFREG | 0644, 0) >= 0);
+  assert((long) get_inode(path) >= 0);
+  assert(inode_rename(path, "/leaf") == 0);
+  assert((long) get_inode("//leaf/") >= 0);
+
+  // A component past DIR_NAME_MAX is refused wherever it sits
+  memset(path, 'n', 600);
+  path[0] = '/';
+  path[600] = 0;
+  assert((long) get_inode(path) == -ENAMETOOLONG);
+  assert(get_new_inode(path, S_IFREG | 0644, 0) == -ENAMETOOLONG);
+  strcat(path, "/file");
+  assert((long) get_inode(path) == -ENAMETOOLONG);
+  assert(inode_unlink(path) == -ENAMETOOLONG);
+  assert(get_new_inode("/", S_IFREG | 0644, 0) == -EINVAL);
+  unlink("test_fs");
+}
+
+// unlink only takes files and rmdir only empty directories, nothing ever
+// goes along with what was asked for
+void
+test_remove_dir() {
+  assert(storage_format("test_fs", 2 * 1024 * 1024, 1024, 64) == 0);
+  assert(storage_init("test_fs") == 0);
+  assert(create_dir_inode("/d", 0755) == 0);
+  assert(get_new_inode("/d/a", S_IFREG | 0644, 0) >= 0);
+  assert(get_new_inode("/c", S_IFREG | 0644, 0) >= 0);
+  assert(remove_dir("/d") == -ENOTEMPTY);
+  assert(inode_unlink("/d") == -EISDIR);
+  assert(remove_dir("/c") == -ENOTDIR);
+  assert((long) get_inode("/d/a") > 0 && (long) get_inode("/c") > 0);
+
+  long dirId = lookup_inode_at(-1, "d");
+  assert(remove_dir_at(-1, "d") == -ENOTEMPTY);
+  assert(inode_unlink_at(-1, "d") == -EISDIR);
+  assert(remove_dir_at(-1, "c") == -ENOTDIR);
+  assert(inode_unlink_at(dirId, "a") == 0);
+  assert(remove_dir_at(-1, "d") == 0);
+  assert(lookup_inode_at(-1, "d") == -ENOENT);
+  forget_inode(dirId, 1);
+  assert(inode_unlink("/c") == 0);
+  unlink("test_fs");
+}
+
+// Renaming over something that is already there only replaces what it
+// can, and never loses either name when it can't
+void
+test_rename_over() {
+  char buf[8];
+  assert(storage_format("test_fs", 2 * 1024 * 1024, 1024, 64) == 0);
+  assert(storage_init("test_fs") == 0);
+  assert(create_dir_inode("/a", 0755) == 0);
+  assert(create_dir_inode("/b", 0755) == 0);
+  assert(get_new_inode("/b/precious", S_IFREG | 0644, 0) >= 0);
+  assert(get_new_inode("/f", S_IFREG | 0644, 0) >= 0);
+  assert(write_path("/f", "file", 4, 0) == 4);
+  assert(get_new_inode("/g", S_IFREG | 0644, 0) >= 0);
+
+  assert(inode_rename("/a", "/b") == -ENOTEMPTY);
+  assert((long) get_inode("/a") > 0 && (long) get_inode("/b/precious") > 0);
+  assert(inode_rename("/f", "/b") == -EISDIR);
+  assert(inode_rename("/a", "/f") == -ENOTDIR);
+  assert(read_path("/f", buf, sizeof(buf), 0) == 4);
+
+  // An empty directory or a file can be taken over
+  assert(inode_unlink("/b/precious") == 0);
+  assert(inode_rename("/a", "/b") == 0);
+  assert(get_inode("/a") == (inode*) -ENOENT);
+  assert((long) get_inode("/b") > 0);
+  assert(inode_rename("/f", "/g") == 0);
+  assert(read_path("/g", buf, sizeof(buf), 0) == 4 && memcmp(buf, "file", 4) == 0);
+  assert(get_inode("/f") == (inode*) -ENOENT);
+
+  // Still there once the journal has been replayed
+  assert(storage_init("test_fs") == 0);
+  assert(read_path("/g", buf, sizeof(buf), 0) == 4 && memcmp(buf, "file", 4) == 0);
+  assert((long) get_inode("/b") > 0);
+  unlink("test_fs");
+}
+
+#define TEST_THREADS 4
+
+// Each thread works in its own directory, creating, writing, renaming and
+// removing files, while also reading one file they all share.
+void*
+concurrent_worker(void* arg) {
+  long id = (long) arg;
+  char dir[32];
+  char path[64];
+  char moved[64];
+  char buf[3000];
+  char readBuf[3000];
+  snprintf(dir, sizeof(dir), "/t%ld", id);
+  for (int i = 0; i < 50; ++i) {
+    snprintf(path, sizeof(path), "%s/f%d", dir, i);
+    snprintf(moved, sizeof(moved), "/t%ld/g%d", (id + 1) % TEST_THREADS, i + 100 * (int) id);
+    memset(buf, 'a' + id, sizeof(buf));
+    assert(get_new_inode(path, S_IFREG | 0644, 0) >= 0);
+    assert(write_path(path, buf, sizeof(buf), i) == sizeof(buf));
+    assert(read_path(path, readBuf, sizeof(readBuf), i) == sizeof(readBuf));
+    assert(memcmp(buf, readBuf, sizeof(buf)) == 0);
+    assert(read_path("/shared", readBuf, sizeof(readBuf), 0) == sizeof(readBuf));
+    assert(readBuf[0] == 's' && readBuf[sizeof(readBuf) - 1] == 's');
+    // Across into the next thread's directory, then gone again
+    assert(inode_rename(path, moved) == 0);
+    assert(inode_unlink(moved) == 0);
+  }
+  return 0;
+}
+
+void
+test_concurrent_access() {
+  char buf[3000];
+  pthread_t threads[TEST_THREADS];
+  assert(storage_format("test_fs", 4 * 1024 * 1024, 1024, 256) == 0);
+  assert(storage_init("test_fs") == 0);
+  memset(buf, 's', sizeof(buf));
+  assert(get_new_inode("/shared", S_IFREG | 0644, 0) >= 0);
+  assert(write_path("/shared", buf, sizeof(buf), 0) == sizeof(buf));
+  for (long i = 0; i < TEST_THREADS; ++i) {
+    char dir[32];
+    snprintf(dir, sizeof(dir), "/t%ld", i);
+    assert(create_dir_inode(dir, 0755) == 0);
+  }
+  for (long i = 0; i < TEST_THREADS; ++i) {
+    assert(pthread_create(&threads[i], 0, concurrent_worker, (void*) i) == 0);
+  }
+  for (long i = 0; i < TEST_THREADS; ++i) {
+    pthread_join(threads[i], 0);
+  }
+  unlink("test_fs");
+}
+
+// Whether text has made it into the image file itself
+int
+image_contains(const char* text) {
+  long size = 2 * 1024 * 1024;
+  char* image = malloc(size);
+  int fd = open("test_fs", O_RDONLY);
+  long got = pread(fd, image, size, 0);
+  close(fd);
+  int found = got > 0 && memmem(image, got, text, strlen(text)) != 0;
+  free(image);
+  return found;
+}
+
+void*
+sync_worker(void* arg) {
+  char path[32];
+  char text[32];
+  snprintf(path, sizeof(path), "/s%ld", (long) arg);
+  snprintf(text, sizeof(text), "synced by %ld", (long) arg);
+  assert(get_new_inode(path, S_IFREG | 0644, 0) >= 0);
+  assert(write_path(path, text, strlen(text), 0) == (int) strlen(text));
+  assert(storage_sync() == 0);
+  assert(image_contains(text));
+  return 0;
+}
+
+void
+test_durability() {
+  pthread_t threads[TEST_THREADS];
+  assert(storage_format("test_fs", 2 * 1024 * 1024, 1024, 64) == 0);
+  assert(storage_init("test_fs") == 0);
+  storage_set_durability(DURABILITY_NONE, 0);
+  assert(get_new_inode("/n", S_IFREG | 0644, 0) >= 0);
+  assert(write_path("/n", "not synced", 10, 0) == 10);
+  assert(storage_sync() == 0);
+  assert(!image_contains("not synced"));
+
+  storage_set_durability(DURABILITY_FSYNC, 0);
+  for (long i = 0; i < TEST_THREADS; ++i) {
+    assert(pthread_create(&threads[i], 0, sync_worker, (void*) i) == 0);
+  }
+  for (long i = 0; i < TEST_THREADS; ++i) {
+    pthread_join(threads[i], 0);
+  }
+  assert(image_contains("not synced"));
+  storage_set_durability(DURABILITY_PERIODIC, 0);
+  unlink("test_fs");
+}
+
 void
 test_storage() {
-  //storage_init("test_fs");
+  test_alloc_map();
+  test_dcache();
+  test_format_geometry();
+  test_fragmented_extents();
+  test_extent_split_enospc();
+  test_sparse_files();
+  test_journal_replay();
+  test_open_files();
+  test_inline_data();
+  test_inode_ids();
+  test_list_in_chunks();
+  test_list_while_changing();
+  test_list_colliding_names();
+  test_remove_dir();
+  test_rename_over();
+  test_long_paths();
+  test_concurrent_access();
+  test_durability();
   //test_root();
 }
 
+void
+test_log() {
+  char line[LOG_LINE_MAX];
+  FILE* out = tmpfile();
+  log_set_level(LOG_LEVEL_DEBUG);
+  assert(log_start(out) == 0);
+  log_trace("not logged %d", 1);
+  for (int i = 0; i < 10; ++i) {
+    log_debug("line %d", i);
+  }
+  log_stop();
+  log_set_level(LOG_LEVEL_WARN);
+  log_debug("not logged either");
+  rewind(out);
+  for (int i = 0; i < 10; ++i) {
+    char expected[32];
+    sprintf(expected, "line %d\n", i);
+    assert(fgets(line, sizeof(line), out) && strcmp(line, expected) == 0);
+  }
+  assert(!fgets(line, sizeof(line), out));
+  fclose(out);
+  assert(log_parse_level("trace") == LOG_LEVEL_TRACE);
+  assert(log_parse_level("loud") == -1);
+}
+
+void
+test_stats() {
+  static latency_histogram hist = {.name = "op"};
+  for (long ns = 1; ns <= 1000; ++ns) {
+    histogram_record(&hist, ns * 1000);
+  }
+  // Buckets are within 1/16th of what went in them
+  long p50 = histogram_percentile(&hist, 50);
+  assert(p50 >= 500000 && p50 < 500000 * 17 / 16);
+  long p99 = histogram_percentile(&hist, 99);
+  assert(p99 >= 990000 && p99 < 990000 * 17 / 16);
+  assert(histogram_percentile(&hist, 100) == 1000000);
+  histogram_record(&hist, 7);
+  assert(histogram_percentile(&hist, 0.01) == 7);
+
+  long before = statsCounters[STAT_BLOCKS_ALLOCATED];
+  assert(storage_format("test_fs", 2 * 1024 * 1024, 1024, 64) == 0);
+  assert(storage_init("test_fs") == 0);
+  char buf[4096];
+  memset(buf, 'x', sizeof(buf));
+  assert(get_new_inode("/big", S_IFREG | 0644, 0) >= 0);
+  assert(write_path("/big", buf, sizeof(buf), 0) == sizeof(buf));
+  assert(statsCounters[STAT_BLOCKS_ALLOCATED] >= before + 4);
+  unlink("test_fs");
+
+  char text[2048];
+  size_t len = stats_format(text, sizeof(text), &hist, 1);
+  assert(len == strlen(text));
+  assert(strstr(text, "blocks_allocated "));
+  assert(strstr(text, "op op count 1001 "));
+  // Too small a buffer just gets cut short
+  assert(stats_format(text, 16, &hist, 1) == 15);
+}
+
 int main() {
+  test_log();
+  test_stats();
   test_directory();
   test_parser();
   test_storage();